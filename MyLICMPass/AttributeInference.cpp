@@ -0,0 +1,202 @@
+#include "AttributeInference.h"
+#include "PassOutput.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/InstIterator.h"
+#if LLVM_VERSION_MAJOR >= 17
+#include "llvm/TargetParser/Triple.h"
+#else
+#include "llvm/ADT/Triple.h"
+#endif
+
+// Memory of an alloca whose address only reaches loads, stores and address
+// arithmetic is invisible to callers, so accessing it is no side effect.
+bool AttributeInference::isLocalMemory(Value *Ptr, Function &F)
+{
+    auto *AI = dyn_cast<AllocaInst>(getUnderlyingObject(Ptr));
+    if (AI == nullptr || AI->getFunction() != &F) {
+      return false;
+    }
+
+    SmallVector<Value *, 8> Worklist{AI};
+    SmallPtrSet<Value *, 8> Visited;
+    while (!Worklist.empty()) {
+      Value *V = Worklist.pop_back_val();
+      if (!Visited.insert(V).second) {
+        continue;
+      }
+
+      for (User *U : V->users()) {
+        if (auto *SI = dyn_cast<StoreInst>(U)) {
+          if (SI->getValueOperand() == V) {
+            return false;
+          }
+        }
+        else if (isa<GetElementPtrInst>(U) || isa<BitCastInst>(U)) {
+          Worklist.push_back(U);
+        }
+        else if (!isa<LoadInst>(U)) {
+          return false;
+        }
+      }
+    }
+
+    return true;
+}
+
+bool AttributeInference::inferLibraryFunction(Function &F, const TargetLibraryInfoImpl &TLI)
+{
+    LibFunc Func;
+    if (!TLI.getLibFunc(F, Func)) {
+      return false;
+    }
+
+    bool ReadNone = false;
+    switch (Func) {
+    case LibFunc_abs:
+    case LibFunc_labs:
+    case LibFunc_llabs:
+    case LibFunc_fabs:
+    case LibFunc_fabsf:
+    case LibFunc_floor:
+    case LibFunc_floorf:
+    case LibFunc_ceil:
+    case LibFunc_ceilf:
+    case LibFunc_trunc:
+    case LibFunc_round:
+    case LibFunc_fmin:
+    case LibFunc_fmax:
+    case LibFunc_copysign:
+      ReadNone = true;
+      break;
+    case LibFunc_strlen:
+    case LibFunc_strnlen:
+    case LibFunc_strcmp:
+    case LibFunc_strncmp:
+    case LibFunc_strchr:
+    case LibFunc_strrchr:
+    case LibFunc_strstr:
+    case LibFunc_strpbrk:
+    case LibFunc_strspn:
+    case LibFunc_strcspn:
+    case LibFunc_memcmp:
+    case LibFunc_memchr:
+      break;
+    default:
+      return false;
+    }
+
+    bool Changed = false;
+    if (ReadNone ? !F.doesNotAccessMemory() : !F.onlyReadsMemory()) {
+      ReadNone ? F.setDoesNotAccessMemory() : F.setOnlyReadsMemory();
+      Changed = true;
+    }
+    if (!F.doesNotThrow()) {
+      F.setDoesNotThrow();
+      Changed = true;
+    }
+    if (!F.willReturn()) {
+      F.setWillReturn();
+      Changed = true;
+    }
+
+    return Changed;
+}
+
+bool AttributeInference::inferFromBody(Function &F)
+{
+    bool ReadsMemory = false, WritesMemory = false, MayThrow = false;
+
+    // A loop may run forever, a body without one returns once its callees do.
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 4> Backedges;
+    FindFunctionBackedges(F, Backedges);
+    bool MayNotReturn = !Backedges.empty();
+
+    for (Instruction &I : instructions(F)) {
+      if (auto *Call = dyn_cast<CallBase>(&I)) {
+        MayThrow |= !Call->doesNotThrow();
+        MayNotReturn |= !Call->hasFnAttr(Attribute::WillReturn);
+        if (!Call->doesNotAccessMemory()) {
+          (Call->onlyReadsMemory() ? ReadsMemory : WritesMemory) = true;
+        }
+      }
+      else if (auto *LI = dyn_cast<LoadInst>(&I)) {
+        if (LI->isVolatile()) {
+          WritesMemory = true;
+        }
+        else if (!isLocalMemory(LI->getPointerOperand(), F)) {
+          ReadsMemory = true;
+        }
+      }
+      else if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        if (SI->isVolatile() || !isLocalMemory(SI->getPointerOperand(), F)) {
+          WritesMemory = true;
+        }
+      }
+      else if (I.mayWriteToMemory()) {
+        WritesMemory = true;
+      }
+      else if (I.mayReadFromMemory()) {
+        ReadsMemory = true;
+      }
+
+      MayThrow |= isa<ResumeInst>(I);
+    }
+
+    bool Changed = false;
+    if (!WritesMemory && !ReadsMemory && !F.doesNotAccessMemory()) {
+      // A function inferred readonly in an earlier round may turn out readnone.
+      F.removeFnAttr(Attribute::ReadOnly);
+      F.setDoesNotAccessMemory();
+      Changed = true;
+    }
+    else if (!WritesMemory && !F.onlyReadsMemory()) {
+      F.setOnlyReadsMemory();
+      Changed = true;
+    }
+    if (!MayThrow && !F.doesNotThrow()) {
+      F.setDoesNotThrow();
+      Changed = true;
+    }
+    if (!MayNotReturn && !F.willReturn()) {
+      F.setWillReturn();
+      Changed = true;
+    }
+
+    return Changed;
+}
+
+bool AttributeInference::runOnModule(Module &M) {
+    bool Changed = false, RoundChanged = true;
+    TargetLibraryInfoImpl TLI(Triple(M.getTargetTriple()));
+
+    for (Function &F : M) {
+      if (F.isDeclaration() && inferLibraryFunction(F, TLI)) {
+        passOutput() << "Inferred attributes of library function " << F.getName() << "\n";
+        Changed = true;
+      }
+    }
+
+    // Interposable definitions may be replaced by one with different effects.
+    while (RoundChanged) {
+      RoundChanged = false;
+      for (Function &F : M) {
+        if (!F.isDeclaration() && F.hasExactDefinition() && inferFromBody(F)) {
+          passOutput() << "Inferred attributes of " << F.getName() << "\n";
+          RoundChanged = true;
+        }
+      }
+      Changed |= RoundChanged;
+    }
+
+    return Changed;
+}
+
+char AttributeInference::ID = 0;
+static RegisterPass<AttributeInference> X("our-function-attrs", "Our function attribute inference pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,32 @@
+#ifndef LLVM_PROJECT_ATTRIBUTEINFERENCE_H
+#define LLVM_PROJECT_ATTRIBUTEINFERENCE_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// Infers readnone/readonly, nounwind and willreturn for the functions of a
+// module that lack them, so MyLICMPass can hoist calls to them. Known library
+// declarations (strlen, abs, ...) are recognized by name and prototype,
+// definitions are inferred from their bodies. Attributes only ever get added
+// once every callee already has them, so the iteration is repeated until
+// nothing changes and recursion is left alone.
+class AttributeInference : public ModulePass {
+private:
+  bool isLocalMemory(Value *Ptr, Function &F);
+  bool inferLibraryFunction(Function &F, const TargetLibraryInfoImpl &TLI);
+  bool inferFromBody(Function &F);
+
+public:
+  static char ID;
+  AttributeInference() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+};
+
+#endif // LLVM_PROJECT_ATTRIBUTEINFERENCE_H
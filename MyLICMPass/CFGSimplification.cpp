@@ -0,0 +1,231 @@
+#include "CFGSimplification.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include <vector>
+
+bool CFGSimplification::foldBranches(Function &F)
+{
+    std::vector<BranchInst *> Branches;
+    for (BasicBlock &BB : F) {
+      auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+      if (BI != nullptr && BI->isConditional() &&
+          (isa<ConstantInt>(BI->getCondition()) || BI->getSuccessor(0) == BI->getSuccessor(1))) {
+        Branches.push_back(BI);
+      }
+    }
+
+    for (BranchInst *BI : Branches) {
+      Value *Condition = BI->getCondition();
+      if (isa<ConstantInt>(Condition)) {
+        Folding.foldBranchInstruction(*BI);
+        continue;
+      }
+
+      // Both edges lead to the same block, whose PHIs have one entry per edge.
+      BasicBlock *BB = BI->getParent(), *Succ = BI->getSuccessor(0);
+      BranchInst::Create(Succ, BB);
+      Succ->removePredecessor(BB);
+      BI->eraseFromParent();
+      RecursivelyDeleteTriviallyDeadInstructions(Condition);
+    }
+    return !Branches.empty();
+}
+
+// Everything the block computes has to be dead on the threaded path: its PHIs
+// may only feed the block itself and the PHIs of its successors, its compare
+// only the branch.
+bool CFGSimplification::canThreadThrough(BasicBlock *BB)
+{
+    auto *BI = cast<BranchInst>(BB->getTerminator());
+    for (Instruction &I : *BB) {
+      if (&I == BI) {
+        continue;
+      }
+
+      bool IsCondition = &I == BI->getCondition() && isa<CmpInst>(&I);
+      if (!isa<PHINode>(&I) && !IsCondition) {
+        return false;
+      }
+
+      for (Use &U : I.uses()) {
+        auto *UserInst = cast<Instruction>(U.getUser());
+        if (UserInst->getParent() == BB) {
+          continue;
+        }
+
+        auto *PN = dyn_cast<PHINode>(UserInst);
+        if (IsCondition || PN == nullptr || PN->getIncomingBlock(U) != BB) {
+          return false;
+        }
+      }
+    }
+    return true;
+}
+
+// The condition is known when it is a PHI or a compare of PHIs that get
+// constants from the predecessor, or when the predecessor itself branched on
+// it to get here.
+ConstantInt *CFGSimplification::getKnownCondition(BranchInst *BI, BasicBlock *Pred)
+{
+    BasicBlock *BB = BI->getParent();
+    Value *Condition = BI->getCondition();
+    auto Resolve = [BB, Pred](Value *V) -> Constant * {
+      auto *PN = dyn_cast<PHINode>(V);
+      if (PN != nullptr && PN->getParent() == BB) {
+        V = PN->getIncomingValueForBlock(Pred);
+      }
+      return dyn_cast<Constant>(V);
+    };
+
+    auto *Cmp = dyn_cast<CmpInst>(Condition);
+    if (Cmp != nullptr && Cmp->getParent() == BB) {
+      Constant *Lhs = Resolve(Cmp->getOperand(0)), *Rhs = Resolve(Cmp->getOperand(1));
+      if (Lhs == nullptr || Rhs == nullptr) {
+        return nullptr;
+      }
+      const DataLayout &DL = BB->getModule()->getDataLayout();
+      return dyn_cast_or_null<ConstantInt>(ConstantFoldCompareInstOperands(Cmp->getPredicate(), Lhs, Rhs, DL));
+    }
+
+    auto *Inst = dyn_cast<Instruction>(Condition);
+    if (Inst != nullptr && Inst->getParent() == BB) {
+      return dyn_cast_or_null<ConstantInt>(Resolve(Condition));
+    }
+
+    auto *PredBranch = dyn_cast<BranchInst>(Pred->getTerminator());
+    if (PredBranch != nullptr && PredBranch->isConditional() && PredBranch->getCondition() == Condition &&
+        PredBranch->getSuccessor(0) != PredBranch->getSuccessor(1)) {
+      return ConstantInt::getBool(Condition->getContext(), PredBranch->getSuccessor(0) == BB);
+    }
+    return nullptr;
+}
+
+bool CFGSimplification::threadPredecessor(BasicBlock *BB, BasicBlock *Pred)
+{
+    auto *BI = cast<BranchInst>(BB->getTerminator());
+    auto *PredBranch = dyn_cast<BranchInst>(Pred->getTerminator());
+    if (Pred == BB || PredBranch == nullptr || count(successors(Pred), BB) != 1) {
+      return false;
+    }
+
+    ConstantInt *Known = getKnownCondition(BI, Pred);
+    if (Known == nullptr) {
+      return false;
+    }
+
+    // A block the predecessor already reaches would need two different entries for it in its PHIs.
+    BasicBlock *Target = BI->getSuccessor(Known->isOne() ? 0 : 1);
+    if (Target == BB || is_contained(successors(Pred), Target)) {
+      return false;
+    }
+
+    passOutput() << "Threading " << Pred->getName() << " through " << BB->getName() << " to " << Target->getName()
+           << "\n";
+    for (PHINode &PN : Target->phis()) {
+      Value *Incoming = PN.getIncomingValueForBlock(BB);
+      auto *Through = dyn_cast<PHINode>(Incoming);
+      if (Through != nullptr && Through->getParent() == BB) {
+        Incoming = Through->getIncomingValueForBlock(Pred);
+      }
+      PN.addIncoming(Incoming, Pred);
+    }
+
+    PredBranch->replaceSuccessorWith(BB, Target);
+    BB->removePredecessor(Pred);
+    return true;
+}
+
+bool CFGSimplification::threadJumps(Function &F)
+{
+    bool Changed = false;
+    DominatorTree DT(F);
+
+    std::vector<BasicBlock *> Blocks;
+    for (BasicBlock &BB : F) {
+      auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+      if (BI != nullptr && BI->isConditional() && BI->getSuccessor(0) != BI->getSuccessor(1)) {
+        Blocks.push_back(&BB);
+      }
+    }
+
+    for (BasicBlock *BB : Blocks) {
+      // Threading the entry of a loop past its header would give the loop a second entry.
+      SmallVector<BasicBlock *, 8> Preds(predecessors(BB));
+      if (any_of(Preds, [&DT, BB](BasicBlock *Pred) { return DT.dominates(BB, Pred); }) ||
+          !canThreadThrough(BB)) {
+        continue;
+      }
+
+      bool Threaded = false;
+      for (BasicBlock *Pred : Preds) {
+        Threaded |= threadPredecessor(BB, Pred);
+      }
+
+      if (Threaded) {
+        DT.recalculate(F);
+        Changed = true;
+      }
+    }
+    return Changed;
+}
+
+bool CFGSimplification::forwardEmptyBlocks(Function &F)
+{
+    std::vector<BasicBlock *> Empty;
+    for (BasicBlock &BB : F) {
+      auto *BI = dyn_cast<BranchInst>(BB.getTerminator());
+      if (&BB != &F.getEntryBlock() && BI != nullptr && BI->isUnconditional() && BI->getSuccessor(0) != &BB &&
+          BB.getFirstNonPHIOrDbg() == BI) {
+        Empty.push_back(&BB);
+      }
+    }
+
+    // Declines when the predecessors would need different values in a PHI of the successor.
+    bool Changed = false;
+    for (BasicBlock *BB : Empty) {
+      Changed |= TryToSimplifyUncondBranchFromEmptyBlock(BB);
+    }
+    return Changed;
+}
+
+bool CFGSimplification::mergeBlocks(Function &F)
+{
+    std::vector<BasicBlock *> Blocks;
+    for (BasicBlock &BB : F) {
+      BasicBlock *Pred = BB.getSinglePredecessor();
+      if (Pred != nullptr && Pred != &BB && Pred->getSingleSuccessor() == &BB) {
+        Blocks.push_back(&BB);
+      }
+    }
+
+    bool Changed = false;
+    for (BasicBlock *BB : Blocks) {
+      Changed |= MergeBlockIntoPredecessor(BB);
+    }
+    return Changed;
+}
+
+bool CFGSimplification::runOnFunction(Function &F)
+{
+    bool Changed = false;
+    bool Simplified = true;
+    while (Simplified) {
+      Simplified = Elimination.removeUnreachableBlocks(F);
+      Simplified |= foldBranches(F);
+      Simplified |= threadJumps(F);
+      Simplified |= forwardEmptyBlocks(F);
+      Simplified |= mergeBlocks(F);
+      Changed |= Simplified;
+    }
+    return Changed;
+}
+
+char CFGSimplification::ID = 0;
+static RegisterPass<CFGSimplification> X("our-simplifycfg", "Our CFG simplification pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,44 @@
+#ifndef LLVM_PROJECT_CFGSIMPLIFICATION_H
+#define LLVM_PROJECT_CFGSIMPLIFICATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "ConstantFolding.h"
+#include "DeadCodeElimination.h"
+
+using namespace llvm;
+
+// Control flow cleanup after branches were folded, loops unswitched or
+// unrolled. Until nothing changes, unreachable blocks are removed, branches
+// on constants or to one successor become unconditional, a predecessor whose
+// outcome in a block's branch is already known jumps straight to the
+// successor it would take, blocks holding nothing but a jump are bypassed
+// and a block is merged into its only predecessor when it is that block's
+// only successor. Jumps are only threaded through blocks that compute
+// nothing besides PHIs and the compare they branch on, so no code is
+// duplicated, and never through loop headers.
+class CFGSimplification : public FunctionPass {
+private:
+  ConstantFolding Folding;
+  DeadCodeElimination Elimination;
+
+  bool foldBranches(Function &F);
+  bool canThreadThrough(BasicBlock *BB);
+  ConstantInt *getKnownCondition(BranchInst *BI, BasicBlock *Pred);
+  bool threadPredecessor(BasicBlock *BB, BasicBlock *Pred);
+  bool threadJumps(Function &F);
+  bool forwardEmptyBlocks(Function &F);
+  bool mergeBlocks(Function &F);
+
+public:
+  static char ID;
+  CFGSimplification() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override;
+};
+
+#endif // LLVM_PROJECT_CFGSIMPLIFICATION_H
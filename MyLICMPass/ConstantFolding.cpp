@@ -1,84 +1,215 @@
 #include "ConstantFolding.h"
 
+// Computed in the width of the operands. Division by zero, the overflowing signed division and shifts by
+// the width or more are undefined and may sit on a path that is never taken, e.g. in a copy of an unrolled
+// loop body, so they stay.
 bool ConstantFolding::handleBinaryOperator(Instruction &I)
 {
-    Value *Lhs = I.getOperand(0), *Rhs = I.getOperand(1);
-    ConstantInt *LhsValue, *RhsValue;
-    int Value;
-
-    if (!(LhsValue = dyn_cast<ConstantInt>(Lhs))) {
+    ConstantInt *LhsValue = dyn_cast<ConstantInt>(I.getOperand(0));
+    ConstantInt *RhsValue = dyn_cast<ConstantInt>(I.getOperand(1));
+    if (LhsValue == nullptr || RhsValue == nullptr) {
       return false;
     }
 
-    if (!(RhsValue = dyn_cast<ConstantInt>(Rhs))) {
+    const APInt &Lhs = LhsValue->getValue(), &Rhs = RhsValue->getValue();
+    unsigned Opcode = I.getOpcode();
+    APInt Value;
+
+    if ((Opcode == Instruction::SDiv || Opcode == Instruction::UDiv || Opcode == Instruction::SRem ||
+         Opcode == Instruction::URem) && Rhs.isZero()) {
+      return false;
+    }
+    if ((Opcode == Instruction::SDiv || Opcode == Instruction::SRem) && Lhs.isMinSignedValue() && Rhs.isAllOnes()) {
+      return false;
+    }
+    if ((Opcode == Instruction::Shl || Opcode == Instruction::LShr || Opcode == Instruction::AShr) &&
+        Rhs.uge(Lhs.getBitWidth())) {
       return false;
     }
 
-    if (isa<AddOperator>(&I)) {
-      Value = LhsValue->getSExtValue() + RhsValue->getSExtValue();
+    if (Opcode == Instruction::Add) {
+      Value = Lhs + Rhs;
     }
-    else if (isa<SubOperator>(&I)) {
-      Value = LhsValue->getSExtValue() - RhsValue->getSExtValue();
+    else if (Opcode == Instruction::Sub) {
+      Value = Lhs - Rhs;
     }
-    else if (isa<MulOperator>(&I)) {
-      Value = LhsValue->getSExtValue() * RhsValue->getSExtValue();
+    else if (Opcode == Instruction::Mul) {
+      Value = Lhs * Rhs;
     }
-    else if (isa<SDivOperator>(&I)) {
-      if (RhsValue->getSExtValue() == 0) {
-        errs() << "Division by zero not allowed!\n";
-        exit(1);
-      }
-
-      Value = LhsValue->getSExtValue() / RhsValue->getSExtValue();
+    else if (Opcode == Instruction::SDiv) {
+      Value = Lhs.sdiv(Rhs);
+    }
+    else if (Opcode == Instruction::UDiv) {
+      Value = Lhs.udiv(Rhs);
+    }
+    else if (Opcode == Instruction::SRem) {
+      Value = Lhs.srem(Rhs);
+    }
+    else if (Opcode == Instruction::URem) {
+      Value = Lhs.urem(Rhs);
+    }
+    else if (Opcode == Instruction::Shl) {
+      Value = Lhs.shl(Rhs);
+    }
+    else if (Opcode == Instruction::LShr) {
+      Value = Lhs.lshr(Rhs);
+    }
+    else if (Opcode == Instruction::AShr) {
+      Value = Lhs.ashr(Rhs);
+    }
+    else if (Opcode == Instruction::And) {
+      Value = Lhs & Rhs;
+    }
+    else if (Opcode == Instruction::Or) {
+      Value = Lhs | Rhs;
+    }
+    else if (Opcode == Instruction::Xor) {
+      Value = Lhs ^ Rhs;
     }
     else {
-        return false;
+      return false;
     }
 
-    I.replaceAllUsesWith(ConstantInt::get(Type::getInt32Ty(I.getContext()), Value));
+    I.replaceAllUsesWith(ConstantInt::get(I.getType(), Value));
     return true;
 }
 
 bool ConstantFolding::handleCompareInstruction(Instruction &I)
 {
-    Value *Lhs = I.getOperand(0), *Rhs = I.getOperand(1);
-    ConstantInt *LhsValue, *RhsValue;
-    bool Value;
+    ConstantInt *LhsValue = dyn_cast<ConstantInt>(I.getOperand(0));
+    ConstantInt *RhsValue = dyn_cast<ConstantInt>(I.getOperand(1));
+    if (LhsValue == nullptr || RhsValue == nullptr) {
+      return false;
+    }
 
-    if (!(LhsValue = dyn_cast<ConstantInt>(Lhs))) {
+    bool Value = ICmpInst::compare(LhsValue->getValue(), RhsValue->getValue(), cast<ICmpInst>(&I)->getPredicate());
+    I.replaceAllUsesWith(ConstantInt::get(Type::getInt1Ty(I.getContext()), Value));
+    return true;
+}
+
+// A function that flushes subnormals computes something else with them than the default environment does.
+bool ConstantFolding::isFoldableFloat(Instruction &I, const APFloat &Value)
+{
+    return !Value.isDenormal() || I.getFunction()->getDenormalMode(Value.getSemantics()) == DenormalMode::getIEEE();
+}
+
+// Rounded to nearest, ties to even, in the format of the operands, as the default floating point environment does.
+// Fast-math flags only allow results the folded value is one of, so they do not stop folding.
+bool ConstantFolding::handleFloatingPointOperator(Instruction &I)
+{
+    ConstantFP *LhsValue = dyn_cast<ConstantFP>(I.getOperand(0));
+    if (LhsValue == nullptr || !isFoldableFloat(I, LhsValue->getValueAPF())) {
       return false;
     }
 
-    if (!(RhsValue = dyn_cast<ConstantInt>(Rhs))) {
+    APFloat Value = LhsValue->getValueAPF();
+
+    if (I.getOpcode() == Instruction::FNeg) {
+      Value.changeSign();
+      I.replaceAllUsesWith(ConstantFP::get(I.getContext(), Value));
+      return true;
+    }
+
+    ConstantFP *RhsValue = dyn_cast<ConstantFP>(I.getOperand(1));
+    if (RhsValue == nullptr || !isFoldableFloat(I, RhsValue->getValueAPF())) {
       return false;
     }
 
-    ICmpInst *Cmp = dyn_cast<ICmpInst>(&I);
-    auto Pred = Cmp->getSignedPredicate();
+    const APFloat &Rhs = RhsValue->getValueAPF();
 
-    if (Pred == ICmpInst::ICMP_EQ) {
-      Value = LhsValue == RhsValue;
+    if (I.getOpcode() == Instruction::FAdd) {
+      Value.add(Rhs, APFloat::rmNearestTiesToEven);
     }
-    else if (Pred == ICmpInst::ICMP_NE) {
-      Value = LhsValue != RhsValue;
+    else if (I.getOpcode() == Instruction::FSub) {
+      Value.subtract(Rhs, APFloat::rmNearestTiesToEven);
     }
-    else if (Pred == ICmpInst::ICMP_SGT) {
-      Value = LhsValue > RhsValue;
+    else if (I.getOpcode() == Instruction::FMul) {
+      Value.multiply(Rhs, APFloat::rmNearestTiesToEven);
     }
-    else if (Pred == ICmpInst::ICMP_SLT) {
-      Value = LhsValue < RhsValue;
+    else if (I.getOpcode() == Instruction::FDiv) {
+      Value.divide(Rhs, APFloat::rmNearestTiesToEven);
     }
-    else if (Pred == ICmpInst::ICMP_SGE) {
-      Value = LhsValue >= RhsValue;
+    else if (I.getOpcode() == Instruction::FRem) {
+      Value.mod(Rhs);
     }
-    else if (Pred == ICmpInst::ICMP_SLE) {
-      Value = LhsValue <= RhsValue;
+    else {
+      return false;
+    }
+
+    if (!isFoldableFloat(I, Value)) {
+      return false;
     }
 
+    I.replaceAllUsesWith(ConstantFP::get(I.getContext(), Value));
+    return true;
+}
+
+bool ConstantFolding::handleFloatingPointCompare(Instruction &I)
+{
+    ConstantFP *LhsValue = dyn_cast<ConstantFP>(I.getOperand(0));
+    ConstantFP *RhsValue = dyn_cast<ConstantFP>(I.getOperand(1));
+    if (LhsValue == nullptr || RhsValue == nullptr || !isFoldableFloat(I, LhsValue->getValueAPF()) ||
+        !isFoldableFloat(I, RhsValue->getValueAPF())) {
+      return false;
+    }
+
+    // Every predicate is the set of outcomes it accepts: ordered equal, greater, less and unordered.
+    APFloat::cmpResult Result = LhsValue->getValueAPF().compare(RhsValue->getValueAPF());
+    unsigned Outcome;
+
+    if (Result == APFloat::cmpEqual) {
+      Outcome = FCmpInst::FCMP_OEQ;
+    }
+    else if (Result == APFloat::cmpGreaterThan) {
+      Outcome = FCmpInst::FCMP_OGT;
+    }
+    else if (Result == APFloat::cmpLessThan) {
+      Outcome = FCmpInst::FCMP_OLT;
+    }
+    else {
+      Outcome = FCmpInst::FCMP_UNO;
+    }
+
+    bool Value = (cast<FCmpInst>(&I)->getPredicate() & Outcome) != 0;
     I.replaceAllUsesWith(ConstantInt::get(Type::getInt1Ty(I.getContext()), Value));
     return true;
 }
 
+// Conversions to floating point round like the arithmetic, the ones back to integers are poison out of range and stay.
+bool ConstantFolding::handleFloatingPointCast(Instruction &I)
+{
+    const fltSemantics &Semantics = I.getType()->getFltSemantics();
+    APFloat Value(Semantics);
+    bool LosesInfo;
+
+    if (auto *Float = dyn_cast<ConstantFP>(I.getOperand(0))) {
+      if ((I.getOpcode() != Instruction::FPExt && I.getOpcode() != Instruction::FPTrunc) ||
+          !isFoldableFloat(I, Float->getValueAPF())) {
+        return false;
+      }
+
+      Value = Float->getValueAPF();
+      Value.convert(Semantics, APFloat::rmNearestTiesToEven, &LosesInfo);
+    }
+    else if (auto *Int = dyn_cast<ConstantInt>(I.getOperand(0))) {
+      if (I.getOpcode() != Instruction::SIToFP && I.getOpcode() != Instruction::UIToFP) {
+        return false;
+      }
+
+      Value.convertFromAPInt(Int->getValue(), I.getOpcode() == Instruction::SIToFP, APFloat::rmNearestTiesToEven);
+    }
+    else {
+      return false;
+    }
+
+    if (!isFoldableFloat(I, Value)) {
+      return false;
+    }
+
+    I.replaceAllUsesWith(ConstantFP::get(I.getContext(), Value));
+    return true;
+}
+
 bool ConstantFolding::handleBranchInstruction(Instruction &I)
 {
     BranchInst *BranchInstr = dyn_cast<BranchInst>(&I);
@@ -90,12 +221,13 @@ bool ConstantFolding::handleBranchInstruction(Instruction &I)
         return false;
       }
 
-      if (Condition->getZExtValue() == 1) {
-        BranchInst::Create(BranchInstr->getSuccessor(0),
-                           BranchInstr->getParent());
-      } else {
-        BranchInst::Create(BranchInstr->getSuccessor(1),
-                           BranchInstr->getParent());
+      BasicBlock *Taken = BranchInstr->getSuccessor(Condition->isOne() ? 0 : 1);
+      BasicBlock *NotTaken = BranchInstr->getSuccessor(Condition->isOne() ? 1 : 0);
+      BranchInst::Create(Taken, BranchInstr->getParent());
+
+      // The PHIs of the successor that is no longer reached from here lose their entry for this block.
+      if (NotTaken != Taken) {
+        NotTaken->removePredecessor(BranchInstr->getParent());
       }
 
       InstructionsToRemove.push_back(&I);
@@ -108,11 +240,22 @@ bool ConstantFolding::handleBranchInstruction(Instruction &I)
 bool ConstantFolding::iterateInstructions(Function &F)
 {
     bool Changed = false;
+    InstructionsToRemove.clear();
+
     for (BasicBlock &BB : F) {
       for (Instruction &I : BB) {
-        if (isa<BinaryOperator>(&I)) {
+        if ((isa<BinaryOperator>(&I) || isa<UnaryOperator>(&I)) && I.getType()->isFloatingPointTy()) {
+          Changed |= handleFloatingPointOperator(I);
+        }
+        else if (isa<BinaryOperator>(&I)) {
           Changed |= handleBinaryOperator(I);
         }
+        else if (isa<CastInst>(&I) && I.getType()->isFloatingPointTy()) {
+          Changed |= handleFloatingPointCast(I);
+        }
+        else if (isa<FCmpInst>(&I)) {
+          Changed |= handleFloatingPointCompare(I);
+        }
         else if (isa<ICmpInst>(&I)) {
           Changed |= handleCompareInstruction(I);
         }
@@ -129,6 +272,20 @@ bool ConstantFolding::iterateInstructions(Function &F)
     return Changed;
 }
 
+// Folds a single branch outside of a full run, the replaced branch is erased right away.
+bool ConstantFolding::foldBranchInstruction(Instruction &I)
+{
+    InstructionsToRemove.clear();
+    bool Folded = handleBranchInstruction(I);
+
+    for (Instruction *Instr : InstructionsToRemove) {
+      Instr->eraseFromParent();
+    }
+
+    InstructionsToRemove.clear();
+    return Folded;
+}
+
 bool ConstantFolding::runOnFunction(Function &F) {
     return iterateInstructions(F);
 }
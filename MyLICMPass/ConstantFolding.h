@@ -7,6 +7,8 @@
 #include "llvm/IR/Operator.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/ADT/APFloat.h"
 
 #include<vector>
 
@@ -18,6 +20,10 @@ private:
 
   bool handleBinaryOperator(Instruction &I);
   bool handleCompareInstruction(Instruction &I);
+  bool isFoldableFloat(Instruction &I, const APFloat &Value);
+  bool handleFloatingPointOperator(Instruction &I);
+  bool handleFloatingPointCompare(Instruction &I);
+  bool handleFloatingPointCast(Instruction &I);
   bool handleBranchInstruction(Instruction &I);
   bool iterateInstructions(Function &F);
 
@@ -26,6 +32,7 @@ public:
   ConstantFolding() : FunctionPass(ID) {}
 
   bool runOnFunction(Function &F) override;
+  bool foldBranchInstruction(Instruction &I);
 };
 
 #endif // LLVM_PROJECT_CONSTANTFOLDING_H
\ No newline at end of file
@@ -1,35 +1,52 @@
 #include "ConstantPropagation.h"
+#include "PassOutput.h"
+
+#include "llvm/Support/CommandLine.h"
+
+static cl::opt<bool> UseRanges("cp-use-ranges", cl::init(false),
+                               cl::desc("Also propagate value ranges and fold the compares they decide"));
+
+static cl::opt<bool> ForwardStores("cp-forward-stores", cl::init(false),
+                                   cl::desc("Also forward stored values that are not constants to the loads they reach"));
 
 void ConstantPropagation::findAllInstructions(Function &F)
 {
-    errs() << "Finding instructions\n";
+    passOutput() << "Finding instructions\n";
+    DenseMap<Instruction *, ConstantPropagationInstruction *> InstructionMap;
+
     for (BasicBlock &BB : F) {
       for (Instruction &I : BB) {
-        ConstantPropagationInstruction *CPI = new ConstantPropagationInstruction(&I, Variables);
+        unsigned MaxPredecessors = I.getPrevNonDebugInstruction() == nullptr ? pred_size(&BB) : 1;
+        ConstantPropagationInstruction *CPI = new (Allocator.Allocate<ConstantPropagationInstruction>())
+            ConstantPropagationInstruction(&I, VariableIndices, MaxPredecessors, Allocator);
         Instructions.push_back(CPI);
+        InstructionMap[&I] = CPI;
+      }
+    }
 
-        Instruction *Previous = I.getPrevNonDebugInstruction();
+    // Predecessors are linked in a second pass so that terminators of blocks
+    // laid out after their successors (loop latches) are already known.
+    for (ConstantPropagationInstruction *CPI : Instructions) {
+      Instruction *I = CPI->getInstruction();
 
-        if (Previous == nullptr) {
-          for (BasicBlock *Pred : predecessors(&BB)) {
-            Instruction *Terminator = Pred->getTerminator();
-            CPI->addPredecessor(*std::find_if(Instructions.begin(), Instructions.end(),
-            [Terminator](ConstantPropagationInstruction *CPI){ return CPI->getInstruction() == Terminator; }));
-          }
-        }
-        else {
-          CPI->addPredecessor(Instructions[Instructions.size() - 2]);
+      if (I->getPrevNonDebugInstruction() == nullptr) {
+        for (BasicBlock *Pred : predecessors(I->getParent())) {
+          CPI->addPredecessor(InstructionMap[Pred->getTerminator()]);
         }
       }
+      else {
+        CPI->addPredecessor(InstructionMap[I->getPrevNode()]);
+      }
     }
 }
 
 void ConstantPropagation::findAllVariables(Function &F)
 {
-    errs() << "Finding variables\n";
+    passOutput() << "Finding variables\n";
     for (BasicBlock &BB : F) {
       for (Instruction &I : BB) {
         if (isa<AllocaInst>(&I)) {
+          VariableIndices[&I] = Variables.size();
           Variables.push_back(&I);
         }
       }
@@ -38,7 +55,7 @@ void ConstantPropagation::findAllVariables(Function &F)
 
 void ConstantPropagation::setStatusForFirstInstruction()
 {
-    errs() << "Setting status\n";
+    passOutput() << "Setting status\n";
     for (Value *Variable : Variables) {
       Instructions.front()->setStatusBefore(Variable, Top);
     }
@@ -47,7 +64,7 @@ void ConstantPropagation::setStatusForFirstInstruction()
 void ConstantPropagation::propagateVariable(Value *Variable)
 {
 
-    errs() << "RULES!\n";
+    passOutput() << "RULES!\n";
 
     bool RuleApplied;
 
@@ -56,16 +73,16 @@ void ConstantPropagation::propagateVariable(Value *Variable)
 
       for (ConstantPropagationInstruction *CPI : Instructions) {
         if (!checkRuleOne(CPI, Variable)) {
-          errs() << "RULE1\n";
+          passOutput() << "RULE1\n";
           applyRuleOne(CPI, Variable);
           RuleApplied = true;
         } else if (!checkRuleTwo(CPI, Variable)) {
-          errs() << "RULE2\n";
+          passOutput() << "RULE2\n";
           applyRuleTwo(CPI, Variable);
           RuleApplied = true;
         } else if (!checkRuleThree(CPI, Variable)) {
-          errs() << "RULE3\n";
-          int Value;
+          passOutput() << "RULE3\n";
+          Constant *Value = nullptr;
           bool reached = false;
           for (ConstantPropagationInstruction *Predecessor :
                CPI->getPredecessors()) {
@@ -78,25 +95,23 @@ void ConstantPropagation::propagateVariable(Value *Variable)
           applyRuleThree(CPI, Variable, Value);
           RuleApplied = true;
         } else if (!checkRuleFour(CPI, Variable)) {
-          errs() << "RULE4\n";
+          passOutput() << "RULE4\n";
           applyRuleFour(CPI, Variable);
           RuleApplied = true;
         } else if (!checkRuleFive(CPI, Variable)) {
-          errs() << "RULE5\n";
+          passOutput() << "RULE5\n";
           applyRuleFive(CPI, Variable);
           RuleApplied = true;
         } else if (!checkRuleSix(CPI, Variable)) {
-          errs() << "RULE6\n";
-          ConstantInt *ConstInt =
-              dyn_cast<ConstantInt>(CPI->getInstruction()->getOperand(0));
-          applyRuleSix(CPI, Variable, ConstInt->getSExtValue());
+          passOutput() << "RULE6\n";
+          applyRuleSix(CPI, Variable, getTrackedConstant(CPI->getInstruction()->getOperand(0)));
           RuleApplied = true;
         } else if (!checkRuleSeven(CPI, Variable)) {
-          errs() << "RULE7\n";
+          passOutput() << "RULE7\n";
           applyRuleSeven(CPI, Variable);
           RuleApplied = true;
         } else if (!checkRuleEight(CPI, Variable)) {
-          errs() << "RULE8\n";
+          passOutput() << "RULE8\n";
           applyRuleEight(CPI, Variable);
           RuleApplied = true;
         }
@@ -115,12 +130,28 @@ void ConstantPropagation::runAlgorithm()
     }
 }
 
+// A load is only replaced by a constant of its own type, memory may be read as another type than it was written.
+bool ConstantPropagation::replaceWithConstant(ConstantPropagationInstruction *CPI, Value *Operand, Value *Variable)
+{
+    if (Variable == nullptr || CPI->getStatusBefore(Variable) != Const) {
+      return false;
+    }
+
+    Constant *Value = CPI->getValueBefore(Variable);
+    if (Value->getType() != Operand->getType()) {
+      return false;
+    }
+
+    Operand->replaceAllUsesWith(Value);
+    return true;
+}
+
 bool ConstantPropagation::modifyIR()
 {
     bool Changed = false;
     std::unordered_map<Value *, Value *> VariablesMap;
 
-    errs() << "PROPAGATION MODIFYING IR\n";
+    passOutput() << "PROPAGATION MODIFYING IR\n";
 
     for (ConstantPropagationInstruction *CPI : Instructions) {
       if (isa<LoadInst> (CPI->getInstruction())) {
@@ -133,38 +164,12 @@ bool ConstantPropagation::modifyIR()
 
       if (isa<StoreInst>(Instr)) {
         Value *Operand = Instr->getOperand(0);
-        if (CPI->getStatusBefore(VariablesMap[Operand]) == Const) {
-          int Value = CPI->getValueBefore(VariablesMap[Operand]);
-          ConstantInt *ConstInt = ConstantInt::get(Type::getInt32Ty(Instr->getContext()), Value);
-          Operand->replaceAllUsesWith(ConstInt);
-          Changed = true;
-        }
+        Changed |= replaceWithConstant(CPI, Operand, VariablesMap[Operand]);
       }
-      else if (isa<BinaryOperator>(Instr) || isa<ICmpInst>(Instr)) {
-        Value *Lhs = Instr->getOperand(0), *Rhs = Instr->getOperand(1);
-        Value *VarLHS = VariablesMap[Lhs], *VarRHS = VariablesMap[Rhs];
-
-        if (VarLHS != nullptr && CPI->getStatusBefore(VarLHS) == Const) {
-          Lhs->replaceAllUsesWith(ConstantInt::get(Type::getInt32Ty(Instr->getContext()), CPI->getValueBefore(VarLHS)));
-          Changed = true;
-        }
-
-        if (VarRHS != nullptr && CPI->getStatusBefore(VarRHS) == Const) {
-          Rhs->replaceAllUsesWith(ConstantInt::get(Type::getInt32Ty(Instr->getContext()), CPI->getValueBefore(VarRHS)));
-          Changed = true;
-        }
-      }
-      else if (isa<CallInst>(Instr)){
-        Value *Operand, *VarOperand;
-
-        for (size_t i = 0;i < Instr->getNumOperands(); i++) {
-          Operand = Instr->getOperand(i);
-          VarOperand = VariablesMap[Operand];
-
-          if (VarOperand != nullptr && CPI->getStatusBefore(VarOperand) == Const) {
-            Operand->replaceAllUsesWith(ConstantInt::get(Type::getInt32Ty(Instr->getContext()), CPI->getValueBefore(VarOperand)));
-            Changed = true;
-          }
+      else if (isa<BinaryOperator>(Instr) || isa<UnaryOperator>(Instr) || isa<CmpInst>(Instr) ||
+               isa<CallInst>(Instr) || (isa<ReturnInst>(Instr) && Instr->getNumOperands() == 1)) {
+        for (Value *Operand : Instr->operands()) {
+          Changed |= replaceWithConstant(CPI, Operand, VariablesMap[Operand]);
         }
       }
     }
@@ -174,12 +179,23 @@ bool ConstantPropagation::modifyIR()
 
 bool ConstantPropagation::runOnFunction(Function &F) {
     Variables.clear();
+    VariableIndices.clear();
     Instructions.clear();
+    Allocator.Reset();
     findAllVariables(F);
     findAllInstructions(F);
     setStatusForFirstInstruction();
     runAlgorithm();
-    return modifyIR();
+
+    bool Changed = modifyIR();
+    if (UseRanges) {
+      Changed |= Ranges.runOnFunction(F);
+    }
+    if (ForwardStores) {
+      Changed |= Forwarding.runOnFunction(F);
+    }
+
+    return Changed;
 }
 
 char ConstantPropagation::ID = 0;
@@ -8,18 +8,36 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Operator.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/Allocator.h"
 
 #include <vector>
-#include <unordered_set>
+#include <unordered_map>
 
 #include "ConstantPropagationInstruction.h"
+#include "RangePropagation.h"
+#include "StoreForwarding.h"
 
 using namespace llvm;
 
 class ConstantPropagation : public FunctionPass {
 private:
   std::vector<Value *> Variables;
+  DenseMap<Value *, unsigned> VariableIndices;
   std::vector<ConstantPropagationInstruction *> Instructions;
+  // Per-function arena for the analysis state, reset at the start of every run.
+  BumpPtrAllocator Allocator;
+  // Optional interval lattice run after the constant one (-cp-use-ranges).
+  RangePropagation Ranges;
+  // Optional forwarding of non-constant stores, which rule seven only sends to Top (-cp-forward-stores).
+  StoreForwarding Forwarding;
+
+  // Integer and floating point scalars are the values the lattice holds.
+  static Constant *getTrackedConstant(Value *V)
+  {
+    return isa<ConstantInt>(V) || isa<ConstantFP>(V) ? cast<Constant>(V) : nullptr;
+  }
 
   void findAllInstructions(Function &F);
   void findAllVariables(Function &F);
@@ -42,7 +60,7 @@ private:
 
   bool checkRuleTwo(ConstantPropagationInstruction *CPI, Value *Variable)
   {
-    std::unordered_set<int> Values;
+    SmallPtrSet<Constant *, 4> Values;
 
     for (ConstantPropagationInstruction *Predecessor : CPI->getPredecessors()) {
       if (Predecessor->getStatusAfter(Variable) == Const) {
@@ -64,7 +82,7 @@ private:
 
   bool checkRuleThree(ConstantPropagationInstruction *CPI, Value *Variable)
   {
-    std::unordered_set<int> Values;
+    SmallPtrSet<Constant *, 4> Values;
 
     for (ConstantPropagationInstruction *Predecessor : CPI->getPredecessors()) {
       if (Predecessor->getStatusAfter(Variable) == Const) {
@@ -83,7 +101,7 @@ private:
     return true;
   }
 
-  void applyRuleThree(ConstantPropagationInstruction *CPI, Value *Variable, int Value)
+  void applyRuleThree(ConstantPropagationInstruction *CPI, Value *Variable, Constant *Value)
   {
     CPI->setStatusBefore(Variable, Const, Value);
   }
@@ -127,15 +145,15 @@ private:
   {
     Instruction *Instr = CPI->getInstruction();
     if (isa<StoreInst>(Instr) && Instr->getOperand(1) == Variable) {
-      if (ConstantInt *ConstInt = dyn_cast<ConstantInt>(Instr->getOperand(0))) {
-        return CPI->getStatusAfter(Variable) == Const && CPI->getValueAfter(Variable) == ConstInt->getSExtValue();
+      if (Constant *Stored = getTrackedConstant(Instr->getOperand(0))) {
+        return CPI->getStatusAfter(Variable) == Const && CPI->getValueAfter(Variable) == Stored;
       }
     }
 
     return true;
   }
 
-  void applyRuleSix(ConstantPropagationInstruction *CPI, Value *Variable, int Value)
+  void applyRuleSix(ConstantPropagationInstruction *CPI, Value *Variable, Constant *Value)
   {
     CPI->setStatusAfter(Variable, Const, Value);
   }
@@ -143,7 +161,7 @@ private:
   bool checkRuleSeven(ConstantPropagationInstruction *CPI, Value *Variable)
   {
     Instruction *Instr = CPI->getInstruction();
-    if (isa<StoreInst>(Instr) && Instr->getOperand(1) == Variable && !isa<ConstantInt>(Instr->getOperand(0))) {
+    if (isa<StoreInst>(Instr) && Instr->getOperand(1) == Variable && getTrackedConstant(Instr->getOperand(0)) == nullptr) {
       return CPI->getStatusAfter(Variable) == Top;
     }
 
@@ -171,6 +189,7 @@ private:
   
   void propagateVariable(Value *Variable);
   void runAlgorithm();
+  bool replaceWithConstant(ConstantPropagationInstruction *CPI, Value *Operand, Value *Variable);
   bool modifyIR();
 
 public:
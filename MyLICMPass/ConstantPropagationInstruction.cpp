@@ -5,48 +5,80 @@
 #include "ConstantPropagationInstruction.h"
 
 ConstantPropagationInstruction::ConstantPropagationInstruction(llvm::Instruction *Instr,
-                                                               const std::vector<Value *> &Variables)
+                                                               const DenseMap<Value *, unsigned> &VariableIndices,
+                                                               unsigned MaxPredecessors,
+                                                               BumpPtrAllocator &Allocator)
 {
   this->Instr = Instr;
-  for (Value *Variable : Variables) {
-    setStatusBefore(Variable, Bottom);
-    setStatusAfter(Variable, Bottom);
+  this->VariableIndices = &VariableIndices;
+  this->NumPredecessors = 0;
+  this->MaxPredecessors = MaxPredecessors;
+
+  unsigned NumVariables = VariableIndices.size();
+  StatusBefore = Allocator.Allocate<std::pair<Status, Constant *>>(NumVariables);
+  StatusAfter = Allocator.Allocate<std::pair<Status, Constant *>>(NumVariables);
+  Predecessors = Allocator.Allocate<ConstantPropagationInstruction *>(MaxPredecessors);
+
+  for (unsigned i = 0; i < NumVariables; i++) {
+    StatusBefore[i] = {Bottom, nullptr};
+    StatusAfter[i] = {Bottom, nullptr};
   }
 }
 
-void ConstantPropagationInstruction::setStatusAfter(llvm::Value *Variable, Status S, int value)
+std::pair<Status, Constant *> *ConstantPropagationInstruction::find(std::pair<Status, Constant *> *Statuses,
+                                                             llvm::Value *Variable)
 {
-  StatusAfter[Variable] = {S, value};
+  auto It = VariableIndices->find(Variable);
+  if (It == VariableIndices->end()) {
+    return nullptr;
+  }
+
+  return &Statuses[It->second];
 }
 
-void ConstantPropagationInstruction::setStatusBefore(llvm::Value *Variable, Status S, int value)
+void ConstantPropagationInstruction::setStatusAfter(llvm::Value *Variable, Status S, Constant *value)
 {
-  StatusBefore[Variable] = {S, value};
+  if (std::pair<Status, Constant *> *Entry = find(StatusAfter, Variable)) {
+    *Entry = {S, value};
+  }
+}
+
+void ConstantPropagationInstruction::setStatusBefore(llvm::Value *Variable, Status S, Constant *value)
+{
+  if (std::pair<Status, Constant *> *Entry = find(StatusBefore, Variable)) {
+    *Entry = {S, value};
+  }
 }
 
+// Values that are not tracked variables are treated as unknown (Top).
 Status ConstantPropagationInstruction::getStatusAfter(llvm::Value *Variable)
 {
-  return StatusAfter[Variable].first;
+  std::pair<Status, Constant *> *Entry = find(StatusAfter, Variable);
+  return Entry ? Entry->first : Top;
 }
 
 Status ConstantPropagationInstruction::getStatusBefore(llvm::Value *Variable)
 {
-  return StatusBefore[Variable].first;
+  std::pair<Status, Constant *> *Entry = find(StatusBefore, Variable);
+  return Entry ? Entry->first : Top;
 }
 
-int ConstantPropagationInstruction::getValueBefore(llvm::Value *Variable)
+Constant *ConstantPropagationInstruction::getValueBefore(llvm::Value *Variable)
 {
-  return StatusBefore[Variable].second;
+  std::pair<Status, Constant *> *Entry = find(StatusBefore, Variable);
+  return Entry ? Entry->second : nullptr;
 }
 
-int ConstantPropagationInstruction::getValueAfter(llvm::Value *Variable)
+Constant *ConstantPropagationInstruction::getValueAfter(llvm::Value *Variable)
 {
-  return StatusAfter[Variable].second;
+  std::pair<Status, Constant *> *Entry = find(StatusAfter, Variable);
+  return Entry ? Entry->second : nullptr;
 }
 
 void ConstantPropagationInstruction::addPredecessor(ConstantPropagationInstruction *Predecessor)
 {
-  Predecessors.push_back(Predecessor);
+  assert(NumPredecessors < MaxPredecessors && "Too many predecessors");
+  Predecessors[NumPredecessors++] = Predecessor;
 }
 
 Instruction *ConstantPropagationInstruction::getInstruction()
@@ -54,7 +86,7 @@ Instruction *ConstantPropagationInstruction::getInstruction()
   return Instr;
 }
 
-std::vector<ConstantPropagationInstruction *> ConstantPropagationInstruction::getPredecessors()
+ArrayRef<ConstantPropagationInstruction *> ConstantPropagationInstruction::getPredecessors()
 {
-  return Predecessors;
+  return ArrayRef<ConstantPropagationInstruction *>(Predecessors, NumPredecessors);
 }
@@ -5,10 +5,13 @@
 #ifndef LLVM_PROJECT_CONSTANTPROPAGATIONINSTRUCTION_H
 #define LLVM_PROJECT_CONSTANTPROPAGATIONINSTRUCTION_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
-#include <unordered_map>
-#include <vector>
+#include "llvm/Support/Allocator.h"
+#include <utility>
 
 using namespace llvm;
 
@@ -18,24 +21,37 @@ enum Status {
   Const
 };
 
+// Constant values of the lattice are uniqued by the context, so two of them
+// are the same value exactly when they are the same pointer. That holds for
+// integers and floating point alike, 0.0 and -0.0 stay apart.
+//
+// All storage of a ConstantPropagationInstruction (the lattice values and the
+// predecessor list) lives in the arena passed to the constructor, so the
+// objects are trivially destructible and are released by resetting the arena.
 class ConstantPropagationInstruction
 {
 private:
   Instruction *Instr;
-  std::unordered_map<Value *, std::pair<Status, int>> StatusBefore;
-  std::unordered_map<Value *, std::pair<Status, int>> StatusAfter;
-  std::vector<ConstantPropagationInstruction *> Predecessors;
+  const DenseMap<Value *, unsigned> *VariableIndices;
+  std::pair<Status, Constant *> *StatusBefore;
+  std::pair<Status, Constant *> *StatusAfter;
+  ConstantPropagationInstruction **Predecessors;
+  unsigned NumPredecessors;
+  unsigned MaxPredecessors;
+
+  std::pair<Status, Constant *> *find(std::pair<Status, Constant *> *Statuses, Value *);
 
 public:
-  ConstantPropagationInstruction(Instruction *, const std::vector<Value *>&);
+  ConstantPropagationInstruction(Instruction *, const DenseMap<Value *, unsigned> &,
+                                 unsigned MaxPredecessors, BumpPtrAllocator &);
   Status getStatusBefore(Value *);
   Status getStatusAfter(Value *);
-  void setStatusBefore(Value *, Status S, int value = -1);
-  void setStatusAfter(Value *, Status S, int value = -1);
-  int getValueBefore(Value *);
-  int getValueAfter(Value *);
+  void setStatusBefore(Value *, Status S, Constant *value = nullptr);
+  void setStatusAfter(Value *, Status S, Constant *value = nullptr);
+  Constant *getValueBefore(Value *);
+  Constant *getValueAfter(Value *);
   void addPredecessor(ConstantPropagationInstruction *);
-  std::vector<ConstantPropagationInstruction *> getPredecessors();
+  ArrayRef<ConstantPropagationInstruction *> getPredecessors();
   Instruction *getInstruction();
 };
 
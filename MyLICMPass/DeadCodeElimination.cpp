@@ -1,74 +1,114 @@
 #include "DeadCodeElimination.h"
 
-void DeadCodeElimination::handleOperand(Value *Operand)
+// Only stores straight into a local variable can be dead, any other address keeps the store.
+static AllocaInst *getStoredVariable(Instruction &I)
 {
-    if (Variables.find(Operand) != Variables.end()) {
-          Variables[Operand] = true;
-    }
-    if (VariablesMap.find(Operand) != VariablesMap.end()) {
-          Variables[VariablesMap[Operand]] = true;
+    auto *Store = dyn_cast<StoreInst>(&I);
+    return Store != nullptr && !Store->isVolatile() ? dyn_cast<AllocaInst>(Store->getPointerOperand()) : nullptr;
+}
+
+bool DeadCodeElimination::isRoot(Instruction &I)
+{
+    if (getStoredVariable(I) != nullptr) {
+      return false;
     }
+
+    return I.getType()->isVoidTy() || isa<CallBase>(&I) || I.mayHaveSideEffects() || I.isTerminator() || I.isEHPad();
 }
 
-bool DeadCodeElimination::eliminateDeadInstructions(Function &F)
+void DeadCodeElimination::markLive(Value *V)
 {
-    InstructionsToRemove.clear();
+    auto *I = dyn_cast<Instruction>(V);
+    if (I == nullptr) {
+      return;
+    }
 
-    for (BasicBlock &BB : F) {
-      for (Instruction &I : BB) {
-        if (!I.getType()->isVoidTy() && !isa<CallInst>(&I)) {
-          Variables[&I] = false;
-        }
+    auto It = InstructionNumbers.find(I);
+    if (It != InstructionNumbers.end() && !Live.test(It->second)) {
+      Live.set(It->second);
+      Worklist.push_back(I);
+    }
+}
 
-        if (isa<LoadInst>(&I)) {
-          VariablesMap[&I] = I.getOperand(0);
-        }
+void DeadCodeElimination::markOperands(Instruction *I)
+{
+    if (AllocaInst *Variable = getStoredVariable(*I)) {
+      markLive(cast<StoreInst>(I)->getValueOperand());
+      markLive(Variable);
+      return;
+    }
 
-        if (isa<StoreInst>(&I)) {
-          handleOperand(I.getOperand(0));
-        }
-        else {
-          for (size_t i = 0; i < I.getNumOperands(); i++) {
-            handleOperand(I.getOperand(i));
-          }
+    for (Value *Operand : I->operands()) {
+      markLive(Operand);
+    }
+
+    // A variable that is read keeps every store to it.
+    if (auto *Variable = dyn_cast<AllocaInst>(I)) {
+      for (User *U : Variable->users()) {
+        auto *UserInst = cast<Instruction>(U);
+        if (getStoredVariable(*UserInst) == Variable) {
+          markLive(UserInst);
         }
       }
     }
+}
+
+// Runs after the unreachable blocks are gone, so every operand of a live instruction is defined in a reachable block.
+bool DeadCodeElimination::eliminateDeadInstructions(Function &F)
+{
+    InstructionNumbers.clear();
+    Instructions.clear();
+    Worklist.clear();
 
     for (BasicBlock &BB : F) {
       for (Instruction &I : BB) {
-        if (isa<StoreInst>(&I)) {
-          if (!Variables[I.getOperand(1)]) {
-            InstructionsToRemove.push_back(&I);
-          }
-        }
-        else {
-          if (Variables.find(&I) != Variables.end() && !Variables[&I]) {
-            InstructionsToRemove.push_back(&I);
-          }
-        }
+        InstructionNumbers[&I] = Instructions.size();
+        Instructions.push_back(&I);
       }
     }
 
-    if (InstructionsToRemove.size() > 0) {
-      InstructionRemoved = true;
+    Live.clear();
+    Live.resize(Instructions.size());
+    for (Instruction *I : Instructions) {
+      if (isRoot(*I)) {
+        Live.set(InstructionNumbers[I]);
+        Worklist.push_back(I);
+      }
     }
 
-    for (Instruction *Instr : InstructionsToRemove) {
-      Instr->eraseFromParent();
+    while (!Worklist.empty()) {
+      Instruction *I = Worklist.back();
+      Worklist.pop_back();
+      markOperands(I);
     }
 
-    return InstructionRemoved;
+    if (Live.all()) {
+      return false;
+    }
+
+    // Dead instructions may use each other, so none is erased before all of them let go of their operands.
+    std::vector<Instruction *> Dead;
+    for (int i = Live.find_first_unset(); i != -1; i = Live.find_next_unset(i)) {
+      Dead.push_back(Instructions[i]);
+      Instructions[i]->dropAllReferences();
+    }
+
+    for (Instruction *I : Dead) {
+      I->eraseFromParent();
+    }
+
+    InstructionRemoved = true;
+    return true;
 }
 
 bool DeadCodeElimination::eliminateUnreachableInstructions(Function &F)
 {
     std::vector<BasicBlock *> UnreachableBlocks;
-    OurCFG *CFG = new OurCFG(F);
-    CFG->DFS(&F.front());
+    OurCFG CFG(F, Allocator);
+    CFG.DFS(&F.front());
 
     for (BasicBlock &BB : F) {
-      if (!CFG->isReachable(&BB)) {
+      if (!CFG.isReachable(&BB)) {
         UnreachableBlocks.push_back(&BB);
       }
     }
@@ -77,6 +117,14 @@ bool DeadCodeElimination::eliminateUnreachableInstructions(Function &F)
       InstructionRemoved = true;
     }
 
+    // Reachable successors must forget the edges first, and unreachable blocks may use each other's values.
+    for (BasicBlock *UnreachableBlock : UnreachableBlocks) {
+      for (BasicBlock *Successor : successors(UnreachableBlock)) {
+        Successor->removePredecessor(UnreachableBlock);
+      }
+      UnreachableBlock->dropAllReferences();
+    }
+
     for (BasicBlock *UnreachableBlock : UnreachableBlocks) {
       UnreachableBlock->eraseFromParent();
     }
@@ -84,15 +132,19 @@ bool DeadCodeElimination::eliminateUnreachableInstructions(Function &F)
     return InstructionRemoved;
 }
 
+bool DeadCodeElimination::removeUnreachableBlocks(Function &F)
+{
+    InstructionRemoved = false;
+    Allocator.Reset();
+    return eliminateUnreachableInstructions(F);
+}
+
 bool DeadCodeElimination::runOnFunction(Function &F) {
-    bool Changed = false;
-    do {
-      InstructionRemoved = false;
-      Changed |= eliminateDeadInstructions(F);
-      Changed |= eliminateUnreachableInstructions(F);
-    } while (InstructionRemoved);
-
-    return Changed;
+    InstructionRemoved = false;
+    Allocator.Reset();
+    eliminateUnreachableInstructions(F);
+    eliminateDeadInstructions(F);
+    return InstructionRemoved;
 }
 
 char DeadCodeElimination::ID = 0;
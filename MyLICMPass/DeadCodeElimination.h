@@ -7,22 +7,37 @@
 #include "llvm/IR/Operator.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
 
 #include<vector>
-#include<unordered_map>
 
 #include "OurCFG.h"
 
 using namespace llvm;
 
+// Removes unreachable blocks, then every instruction no live instruction
+// depends on. Instructions that may have side effects are live, stores to a
+// local variable only once the variable itself is, and liveness spreads from
+// them to their operands until nothing new is marked. Both reachability and
+// liveness are bitvectors over block and instruction numbers, and because
+// marking follows the def-use graph a single pass removes whole dead chains
+// and dead cycles of PHIs at once.
 class DeadCodeElimination : public FunctionPass {
 private:
-    std::unordered_map<Value *, bool> Variables;
-    std::unordered_map<Value *, Value *> VariablesMap;
-    std::vector<Instruction *> InstructionsToRemove;
+    DenseMap<Instruction *, unsigned> InstructionNumbers;
+    std::vector<Instruction *> Instructions;
+    BitVector Live;
+    std::vector<Instruction *> Worklist;
     bool InstructionRemoved;
+    // Per-function arena for the CFG built on every run, reset at the start of every run.
+    BumpPtrAllocator Allocator;
 
-    void handleOperand(Value *Operand);
+    bool isRoot(Instruction &I);
+    void markLive(Value *V);
+    void markOperands(Instruction *I);
     bool eliminateDeadInstructions(Function &F);
     bool eliminateUnreachableInstructions(Function &F);
 
@@ -31,6 +46,7 @@ public:
   DeadCodeElimination() : FunctionPass(ID) {}
 
   bool runOnFunction(Function &F) override;
+  bool removeUnreachableBlocks(Function &F);
 };
 
 #endif // LLVM_PROJECT_DEADCODEELIMINATION_H
\ No newline at end of file
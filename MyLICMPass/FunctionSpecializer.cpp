@@ -0,0 +1,126 @@
+#include "FunctionSpecializer.h"
+#include "PassOutput.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+static cl::opt<unsigned> MaxCalleeSize("ipcp-max-callee-size", cl::init(200),
+                                       cl::desc("Largest callee (in instructions) that is specialized for a call site"));
+
+static cl::opt<unsigned> MaxSpecializations("ipcp-max-specializations", cl::init(4),
+                                            cl::desc("Maximum number of specialized copies of a single function"));
+
+static cl::opt<unsigned> SizeBudget("ipcp-size-budget", cl::init(1000),
+                                    cl::desc("Total number of instructions all kept specializations may add to the module"));
+
+static cl::opt<unsigned> MinShrinkPercent("ipcp-min-shrink", cl::init(20),
+                                          cl::desc("How much smaller (in percent) than the original a specialization must get to be kept"));
+
+bool FunctionSpecializer::optimize(Function &F)
+{
+    bool Changed = false, IterationChanged;
+    do {
+      IterationChanged = false;
+      passOutput() << "Running Constant Propagation on " << F.getName() << "\n";
+      IterationChanged |= Propagation.runOnFunction(F);
+      passOutput() << "Running Constant Folding on " << F.getName() << "\n";
+      IterationChanged |= Folding.runOnFunction(F);
+      passOutput() << "Running Dead Code Elimination on " << F.getName() << "\n";
+      IterationChanged |= Elimination.runOnFunction(F);
+      Changed |= IterationChanged;
+    } while (IterationChanged);
+
+    return Changed;
+}
+
+bool FunctionSpecializer::makeKey(CallInst *CI, SpecializationKey &Key)
+{
+    bool HasConstant = false;
+    Key.Callee = CI->getCalledFunction();
+    Key.Arguments.clear();
+
+    for (unsigned i = 0; i < CI->arg_size(); i++) {
+      ConstantInt *ConstInt = dyn_cast<ConstantInt>(CI->getArgOperand(i));
+      if (ConstInt != nullptr && Key.Callee->getArg(i)->use_empty()) {
+        ConstInt = nullptr;
+      }
+
+      HasConstant |= ConstInt != nullptr;
+      Key.Arguments.push_back(ConstInt);
+    }
+
+    return HasConstant;
+}
+
+// The copy keeps the original signature, so call sites only have to be redirected.
+Function *FunctionSpecializer::createSpecialization(const SpecializationKey &Key)
+{
+    Function *Callee = Key.Callee;
+    unsigned OriginalSize = Callee->getInstructionCount();
+
+    if (OriginalSize > MaxCalleeSize) {
+      passOutput() << "Callee " << Callee->getName() << " is too large to specialize.\n";
+      return nullptr;
+    }
+
+    if (SpecializationCounts[Callee] >= MaxSpecializations) {
+      passOutput() << "Too many specializations of " << Callee->getName() << ".\n";
+      return nullptr;
+    }
+
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(Callee, VMap);
+    Clone->setName(Callee->getName() + ".specialized");
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+
+    for (Argument &Arg : Clone->args()) {
+      if (ConstantInt *ConstInt = Key.Arguments[Arg.getArgNo()]) {
+        Arg.replaceAllUsesWith(ConstInt);
+      }
+    }
+
+    optimize(*Clone);
+
+    unsigned SpecializedSize = Clone->getInstructionCount();
+    if ((OriginalSize - std::min(SpecializedSize, OriginalSize)) * 100 < OriginalSize * MinShrinkPercent) {
+      passOutput() << "Specialization of " << Callee->getName() << " only shrank from " << OriginalSize << " to "
+             << SpecializedSize << " instructions, discarding it.\n";
+      Clone->eraseFromParent();
+      return nullptr;
+    }
+
+    if (UsedBudget + SpecializedSize > SizeBudget) {
+      passOutput() << "Specialization budget exhausted, discarding " << Clone->getName() << ".\n";
+      Clone->eraseFromParent();
+      return nullptr;
+    }
+
+    UsedBudget += SpecializedSize;
+    SpecializationCounts[Callee]++;
+    return Clone;
+}
+
+Function *FunctionSpecializer::getSpecialization(CallInst *CI)
+{
+    SpecializationKey Key;
+    if (!makeKey(CI, Key)) {
+      return nullptr;
+    }
+
+    auto It = Specializations.find(Key);
+    if (It != Specializations.end()) {
+      return It->second;
+    }
+
+    Function *Clone = createSpecialization(Key);
+    Specializations[Key] = Clone;
+    return Clone;
+}
+
+void FunctionSpecializer::clear()
+{
+    Specializations.clear();
+    SpecializationCounts.clear();
+    UsedBudget = 0;
+}
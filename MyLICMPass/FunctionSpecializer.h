@@ -0,0 +1,65 @@
+#ifndef LLVM_PROJECT_FUNCTIONSPECIALIZER_H
+#define LLVM_PROJECT_FUNCTIONSPECIALIZER_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <unordered_map>
+#include <vector>
+
+#include "ConstantFolding.h"
+#include "ConstantPropagation.h"
+#include "DeadCodeElimination.h"
+
+using namespace llvm;
+
+// A function together with the constants its call site passes, nullptr for
+// arguments that are not constant (or not used by the callee).
+struct SpecializationKey {
+  Function *Callee;
+  std::vector<ConstantInt *> Arguments;
+
+  bool operator==(const SpecializationKey &Other) const
+  {
+    return Callee == Other.Callee && Arguments == Other.Arguments;
+  }
+};
+
+struct SpecializationKeyHash {
+  size_t operator()(const SpecializationKey &Key) const
+  {
+    return hash_combine(Key.Callee, hash_combine_range(Key.Arguments.begin(), Key.Arguments.end()));
+  }
+};
+
+// Creates specialized copies of functions for constant argument tuples and
+// shares a copy between all call sites that pass the same tuple. A copy is
+// kept only if propagation, folding and DCE shrink it enough and it fits in
+// the module wide size budget, rejected tuples are remembered as well so
+// they are not cloned again.
+class FunctionSpecializer {
+private:
+  ConstantPropagation &Propagation;
+  ConstantFolding &Folding;
+  DeadCodeElimination &Elimination;
+
+  std::unordered_map<SpecializationKey, Function *, SpecializationKeyHash> Specializations;
+  std::unordered_map<Function *, unsigned> SpecializationCounts;
+  unsigned UsedBudget = 0;
+
+  bool makeKey(CallInst *CI, SpecializationKey &Key);
+  Function *createSpecialization(const SpecializationKey &Key);
+
+public:
+  FunctionSpecializer(ConstantPropagation &Propagation, ConstantFolding &Folding, DeadCodeElimination &Elimination)
+      : Propagation(Propagation), Folding(Folding), Elimination(Elimination) {}
+
+  bool optimize(Function &F);
+  Function *getSpecialization(CallInst *CI);
+  void clear();
+};
+
+#endif // LLVM_PROJECT_FUNCTIONSPECIALIZER_H
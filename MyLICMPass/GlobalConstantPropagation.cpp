@@ -0,0 +1,127 @@
+#include "GlobalConstantPropagation.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <vector>
+
+static cl::opt<bool> WholeProgram("global-constants-whole-program", cl::init(false),
+                                  cl::desc("Assume no other module writes the dso_local globals defined in this one"));
+
+// The initializer has to be the one every run sees, which rules out weak
+// definitions, and no other module may store to the global.
+bool GlobalConstantPropagation::isCandidate(GlobalVariable &GV)
+{
+    if (!GV.hasDefinitiveInitializer() || GV.isExternallyInitialized() || GV.isThreadLocal()) {
+      return false;
+    }
+
+    return GV.hasLocalLinkage() || (WholeProgram && GV.isDSOLocal());
+}
+
+bool GlobalConstantPropagation::isOnlyRead(Value *V)
+{
+    for (User *U : V->users()) {
+      if (auto *Load = dyn_cast<LoadInst>(U)) {
+        if (!Load->isSimple()) {
+          return false;
+        }
+        continue;
+      }
+
+      // Addresses derived from the global, a ptrtoint or a compare would let it escape.
+      auto *GEP = dyn_cast<GEPOperator>(U);
+      if (GEP != nullptr && GEP->getPointerOperand() == V && isOnlyRead(GEP)) {
+        continue;
+      }
+
+      auto *Op = dyn_cast<Operator>(U);
+      if (Op != nullptr && (Op->getOpcode() == Instruction::BitCast || Op->getOpcode() == Instruction::AddrSpaceCast) &&
+          isOnlyRead(Op)) {
+        continue;
+      }
+      return false;
+    }
+    return true;
+}
+
+// Loads through an offset that is only known at run time stay, the global being constant is all they gain.
+bool GlobalConstantPropagation::replaceLoads(Value *V, const DataLayout &DL)
+{
+    bool Changed = false;
+    std::vector<User *> Users(V->user_begin(), V->user_end());
+
+    for (User *U : Users) {
+      auto *Load = dyn_cast<LoadInst>(U);
+      if (Load == nullptr) {
+        if (!isa<Instruction>(U)) {
+          Changed |= replaceLoads(U, DL);
+        }
+        continue;
+      }
+
+      Constant *Folded = ConstantFoldLoadFromConstPtr(cast<Constant>(V), Load->getType(), DL);
+      if (Folded == nullptr) {
+        continue;
+      }
+
+      passOutput() << "Replacing load of a constant global: " << *Load << " with " << *Folded << "\n";
+      ChangedFunctions.insert(Load->getFunction());
+      Load->replaceAllUsesWith(Folded);
+      Load->eraseFromParent();
+      Changed = true;
+    }
+    return Changed;
+}
+
+void GlobalConstantPropagation::optimize(Function &F)
+{
+    bool IterationChanged;
+    do {
+      IterationChanged = Propagation.runOnFunction(F);
+      IterationChanged |= Folding.runOnFunction(F);
+      IterationChanged |= Elimination.runOnFunction(F);
+    } while (IterationChanged);
+}
+
+bool GlobalConstantPropagation::runOnModule(Module &M) {
+    bool Changed = false;
+    ChangedFunctions.clear();
+    const DataLayout &DL = M.getDataLayout();
+
+    for (GlobalVariable &GV : make_early_inc_range(M.globals())) {
+      if (!isCandidate(GV)) {
+        continue;
+      }
+
+      GV.removeDeadConstantUsers();
+      if (!GV.isConstant()) {
+        if (!isOnlyRead(&GV)) {
+          continue;
+        }
+        passOutput() << "Global never written, marking it constant: " << GV.getName() << "\n";
+        GV.setConstant(true);
+        Changed = true;
+      }
+
+      Changed |= replaceLoads(&GV, DL);
+
+      GV.removeDeadConstantUsers();
+      if (GV.use_empty() && GV.hasLocalLinkage()) {
+        GV.eraseFromParent();
+      }
+    }
+
+    for (Function *F : ChangedFunctions) {
+      optimize(*F);
+    }
+
+    return Changed;
+}
+
+char GlobalConstantPropagation::ID = 0;
+static RegisterPass<GlobalConstantPropagation> X("our-global-constants", "Our global constant propagation pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,46 @@
+#ifndef LLVM_PROJECT_GLOBALCONSTANTPROPAGATION_H
+#define LLVM_PROJECT_GLOBALCONSTANTPROPAGATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/SetVector.h"
+
+#include "ConstantFolding.h"
+#include "ConstantPropagation.h"
+#include "DeadCodeElimination.h"
+
+using namespace llvm;
+
+// Constant propagation of global variables that are never written. A global
+// defined in this module whose address is only ever loaded from, directly or
+// through constant offsets, is marked constant and every load at a known
+// offset is replaced with the part of the initializer it reads. Only globals
+// with local linkage qualify, unless -global-constants-whole-program promises
+// that no other module writes the dso_local ones. The functions that lost
+// loads then go through constant propagation, folding and DCE, and globals
+// with no uses left are deleted.
+class GlobalConstantPropagation : public ModulePass {
+private:
+  SetVector<Function *> ChangedFunctions;
+
+  ConstantPropagation Propagation;
+  ConstantFolding Folding;
+  DeadCodeElimination Elimination;
+
+  bool isCandidate(GlobalVariable &GV);
+  bool isOnlyRead(Value *V);
+  bool replaceLoads(Value *V, const DataLayout &DL);
+  void optimize(Function &F);
+
+public:
+  static char ID;
+  GlobalConstantPropagation() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+};
+
+#endif // LLVM_PROJECT_GLOBALCONSTANTPROPAGATION_H
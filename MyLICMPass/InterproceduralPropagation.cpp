@@ -0,0 +1,244 @@
+#include "InterproceduralPropagation.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/CommandLine.h"
+
+static cl::opt<bool> SpecializeColdCalls("ipcp-specialize-cold", cl::init(false),
+                                         cl::desc("Specialize call sites outside of loops as well"));
+
+bool InterproceduralPropagation::hasOnlyDirectCalls(Function &F)
+{
+    for (Use &U : F.uses()) {
+      CallBase *Call = dyn_cast<CallBase>(U.getUser());
+      if (Call == nullptr || !Call->isCallee(&U) || Call->getFunctionType() != F.getFunctionType()) {
+        return false;
+      }
+    }
+
+    return true;
+}
+
+bool InterproceduralPropagation::hasConstantArgument(CallInst *CI)
+{
+    Function *Callee = CI->getCalledFunction();
+    for (unsigned i = 0; i < CI->arg_size(); i++) {
+      if (isa<ConstantInt>(CI->getArgOperand(i)) && !Callee->getArg(i)->use_empty()) {
+        return true;
+      }
+    }
+
+    return false;
+}
+
+void InterproceduralPropagation::mergeArgumentValue(Argument *Arg, Value *V)
+{
+    std::pair<Status, ConstantInt *> &Entry = ArgumentValues[Arg];
+    ConstantInt *ConstInt = dyn_cast<ConstantInt>(V);
+
+    if (Entry.first == Top) {
+      return;
+    }
+
+    if (ConstInt == nullptr || (Entry.first == Const && Entry.second != ConstInt)) {
+      Entry = {Top, nullptr};
+    }
+    else {
+      Entry = {Const, ConstInt};
+    }
+}
+
+void InterproceduralPropagation::computeArgumentValues(Module &M)
+{
+    for (Function &F : M) {
+      if (F.isDeclaration() || !F.hasLocalLinkage() || F.isVarArg() || !hasOnlyDirectCalls(F)) {
+        continue;
+      }
+
+      for (Argument &Arg : F.args()) {
+        ArgumentValues[&Arg] = {Bottom, nullptr};
+      }
+
+      for (User *U : F.users()) {
+        CallBase *Call = cast<CallBase>(U);
+        for (Argument &Arg : F.args()) {
+          mergeArgumentValue(&Arg, Call->getArgOperand(Arg.getArgNo()));
+        }
+      }
+    }
+}
+
+bool InterproceduralPropagation::propagateArguments(Module &M)
+{
+    bool Changed = false;
+
+    for (Function &F : M) {
+      for (Argument &Arg : F.args()) {
+        auto It = ArgumentValues.find(&Arg);
+        if (It == ArgumentValues.end() || It->second.first != Const || Arg.use_empty()) {
+          continue;
+        }
+
+        passOutput() << "Argument " << Arg.getArgNo() << " of " << F.getName() << " is always " << *It->second.second << "\n";
+        Arg.replaceAllUsesWith(It->second.second);
+        ChangedFunctions.insert(&F);
+        Changed = true;
+      }
+    }
+
+    return Changed;
+}
+
+void InterproceduralPropagation::findHotCallSites(Module &M)
+{
+    for (Function &F : M) {
+      if (F.isDeclaration()) {
+        continue;
+      }
+
+      LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+
+      for (BasicBlock &BB : F) {
+        if (!SpecializeColdCalls && LI.getLoopFor(&BB) == nullptr) {
+          continue;
+        }
+
+        for (Instruction &I : BB) {
+          CallInst *CI = dyn_cast<CallInst>(&I);
+          if (CI == nullptr) {
+            continue;
+          }
+
+          Function *Callee = CI->getCalledFunction();
+          if (Callee == nullptr || Callee->isDeclaration() || Callee == &F || Callee->isVarArg() ||
+              !Callee->hasExactDefinition() || CI->getFunctionType() != Callee->getFunctionType()) {
+            continue;
+          }
+
+          if (hasConstantArgument(CI)) {
+            HotCallSites.push_back(CI);
+          }
+        }
+      }
+    }
+}
+
+bool InterproceduralPropagation::specializeCallSites()
+{
+    bool Changed = false;
+    SetVector<Function *> SpecializedFunctions;
+
+    for (CallInst *CI : HotCallSites) {
+      Function *Callee = CI->getCalledFunction();
+      Function *Clone = Specializer.getSpecialization(CI);
+
+      if (Clone == nullptr) {
+        continue;
+      }
+
+      passOutput() << "Calling " << Clone->getName() << " instead of " << Callee->getName() << " in: " << *CI << "\n";
+      CI->setCalledFunction(Clone);
+      SpecializedFunctions.insert(Callee);
+      Changed = true;
+    }
+
+    // Internal functions whose every call site now goes to a specialization are dead. They may still
+    // be among the changed functions, so they are erased once those are optimized.
+    for (Function *F : SpecializedFunctions) {
+      if (F->hasLocalLinkage() && F->use_empty()) {
+        DeadFunctions.insert(F);
+      }
+    }
+
+    return Changed;
+}
+
+bool InterproceduralPropagation::propagateReturnValues(Module &M)
+{
+    bool Changed = false;
+
+    for (Function &F : M) {
+      if (F.isDeclaration() || !F.hasExactDefinition() || !F.getReturnType()->isIntegerTy()) {
+        continue;
+      }
+
+      ConstantInt *ReturnValue = nullptr;
+      for (BasicBlock &BB : F) {
+        if (ReturnInst *Return = dyn_cast<ReturnInst>(BB.getTerminator())) {
+          ConstantInt *ConstInt = dyn_cast<ConstantInt>(Return->getReturnValue());
+          if (ConstInt == nullptr || (ReturnValue != nullptr && ReturnValue != ConstInt)) {
+            ReturnValue = nullptr;
+            break;
+          }
+          ReturnValue = ConstInt;
+        }
+      }
+
+      if (ReturnValue == nullptr) {
+        continue;
+      }
+
+      for (Use &U : F.uses()) {
+        CallBase *Call = dyn_cast<CallBase>(U.getUser());
+        if (Call == nullptr || !Call->isCallee(&U) || Call->getType() != ReturnValue->getType() || Call->use_empty()) {
+          continue;
+        }
+
+        passOutput() << F.getName() << " always returns " << *ReturnValue << ", replacing: " << *Call << "\n";
+        Call->replaceAllUsesWith(ReturnValue);
+        ChangedFunctions.insert(Call->getFunction());
+        Changed = true;
+      }
+    }
+
+    return Changed;
+}
+
+bool InterproceduralPropagation::runOnModule(Module &M) {
+    bool Changed = false;
+    ArgumentValues.clear();
+    HotCallSites.clear();
+    Specializer.clear();
+    ChangedFunctions.clear();
+    DeadFunctions.clear();
+
+    // Call sites only see constants once the loads feeding their arguments are propagated.
+    for (Function &F : M) {
+      if (!F.isDeclaration()) {
+        Changed |= Propagation.runOnFunction(F);
+      }
+    }
+
+    computeArgumentValues(M);
+    Changed |= propagateArguments(M);
+    findHotCallSites(M);
+    Changed |= specializeCallSites();
+
+    for (Function *F : ChangedFunctions) {
+      Specializer.optimize(*F);
+    }
+
+    ChangedFunctions.clear();
+    Changed |= propagateReturnValues(M);
+
+    for (Function *F : ChangedFunctions) {
+      Specializer.optimize(*F);
+    }
+
+    for (Function *F : DeadFunctions) {
+      passOutput() << "Removing " << F->getName() << ", all of its call sites are specialized.\n";
+      F->eraseFromParent();
+    }
+    DeadFunctions.clear();
+
+    return Changed;
+}
+
+void InterproceduralPropagation::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<LoopInfoWrapperPass>();
+}
+
+char InterproceduralPropagation::ID = 0;
+static RegisterPass<InterproceduralPropagation> X("our-ipcp", "Our interprocedural constant propagation pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,58 @@
+#ifndef LLVM_PROJECT_INTERPROCEDURALPROPAGATION_H
+#define LLVM_PROJECT_INTERPROCEDURALPROPAGATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+
+#include <utility>
+#include <vector>
+
+#include "ConstantFolding.h"
+#include "ConstantPropagation.h"
+#include "DeadCodeElimination.h"
+#include "FunctionSpecializer.h"
+
+using namespace llvm;
+
+// Module level constant propagation. Arguments of internal functions that get
+// the same constant from every call site are replaced with it, hot call sites
+// (inside loops) that pass constants share a specialized copy of the callee
+// per constant tuple (see FunctionSpecializer), and constant return values
+// are substituted into the callers. The intraprocedural passes then run on
+// every function that was changed.
+class InterproceduralPropagation : public ModulePass {
+private:
+  DenseMap<Argument *, std::pair<Status, ConstantInt *>> ArgumentValues;
+  std::vector<CallInst *> HotCallSites;
+  SetVector<Function *> ChangedFunctions;
+  SetVector<Function *> DeadFunctions;
+
+  ConstantPropagation Propagation;
+  ConstantFolding Folding;
+  DeadCodeElimination Elimination;
+  FunctionSpecializer Specializer{Propagation, Folding, Elimination};
+
+  bool hasOnlyDirectCalls(Function &F);
+  bool hasConstantArgument(CallInst *CI);
+  void mergeArgumentValue(Argument *Arg, Value *V);
+  void computeArgumentValues(Module &M);
+  bool propagateArguments(Module &M);
+  void findHotCallSites(Module &M);
+  bool specializeCallSites();
+  bool propagateReturnValues(Module &M);
+
+public:
+  static char ID;
+  InterproceduralPropagation() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+};
+
+#endif // LLVM_PROJECT_INTERPROCEDURALPROPAGATION_H
@@ -0,0 +1,320 @@
+#include "LoopFusion.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/raw_ostream.h"
+
+LoopFusion::LoopFusion(Loop *First, Loop *Second, Value *FirstCounter, Value *SecondCounter, int64_t Step)
+    : First(First), Second(Second), FirstCounter(FirstCounter), SecondCounter(SecondCounter), Step(Step)
+{
+}
+
+// Only loaded from and stored to, directly or through GEPs, so no other pointer can reach it.
+bool LoopFusion::isLocalVariable(Value *V)
+{
+    if (!isa<AllocaInst>(V) && !isa<GEPOperator>(V)) {
+      return false;
+    }
+
+    for (User *U : V->users()) {
+      if (isa<LoadInst>(U)) {
+        continue;
+      }
+      auto *Store = dyn_cast<StoreInst>(U);
+      if (Store != nullptr && Store->getValueOperand() != V) {
+        continue;
+      }
+      auto *GEP = dyn_cast<GEPOperator>(U);
+      if (GEP == nullptr || GEP->getPointerOperand() != V || !isLocalVariable(GEP)) {
+        return false;
+      }
+    }
+    return true;
+}
+
+bool LoopFusion::hasPHIs(Loop *L)
+{
+    for (BasicBlock *BB : L->blocks()) {
+      if (!BB->phis().empty()) {
+        return true;
+      }
+    }
+    return false;
+}
+
+// "i = i + step" and the jump back, so the latch can be shared by both bodies.
+bool LoopFusion::isUpdateOnly(BasicBlock *Latch, Value *Counter)
+{
+    if (Latch->size() != 4) {
+      return false;
+    }
+
+    auto It = Latch->begin();
+    auto *Load = dyn_cast<LoadInst>(&*It++);
+    auto *Increment = dyn_cast<BinaryOperator>(&*It++);
+    auto *Update = dyn_cast<StoreInst>(&*It);
+    return Load != nullptr && Increment != nullptr && Update != nullptr && Load->getPointerOperand() == Counter &&
+           Increment->getOperand(0) == Load && Update->getValueOperand() == Increment &&
+           Update->getPointerOperand() == Counter;
+}
+
+// The blocks from the exit of the first loop to the preheader of the second, each jumping straight to the next.
+bool LoopFusion::findBetween()
+{
+    BasicBlock *Exit = First->getExitBlock();
+    BasicBlock *Preheader = Second->getLoopPreheader();
+    if (Exit == nullptr || Preheader == nullptr || Exit->getSinglePredecessor() != FirstHeader) {
+      return false;
+    }
+
+    for (BasicBlock *BB = Exit; BB != nullptr; BB = BB->getSingleSuccessor()) {
+      if (BB != Exit && BB->getSinglePredecessor() == nullptr) {
+        return false;
+      }
+
+      Between.push_back(BB);
+      if (BB == Preheader) {
+        return true;
+      }
+    }
+    return false;
+}
+
+// Index "i + c" of the loop counter i, possibly extended, read before the latch steps it.
+bool LoopFusion::getIndexOffset(Value *Index, Loop *L, Value *Counter, int64_t &Offset)
+{
+    Offset = 0;
+    if (isa<SExtInst>(Index) || isa<ZExtInst>(Index)) {
+      Index = cast<CastInst>(Index)->getOperand(0);
+    }
+
+    auto *Add = dyn_cast<BinaryOperator>(Index);
+    if (Add != nullptr && (Add->getOpcode() == Instruction::Add || Add->getOpcode() == Instruction::Sub)) {
+      auto *Constant = dyn_cast<ConstantInt>(Add->getOperand(1));
+      if (Constant == nullptr) {
+        return false;
+      }
+      Offset = Add->getOpcode() == Instruction::Add ? Constant->getSExtValue() : -Constant->getSExtValue();
+      Index = Add->getOperand(0);
+      if (isa<SExtInst>(Index) || isa<ZExtInst>(Index)) {
+        Index = cast<CastInst>(Index)->getOperand(0);
+      }
+    }
+
+    auto *Load = dyn_cast<LoadInst>(Index);
+    if (Load == nullptr || Load->getPointerOperand() != Counter || !L->contains(Load->getParent())) {
+      return false;
+    }
+
+    for (Instruction &I : *Load->getParent()) {
+      if (&I == Load) {
+        return true;
+      }
+      auto *Store = dyn_cast<StoreInst>(&I);
+      if (Store != nullptr && Store->getPointerOperand() == Counter) {
+        return false;
+      }
+    }
+    return true;
+}
+
+bool LoopFusion::collectAccesses(Loop *L, Value *Counter, SmallVectorImpl<Access> &Accesses)
+{
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (auto *Call = dyn_cast<CallBase>(&I)) {
+          if (!isa<DbgInfoIntrinsic>(Call) && !Call->doesNotAccessMemory()) {
+            return false;
+          }
+          continue;
+        }
+
+        Value *Ptr;
+        bool Write;
+        if (auto *Load = dyn_cast<LoadInst>(&I)) {
+          if (!Load->isSimple()) {
+            return false;
+          }
+          Ptr = Load->getPointerOperand();
+          Write = false;
+        }
+        else if (auto *Store = dyn_cast<StoreInst>(&I)) {
+          if (!Store->isSimple()) {
+            return false;
+          }
+          Ptr = Store->getPointerOperand();
+          Write = true;
+        }
+        else if (I.mayReadOrWriteMemory()) {
+          return false;
+        }
+        else {
+          continue;
+        }
+
+        Access A{Ptr, getUnderlyingObject(Ptr), Write};
+        auto *GEP = dyn_cast<GEPOperator>(Ptr);
+        if (GEP != nullptr && GEP->getPointerOperand() == A.Object && GEP->getNumIndices() > 0 &&
+            getIndexOffset(*(GEP->idx_end() - 1), L, Counter, A.Offset)) {
+          A.GEP = GEP;
+        }
+        Accesses.push_back(A);
+      }
+    }
+    return true;
+}
+
+// A is an access of the first loop, B one of the second.
+bool LoopFusion::isIndependent(const Access &A, const Access &B)
+{
+    bool Shared = FirstCounter == SecondCounter;
+    if (!Shared && (A.Ptr == SecondCounter || B.Ptr == FirstCounter)) {
+      return false;
+    }
+    if (Shared && A.Ptr == FirstCounter && B.Ptr == FirstCounter) {
+      return true;
+    }
+
+    if (A.Object != B.Object) {
+      auto IsIdentified = [](Value *V) { return isa<AllocaInst>(V) || isa<GlobalVariable>(V); };
+      return (IsIdentified(A.Object) && IsIdentified(B.Object)) || isLocalVariable(A.Object) ||
+             isLocalVariable(B.Object);
+    }
+
+    if (A.GEP == nullptr || B.GEP == nullptr || A.GEP->getSourceElementType() != B.GEP->getSourceElementType() ||
+        A.GEP->getNumIndices() != B.GEP->getNumIndices()) {
+      return false;
+    }
+
+    for (auto It = A.GEP->idx_begin(), Other = B.GEP->idx_begin(); It + 1 != A.GEP->idx_end(); ++It, ++Other) {
+      if (*It != *Other || !isa<Constant>(*It)) {
+        return false;
+      }
+    }
+
+    // Iteration t of the first loop and t' of the second reach the same element when
+    // t' - t = (A.Offset - B.Offset) / Step, the fused loop keeps their order if that is not negative.
+    return Step > 0 ? B.Offset <= A.Offset : B.Offset >= A.Offset;
+}
+
+bool LoopFusion::canFuse()
+{
+    FirstHeader = First->getHeader();
+    FirstLatch = First->getLoopLatch();
+    SecondHeader = Second->getHeader();
+    SecondLatch = Second->getLoopLatch();
+    if (FirstLatch == nullptr || SecondLatch == nullptr || FirstLatch == FirstHeader || SecondLatch == SecondHeader ||
+        First->getExitingBlock() != FirstHeader || Second->getExitingBlock() != SecondHeader ||
+        FirstLatch->getSingleSuccessor() != FirstHeader || SecondLatch->getSingleSuccessor() != SecondHeader ||
+        hasPHIs(First) || hasPHIs(Second)) {
+      return false;
+    }
+
+    // The test of the second header is skipped from now on, it may only compute the condition.
+    auto *Test = dyn_cast<BranchInst>(SecondHeader->getTerminator());
+    if (Test == nullptr || !Test->isConditional()) {
+      return false;
+    }
+    bool ContinuesOnTrue = Second->contains(Test->getSuccessor(0));
+    SecondBody = Test->getSuccessor(ContinuesOnTrue ? 0 : 1);
+    SecondExit = Test->getSuccessor(ContinuesOnTrue ? 1 : 0);
+    if (SecondExit != Second->getExitBlock() || !SecondExit->phis().empty()) {
+      return false;
+    }
+
+    for (Instruction &I : *SecondHeader) {
+      if (&I != Test && (I.mayHaveSideEffects() || any_of(I.users(), [this](User *U) {
+            return cast<Instruction>(U)->getParent() != SecondHeader;
+          }))) {
+        return false;
+      }
+    }
+
+    if (FirstCounter == SecondCounter &&
+        (!isUpdateOnly(FirstLatch, FirstCounter) || !isUpdateOnly(SecondLatch, SecondCounter))) {
+      return false;
+    }
+
+    SmallVector<Access, 16> FirstAccesses, SecondAccesses;
+    if (!findBetween() || !collectAccesses(First, FirstCounter, FirstAccesses) ||
+        !collectAccesses(Second, SecondCounter, SecondAccesses)) {
+      return false;
+    }
+
+    // Stores between the loops run before the first one instead, the reset of a shared counter is dropped.
+    for (BasicBlock *BB : Between) {
+      for (Instruction &I : *BB) {
+        if (I.isTerminator()) {
+          continue;
+        }
+
+        auto *Store = dyn_cast<StoreInst>(&I);
+        if (Store == nullptr || !Store->isSimple() || !isa<Constant>(Store->getValueOperand()) ||
+            !isa<AllocaInst>(Store->getPointerOperand()) || !isLocalVariable(Store->getPointerOperand())) {
+          return false;
+        }
+
+        Value *Ptr = Store->getPointerOperand();
+        if (Ptr == FirstCounter ? FirstCounter != SecondCounter
+                                : any_of(FirstAccesses, [Ptr](const Access &A) { return A.Object == Ptr; })) {
+          return false;
+        }
+      }
+    }
+
+    for (const Access &A : FirstAccesses) {
+      for (const Access &B : SecondAccesses) {
+        if ((A.Write || B.Write) && !isIndependent(A, B)) {
+          return false;
+        }
+      }
+    }
+    return true;
+}
+
+bool LoopFusion::run()
+{
+    if (!canFuse()) {
+      return false;
+    }
+
+    passOutput() << "Fusing loops with headers: " << FirstHeader->getName() << " and " << SecondHeader->getName() << "\n";
+
+    Instruction *InsertBefore = First->getLoopPreheader()->getTerminator();
+    for (BasicBlock *BB : Between) {
+      for (Instruction &I : make_early_inc_range(*BB)) {
+        if (I.isTerminator()) {
+          continue;
+        }
+
+        if (cast<StoreInst>(&I)->getPointerOperand() == FirstCounter) {
+          I.eraseFromParent();
+        }
+        else {
+          I.moveBefore(InsertBefore);
+        }
+      }
+    }
+
+    if (FirstCounter == SecondCounter) {
+      SmallVector<BasicBlock *, 4> Predecessors(predecessors(FirstLatch));
+      for (BasicBlock *Pred : Predecessors) {
+        Pred->getTerminator()->replaceSuccessorWith(FirstLatch, SecondBody);
+      }
+
+      Predecessors.assign(pred_begin(SecondLatch), pred_end(SecondLatch));
+      for (BasicBlock *Pred : Predecessors) {
+        Pred->getTerminator()->replaceSuccessorWith(SecondLatch, FirstLatch);
+      }
+    }
+    else {
+      FirstLatch->getTerminator()->replaceSuccessorWith(FirstHeader, SecondBody);
+      SecondLatch->getTerminator()->replaceSuccessorWith(SecondHeader, FirstHeader);
+    }
+
+    // The second counter has reached its end as well once the fused loop exits.
+    Second->getLoopPreheader()->getTerminator()->replaceSuccessorWith(SecondHeader, SecondExit);
+    return true;
+}
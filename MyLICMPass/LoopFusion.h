@@ -0,0 +1,58 @@
+#ifndef LLVM_PROJECT_LOOPFUSION_H
+#define LLVM_PROJECT_LOOPFUSION_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/ADT/SmallVector.h"
+
+using namespace llvm;
+
+// Fusion of two adjacent innermost loops that are still tested at the top,
+// run the same number of times and step their counters from the same start
+// by the same amount. Only stores of constants to local variables the first
+// loop does not touch may sit between them, and they move to the preheader of
+// the first loop. The fused loop runs the body of the first loop and then
+// the body of the second in every iteration. Loops with their own counters
+// keep both updates, a shared counter is only stepped once, by the latch of
+// the first loop.
+//
+// Memory both loops access has to be provably different objects, or the
+// same array indexed by the counter plus a constant, a[i + c]. An element the
+// second loop reaches in a later iteration than the first loop did is fine,
+// the other order would reverse a dependence, and so would any variable the
+// loops share as a scalar.
+class LoopFusion {
+private:
+  struct Access {
+    Value *Ptr;
+    Value *Object;
+    bool Write;
+    GEPOperator *GEP = nullptr;
+    int64_t Offset = 0;
+  };
+
+  Loop *First, *Second;
+  Value *FirstCounter, *SecondCounter;
+  int64_t Step;
+
+  BasicBlock *FirstHeader = nullptr, *FirstLatch = nullptr, *SecondHeader = nullptr, *SecondLatch = nullptr;
+  BasicBlock *SecondBody = nullptr, *SecondExit = nullptr;
+  SmallVector<BasicBlock *, 4> Between;
+
+  static bool isLocalVariable(Value *V);
+  static bool hasPHIs(Loop *L);
+  bool isUpdateOnly(BasicBlock *Latch, Value *Counter);
+  bool findBetween();
+  bool getIndexOffset(Value *Index, Loop *L, Value *Counter, int64_t &Offset);
+  bool collectAccesses(Loop *L, Value *Counter, SmallVectorImpl<Access> &Accesses);
+  bool isIndependent(const Access &A, const Access &B);
+  bool canFuse();
+
+public:
+  LoopFusion(Loop *First, Loop *Second, Value *FirstCounter, Value *SecondCounter, int64_t Step);
+
+  bool run();
+};
+
+#endif // LLVM_PROJECT_LOOPFUSION_H
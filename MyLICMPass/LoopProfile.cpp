@@ -0,0 +1,103 @@
+#include "LoopProfile.h"
+#include "PassOutput.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+static const char *const ProfileTag = "our.loop.profile";
+
+// Unnamed headers still need a field of their own in the profile.
+StringRef LoopProfile::getHeaderName(const BasicBlock *Header)
+{
+    return Header->hasName() ? Header->getName() : "-";
+}
+
+bool LoopProfile::read(StringRef Path)
+{
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+      passOutput() << "Cannot read loop profile " << Path << ": " << Buffer.getError().message() << "\n";
+      return false;
+    }
+
+    Functions.clear();
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+
+    for (StringRef Line : Lines) {
+      SmallVector<StringRef, 5> Fields;
+      Line.split(Fields, ' ', -1, false);
+
+      unsigned Index;
+      uint64_t Entries, Backedges;
+      if (Fields.size() != 5 || Fields[1].getAsInteger(10, Index) || Fields[3].getAsInteger(10, Entries) ||
+          Fields[4].getAsInteger(10, Backedges)) {
+        passOutput() << "Ignoring malformed loop profile line: " << Line << "\n";
+        continue;
+      }
+
+      Counts &Record = Functions[Fields[0]][Index];
+      if (Record.Header.empty()) {
+        Record.Header = Fields[2].str();
+      }
+      else if (Record.Header != Fields[2]) {
+        continue;
+      }
+      Record.Entries += Entries;
+      Record.Backedges += Backedges;
+    }
+    return true;
+}
+
+void LoopProfile::annotate(Function &F, LoopInfo &LI)
+{
+    auto It = Functions.find(F.getName());
+    if (It == Functions.end()) {
+      return;
+    }
+
+    LLVMContext &Context = F.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    unsigned Index = 0;
+
+    for (Loop *L : LI.getLoopsInPreorder()) {
+      auto Found = It->second.find(Index++);
+      if (Found == It->second.end() || Found->second.Header != getHeaderName(L->getHeader())) {
+        continue;
+      }
+
+      // A loop ID refers to itself first, the options of the loop follow.
+      SmallVector<Metadata *, 4> Operands{nullptr};
+      if (MDNode *ID = L->getLoopID()) {
+        for (unsigned i = 1; i < ID->getNumOperands(); i++) {
+          auto *Option = dyn_cast<MDNode>(ID->getOperand(i));
+          auto *Name = Option != nullptr && Option->getNumOperands() > 0
+                           ? dyn_cast<MDString>(Option->getOperand(0)) : nullptr;
+          if (Name == nullptr || Name->getString() != ProfileTag) {
+            Operands.push_back(ID->getOperand(i));
+          }
+        }
+      }
+
+      Operands.push_back(MDNode::get(Context, {MDString::get(Context, ProfileTag),
+                                               ConstantAsMetadata::get(ConstantInt::get(Int64Ty, Found->second.Entries)),
+                                               ConstantAsMetadata::get(ConstantInt::get(Int64Ty, Found->second.Backedges))}));
+      MDNode *ID = MDNode::getDistinct(Context, Operands);
+      ID->replaceOperandWith(0, ID);
+      L->setLoopID(ID);
+    }
+}
+
+bool LoopProfile::getCounts(const Loop *L, uint64_t &Entries, uint64_t &Backedges)
+{
+    MDNode *Option = findOptionMDForLoop(L, ProfileTag);
+    if (Option == nullptr || Option->getNumOperands() != 3) {
+      return false;
+    }
+
+    Entries = mdconst::extract<ConstantInt>(Option->getOperand(1))->getZExtValue();
+    Backedges = mdconst::extract<ConstantInt>(Option->getOperand(2))->getZExtValue();
+    return true;
+}
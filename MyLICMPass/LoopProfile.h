@@ -0,0 +1,40 @@
+#ifndef LLVM_PROJECT_LOOPPROFILE_H
+#define LLVM_PROJECT_LOOPPROFILE_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <map>
+#include <string>
+
+using namespace llvm;
+
+// Loop counts written by a program built with -our-loop-profile-gen. Every
+// line of the file is "<function> <loop> <header> <entries> <backedges>",
+// where loops are numbered in preorder of the unoptimized function and lines
+// for the same loop, from several runs or modules, are summed. annotate()
+// attaches the counts of a function's loops to their loop IDs, so they stay
+// with the loop through canonicalization, rotation and unswitching. A loop
+// whose header has a different name than when it was counted is left
+// without counts, the profile is stale for it.
+class LoopProfile {
+private:
+  struct Counts {
+    std::string Header;
+    uint64_t Entries = 0;
+    uint64_t Backedges = 0;
+  };
+
+  StringMap<std::map<unsigned, Counts>> Functions;
+
+public:
+  static StringRef getHeaderName(const BasicBlock *Header);
+
+  bool read(StringRef Path);
+  void annotate(Function &F, LoopInfo &LI);
+  static bool getCounts(const Loop *L, uint64_t &Entries, uint64_t &Backedges);
+};
+
+#endif // LLVM_PROJECT_LOOPPROFILE_H
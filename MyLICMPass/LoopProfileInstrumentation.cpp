@@ -0,0 +1,112 @@
+#include "LoopProfileInstrumentation.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+#include "LoopProfile.h"
+
+static cl::opt<std::string> ProfileOutput("loop-profile-file", cl::init("loops.prof"),
+                                          cl::desc("File the instrumented program appends its loop counts to"));
+
+void LoopProfileInstrumentation::collectLoops(Module &M)
+{
+    for (Function &F : M) {
+      if (F.isDeclaration()) {
+        continue;
+      }
+
+      LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+      unsigned Index = 0;
+      for (Loop *L : LI.getLoopsInPreorder()) {
+        LoopSite Site{F.getName().str(), Index++, LoopProfile::getHeaderName(L->getHeader()).str(), L->getHeader(), {}};
+        L->getLoopLatches(Site.Latches);
+        Sites.push_back(std::move(Site));
+      }
+    }
+}
+
+// Plain loads and stores, a program with threads may lose a few counts but never slows down on them.
+void LoopProfileInstrumentation::incrementCounter(GlobalVariable *Counters, unsigned Index, Instruction *InsertBefore)
+{
+    IRBuilder<> Builder(InsertBefore);
+    Type *Int64Ty = Builder.getInt64Ty();
+    Value *Counter = Builder.CreateConstInBoundsGEP2_64(Counters->getValueType(), Counters, 0, Index);
+    Value *Count = Builder.CreateLoad(Int64Ty, Counter, "loop.count");
+    Builder.CreateStore(Builder.CreateAdd(Count, Builder.getInt64(1)), Counter);
+}
+
+Function *LoopProfileInstrumentation::createWriter(Module &M, GlobalVariable *Counters)
+{
+    LLVMContext &Context = M.getContext();
+    Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+    Type *Int32Ty = Type::getInt32Ty(Context);
+    Type *Int64Ty = Type::getInt64Ty(Context);
+
+    FunctionCallee Open = M.getOrInsertFunction("fopen", FunctionType::get(Int8PtrTy, {Int8PtrTy, Int8PtrTy}, false));
+    FunctionCallee Print = M.getOrInsertFunction("fprintf", FunctionType::get(Int32Ty, {Int8PtrTy, Int8PtrTy}, true));
+    FunctionCallee Close = M.getOrInsertFunction("fclose", FunctionType::get(Int32Ty, {Int8PtrTy}, false));
+
+    Function *Writer = Function::Create(FunctionType::get(Type::getVoidTy(Context), false), GlobalValue::InternalLinkage,
+                                        "__our_loop_profile_write", M);
+    BasicBlock *Entry = BasicBlock::Create(Context, "entry", Writer);
+    BasicBlock *Write = BasicBlock::Create(Context, "write", Writer);
+    BasicBlock *Done = BasicBlock::Create(Context, "done", Writer);
+
+    IRBuilder<> Builder(Entry);
+    Value *File = Builder.CreateCall(Open, {Builder.CreateGlobalStringPtr(ProfileOutput), Builder.CreateGlobalStringPtr("a")},
+                                     "file");
+    Builder.CreateCondBr(Builder.CreateIsNull(File), Done, Write);
+
+    Builder.SetInsertPoint(Write);
+    Value *Format = Builder.CreateGlobalStringPtr("%s %u %s %llu %llu\n");
+    for (unsigned i = 0; i < Sites.size(); i++) {
+      Value *Headers = Builder.CreateLoad(Int64Ty, Builder.CreateConstInBoundsGEP2_64(Counters->getValueType(), Counters, 0, 2 * i));
+      Value *Backedges = Builder.CreateLoad(Int64Ty, Builder.CreateConstInBoundsGEP2_64(Counters->getValueType(), Counters, 0, 2 * i + 1));
+      Builder.CreateCall(Print, {File, Format, Builder.CreateGlobalStringPtr(Sites[i].Function), Builder.getInt32(Sites[i].Index),
+                                 Builder.CreateGlobalStringPtr(Sites[i].Header), Builder.CreateSub(Headers, Backedges), Backedges});
+    }
+    Builder.CreateCall(Close, {File});
+    Builder.CreateBr(Done);
+
+    Builder.SetInsertPoint(Done);
+    Builder.CreateRetVoid();
+    return Writer;
+}
+
+bool LoopProfileInstrumentation::runOnModule(Module &M) {
+    Sites.clear();
+    collectLoops(M);
+    if (Sites.empty()) {
+      return false;
+    }
+
+    auto *CountersTy = ArrayType::get(Type::getInt64Ty(M.getContext()), 2 * Sites.size());
+    auto *Counters = new GlobalVariable(M, CountersTy, false, GlobalValue::InternalLinkage,
+                                        ConstantAggregateZero::get(CountersTy), "__our_loop_counters");
+
+    for (unsigned i = 0; i < Sites.size(); i++) {
+      LoopSite &Site = Sites[i];
+      incrementCounter(Counters, 2 * i, &*Site.HeaderBlock->getFirstInsertionPt());
+
+      for (BasicBlock *Latch : Site.Latches) {
+        BasicBlock *Backedge = Latch->getSingleSuccessor() != nullptr ? Latch : SplitEdge(Latch, Site.HeaderBlock);
+        incrementCounter(Counters, 2 * i + 1, Backedge->getTerminator());
+      }
+    }
+
+    passOutput() << "Instrumented " << Sites.size() << " loops, counts go to " << ProfileOutput << "\n";
+    appendToGlobalDtors(M, createWriter(M, Counters), 0);
+    return true;
+}
+
+void LoopProfileInstrumentation::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<LoopInfoWrapperPass>();
+}
+
+char LoopProfileInstrumentation::ID = 0;
+static RegisterPass<LoopProfileInstrumentation> X("our-loop-profile-gen", "Our loop profile instrumentation pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,48 @@
+#ifndef LLVM_PROJECT_LOOPPROFILEINSTRUMENTATION_H
+#define LLVM_PROJECT_LOOPPROFILEINSTRUMENTATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+// Instruments every loop of a module with two counters in one global array:
+// executions of its header and of its backedges. Their difference is the
+// number of times the loop was entered. A destructor of the module appends
+// one line per loop to the file given by -loop-profile-file when the program
+// exits, in the format LoopProfile reads (see LoopProfile.h). Backedges from
+// latches that also leave the loop are split so only the taken backedge
+// counts.
+class LoopProfileInstrumentation : public ModulePass {
+private:
+  struct LoopSite {
+    std::string Function;
+    unsigned Index;
+    std::string Header;
+    BasicBlock *HeaderBlock;
+    SmallVector<BasicBlock *, 4> Latches;
+  };
+
+  std::vector<LoopSite> Sites;
+
+  void collectLoops(Module &M);
+  void incrementCounter(GlobalVariable *Counters, unsigned Index, Instruction *InsertBefore);
+  Function *createWriter(Module &M, GlobalVariable *Counters);
+
+public:
+  static char ID;
+  LoopProfileInstrumentation() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override;
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+};
+
+#endif // LLVM_PROJECT_LOOPPROFILEINSTRUMENTATION_H
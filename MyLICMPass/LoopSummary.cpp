@@ -0,0 +1,44 @@
+#include "LoopSummary.h"
+
+LoopSummary::LoopSummary(Loop *L, DominatorTree &DT)
+{
+  for (BasicBlock *BB : L->blocks()) {
+    for (BasicBlock *Succ : successors(BB)) {
+      if (!L->contains(Succ)) {
+        ExitBlocks.push_back(Succ);
+      }
+    }
+
+    for (Instruction &I : *BB) {
+      if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        StoreCounts[SI->getPointerOperand()]++;
+      }
+      else if (auto *Call = dyn_cast<CallBase>(&I)) {
+        CallsWithSideEffects |= Call->mayHaveSideEffects();
+      }
+      else {
+        OtherWrites |= I.mayWriteToMemory();
+      }
+
+      for (Use &U : I.operands()) {
+        if (U->getType()->isPointerTy()) {
+          ReferenceCounts[U.get()]++;
+        }
+      }
+    }
+  }
+
+  for (BasicBlock *BB : L->blocks()) {
+    bool DominatesAll = true;
+    for (BasicBlock *ExitBB : ExitBlocks) {
+      if (!DT.dominates(BB, ExitBB)) {
+        DominatesAll = false;
+        break;
+      }
+    }
+
+    if (DominatesAll) {
+      BlocksDominatingExits.insert(BB);
+    }
+  }
+}
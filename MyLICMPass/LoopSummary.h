@@ -0,0 +1,39 @@
+#ifndef LLVM_PROJECT_LOOPSUMMARY_H
+#define LLVM_PROJECT_LOOPSUMMARY_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+using namespace llvm;
+
+// Facts about a loop body gathered in a single pass over its instructions,
+// so the per-instruction queries of MyLICMPass are lookups instead of scans.
+// It describes the loop as it was when built and has to be dropped once the
+// loop is transformed.
+class LoopSummary {
+private:
+  SmallVector<BasicBlock *, 4> ExitBlocks;
+  SmallPtrSet<BasicBlock *, 16> BlocksDominatingExits;
+  DenseMap<Value *, unsigned> StoreCounts;
+  DenseMap<Value *, unsigned> ReferenceCounts;
+  bool CallsWithSideEffects = false;
+  bool OtherWrites = false;
+
+public:
+  LoopSummary(Loop *L, DominatorTree &DT);
+
+  ArrayRef<BasicBlock *> getExitBlocks() const { return ExitBlocks; }
+  bool doesBlockDominateAllExitBlocks(BasicBlock *BB) const { return BlocksDominatingExits.count(BB); }
+  unsigned getStoreCount(Value *Ptr) const { return StoreCounts.lookup(Ptr); }
+  unsigned getReferenceCount(Value *Ptr) const { return ReferenceCounts.lookup(Ptr); }
+  const DenseMap<Value *, unsigned> &getStoreCounts() const { return StoreCounts; }
+  bool hasCallsWithSideEffects() const { return CallsWithSideEffects; }
+  // Atomic read-modify-writes and the like, whose target is not tracked.
+  bool hasOtherWrites() const { return OtherWrites; }
+};
+
+#endif // LLVM_PROJECT_LOOPSUMMARY_H
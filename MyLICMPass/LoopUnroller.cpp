@@ -0,0 +1,219 @@
+#include "LoopUnroller.h"
+#include "PassOutput.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+
+LoopUnroller::LoopUnroller(Loop *L, StoreInst *Update, int64_t Start, uint64_t TripCount, unsigned FullThreshold,
+                           unsigned PartialThreshold, unsigned MaxFactor)
+    : L(L), Update(Update), Start(Start), TripCount(TripCount), FullThreshold(FullThreshold),
+      PartialThreshold(PartialThreshold), MaxFactor(MaxFactor)
+{
+    Counter = Update->getPointerOperand();
+    Step = cast<ConstantInt>(cast<BinaryOperator>(Update->getValueOperand())->getOperand(1))->getSExtValue();
+}
+
+// The latch has to test the updated counter itself, the new exit test of a partially unrolled loop replaces it.
+bool LoopUnroller::canUnroll()
+{
+    Header = L->getHeader();
+    Latch = L->getLoopLatch();
+    Preheader = L->getLoopPreheader();
+    if (TripCount == 0 || Latch == nullptr || Preheader == nullptr || L->getExitingBlock() != Latch ||
+        Update->getParent() != Latch) {
+      return false;
+    }
+
+    auto *Branch = dyn_cast<BranchInst>(Latch->getTerminator());
+    if (Branch == nullptr || !Branch->isConditional()) {
+      return false;
+    }
+    Exit = Branch->getSuccessor(L->contains(Branch->getSuccessor(0)) ? 1 : 0);
+
+    auto *Cmp = dyn_cast<ICmpInst>(Branch->getCondition());
+    auto *CounterLoad = Cmp != nullptr ? dyn_cast<LoadInst>(Cmp->getOperand(0)) : nullptr;
+    if (CounterLoad == nullptr || CounterLoad->getPointerOperand() != Counter ||
+        CounterLoad->getParent() != Latch || !Update->comesBefore(CounterLoad)) {
+      return false;
+    }
+
+    Blocks.assign(L->block_begin(), L->block_end());
+    for (BasicBlock *BB : Blocks) {
+      for (Instruction &I : *BB) {
+        auto *Call = dyn_cast<CallBase>(&I);
+        if (Call != nullptr && (Call->cannotDuplicate() || Call->isConvergent())) {
+          return false;
+        }
+      }
+    }
+    return true;
+}
+
+unsigned LoopUnroller::getSize()
+{
+    unsigned Size = 0;
+    for (BasicBlock *BB : Blocks) {
+      Size += BB->size();
+    }
+    return Size;
+}
+
+Value *LoopUnroller::lookupLast(Value *V)
+{
+    auto It = Last.find(V);
+    return It != Last.end() ? It->second : V;
+}
+
+SmallVector<BasicBlock *, 8> LoopUnroller::cloneBlocks(ValueToValueMapTy &VMap, const Twine &Suffix)
+{
+    SmallVector<BasicBlock *, 8> NewBlocks;
+    for (BasicBlock *BB : Blocks) {
+      BasicBlock *NewBB = CloneBasicBlock(BB, VMap, Suffix, Header->getParent());
+      VMap[BB] = NewBB;
+      NewBlocks.push_back(NewBB);
+    }
+    return NewBlocks;
+}
+
+// Only the latch runs after the update, every other block still sees this iteration's counter.
+void LoopUnroller::replaceCounterLoads(ArrayRef<BasicBlock *> Copy, StoreInst *CopyUpdate, uint64_t Iteration)
+{
+    for (BasicBlock *BB : Copy) {
+      for (Instruction &I : make_early_inc_range(*BB)) {
+        auto *Load = dyn_cast<LoadInst>(&I);
+        if (Load == nullptr || Load->getPointerOperand() != Counter || !Load->getType()->isIntegerTy()) {
+          continue;
+        }
+
+        uint64_t Iterations = BB == CopyUpdate->getParent() && CopyUpdate->comesBefore(Load) ? Iteration + 1 : Iteration;
+        Load->replaceAllUsesWith(ConstantInt::getSigned(Load->getType(), Start + int64_t(Iterations) * Step));
+        Load->eraseFromParent();
+      }
+    }
+}
+
+bool LoopUnroller::run()
+{
+    if (!canUnroll()) {
+      return false;
+    }
+
+    unsigned Size = getSize();
+    bool Full = TripCount <= FullThreshold / Size;
+    uint64_t Factor = Full ? TripCount : std::min<uint64_t>(MaxFactor, PartialThreshold / Size);
+    if (!Full && (Factor < 2 || Factor >= TripCount)) {
+      return false;
+    }
+
+    uint64_t Remainder = TripCount % Factor;
+    if (Full) {
+      passOutput() << "Fully unrolling loop with header: " << Header->getName() << " (" << TripCount << " iterations)\n";
+    }
+    else {
+      passOutput() << "Unrolling loop with header: " << Header->getName() << " by " << Factor << ", remainder " << Remainder
+             << "\n";
+    }
+
+    Function *F = Header->getParent();
+    auto *CounterLoad = cast<LoadInst>(cast<ICmpInst>(cast<BranchInst>(Latch->getTerminator())->getCondition())->getOperand(0));
+
+    // Cloned from the loop before it is changed, entered with the values the last unrolled iteration leaves.
+    ValueToValueMapTy RemainderMap;
+    BasicBlock *RemainderEntry = nullptr, *RemainderLatch = nullptr;
+    if (Remainder > 0) {
+      SmallVector<BasicBlock *, 8> RemainderBlocks = cloneBlocks(RemainderMap, ".rem");
+      remapInstructionsInBlocks(RemainderBlocks, RemainderMap);
+
+      auto *RemainderHeader = cast<BasicBlock>(RemainderMap[Header]);
+      RemainderLatch = cast<BasicBlock>(RemainderMap[Latch]);
+      RemainderEntry = BasicBlock::Create(F->getContext(), "unroll.remainder", F, RemainderHeader);
+      BranchInst::Create(RemainderHeader, RemainderEntry);
+      RemainderHeader->replacePhiUsesWith(Preheader, RemainderEntry);
+    }
+
+    std::vector<SmallVector<BasicBlock *, 8>> Copies;
+    std::vector<StoreInst *> Updates;
+    Copies.emplace_back(Blocks.begin(), Blocks.end());
+    Updates.push_back(Update);
+
+    BasicBlock *LastLatch = Latch;
+    for (uint64_t k = 1; k < Factor; k++) {
+      ValueToValueMapTy VMap;
+      SmallVector<BasicBlock *, 8> NewBlocks = cloneBlocks(VMap, ".unroll" + Twine(k));
+
+      // A copy is entered from the previous one only, its header PHIs are the values that one passes on.
+      for (PHINode &PN : Header->phis()) {
+        auto *Copy = cast<PHINode>(VMap[&PN]);
+        VMap[&PN] = lookupLast(PN.getIncomingValueForBlock(Latch));
+        Copy->eraseFromParent();
+      }
+      remapInstructionsInBlocks(NewBlocks, VMap);
+
+      LastLatch->getTerminator()->eraseFromParent();
+      BranchInst::Create(cast<BasicBlock>(VMap[Header]), LastLatch);
+      LastLatch = cast<BasicBlock>(VMap[Latch]);
+
+      for (auto Entry : VMap) {
+        Last[const_cast<Value *>(Entry.first)] = Entry.second;
+      }
+      Copies.push_back(NewBlocks);
+      Updates.push_back(cast<StoreInst>(VMap[Update]));
+    }
+
+    for (PHINode &PN : Exit->phis()) {
+      int Index = PN.getBasicBlockIndex(Latch);
+      Value *Incoming = PN.getIncomingValue(Index);
+      if (RemainderLatch != nullptr) {
+        Value *Mapped = RemainderMap.lookup(Incoming);
+        PN.setIncomingValue(Index, Mapped != nullptr ? Mapped : Incoming);
+        PN.setIncomingBlock(Index, RemainderLatch);
+      }
+      else {
+        PN.setIncomingValue(Index, lookupLast(Incoming));
+        PN.setIncomingBlock(Index, LastLatch);
+      }
+    }
+
+    if (RemainderEntry != nullptr) {
+      for (PHINode &PN : Header->phis()) {
+        auto *RemainderPN = cast<PHINode>(RemainderMap[&PN]);
+        RemainderPN->setIncomingValue(RemainderPN->getBasicBlockIndex(RemainderEntry),
+                                      lookupLast(PN.getIncomingValueForBlock(Latch)));
+      }
+    }
+
+    Instruction *Terminator = LastLatch->getTerminator();
+    if (Full) {
+      BranchInst::Create(Exit, LastLatch);
+      Terminator->eraseFromParent();
+
+      // Only the preheader enters the first copy now.
+      for (PHINode &PN : make_early_inc_range(Header->phis())) {
+        PN.replaceAllUsesWith(PN.getIncomingValueForBlock(Preheader));
+        PN.eraseFromParent();
+      }
+
+      for (uint64_t k = 0; k < Factor; k++) {
+        replaceCounterLoads(Copies[k], Updates[k], k);
+      }
+      return true;
+    }
+
+    // The counter only ever steps from Start, so it is exactly this value once the unrolled iterations are done.
+    int64_t End = Start + int64_t(TripCount - Remainder) * Step;
+    IRBuilder<> Builder(Terminator);
+    Value *Continue = Builder.CreateICmpNE(lookupLast(CounterLoad), ConstantInt::getSigned(CounterLoad->getType(), End),
+                                           "unroll.continue");
+    BranchInst::Create(Header, RemainderEntry != nullptr ? RemainderEntry : Exit, Continue, LastLatch);
+    Terminator->eraseFromParent();
+
+    for (PHINode &PN : Header->phis()) {
+      int Index = PN.getBasicBlockIndex(Latch);
+      PN.setIncomingValue(Index, lookupLast(PN.getIncomingValue(Index)));
+      PN.setIncomingBlock(Index, LastLatch);
+    }
+    return true;
+}
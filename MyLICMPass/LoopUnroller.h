@@ -0,0 +1,53 @@
+#ifndef LLVM_PROJECT_LOOPUNROLLER_H
+#define LLVM_PROJECT_LOOPUNROLLER_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// Unrolling of a rotated innermost loop with an exact trip count, whose
+// counter "i += Step" is only updated in the exiting latch. A loop whose
+// copies all fit in the full threshold is replaced by straight line code,
+// where every load of the counter becomes the constant it reads in that
+// iteration. Otherwise the body is repeated as often as the partial
+// threshold allows, the unrolled loop leaves once the counter reaches the
+// last multiple of the factor and a copy of the original loop runs the
+// remaining iterations.
+class LoopUnroller {
+private:
+  Loop *L;
+  StoreInst *Update;
+  Value *Counter;
+  int64_t Start;
+  int64_t Step;
+  uint64_t TripCount;
+  unsigned FullThreshold;
+  unsigned PartialThreshold;
+  unsigned MaxFactor;
+
+  BasicBlock *Header = nullptr, *Latch = nullptr, *Preheader = nullptr, *Exit = nullptr;
+  std::vector<BasicBlock *> Blocks;
+  // Every value of the loop to its counterpart in the last copy made.
+  DenseMap<Value *, Value *> Last;
+
+  bool canUnroll();
+  unsigned getSize();
+  Value *lookupLast(Value *V);
+  SmallVector<BasicBlock *, 8> cloneBlocks(ValueToValueMapTy &VMap, const Twine &Suffix);
+  void replaceCounterLoads(ArrayRef<BasicBlock *> Copy, StoreInst *CopyUpdate, uint64_t Iteration);
+
+public:
+  LoopUnroller(Loop *L, StoreInst *Update, int64_t Start, uint64_t TripCount, unsigned FullThreshold,
+               unsigned PartialThreshold, unsigned MaxFactor);
+
+  bool run();
+};
+
+#endif // LLVM_PROJECT_LOOPUNROLLER_H
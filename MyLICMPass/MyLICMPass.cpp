@@ -1,4 +1,5 @@
 #include "llvm/Pass.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstIterator.h"
@@ -6,100 +7,333 @@
 #include "llvm/IR/Value.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopRotationUtils.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
+#include "AttributeInference.h"
+#include "CFGSimplification.h"
 #include "ConstantFolding.h"
 #include "ConstantPropagation.h"
 #include "DeadCodeElimination.h"
+#include "GlobalConstantPropagation.h"
+#include "LoopFusion.h"
+#include "LoopProfile.h"
+#include "LoopSummary.h"
+#include "LoopUnroller.h"
+#include "PassOutput.h"
+#include "Reassociation.h"
+#include "ReductionVectorizer.h"
+#include "RegisterPressure.h"
+#include "ScalarReplacement.h"
+#include "StrengthReduction.h"
+#include "PartialRedundancyElimination.h"
 
+#include <algorithm>
 #include <vector>
 #include <map>
+#include <memory>
 
 using namespace llvm;
 
+static cl::opt<bool> EnableRotation("licm-rotate", cl::init(true),
+                                    cl::desc("Rotate header-tested loops into guarded do-while form before hoisting"));
+
+static cl::opt<unsigned> RotationMaxHeaderSize("licm-rotation-max-header-size", cl::init(16),
+                                               cl::desc("Largest loop header (in instructions) that is duplicated by rotation"));
+
+static cl::opt<bool> EnableFusion("licm-fuse", cl::init(true),
+                                  cl::desc("Fuse adjacent loops that run over the same range before hoisting"));
+
+static cl::opt<bool> EnableCallHoisting("licm-hoist-calls", cl::init(true),
+                                        cl::desc("Infer function attributes and hoist invariant calls that do not write memory"));
+
+static cl::opt<bool> EnableGlobalConstants("licm-global-constants", cl::init(true),
+                                           cl::desc("Replace loads of globals that are never written with their initializers"));
+
+static cl::opt<bool> EnableReassociation("licm-reassociate", cl::init(true),
+                                         cl::desc("Reassociate expressions in loops so their invariant operands can be hoisted together"));
+
+static cl::opt<bool> EnableReciprocals("licm-reciprocals", cl::init(true),
+                                       cl::desc("Multiply by the hoisted reciprocal of an invariant divisor where arcp allows it"));
+
+static cl::opt<bool> EnableRegisterBudget("licm-register-pressure", cl::init(true),
+                                          cl::desc("Stop hoisting values that stay live across the loop once its register classes are full"));
+
+static cl::opt<unsigned> MaxLiveRegisters("licm-max-registers", cl::init(0),
+                                          cl::desc("Registers per class available across a loop, 0 asks the target"));
+
+static cl::opt<unsigned> RematerializationCost("licm-remat-cost", cl::init(1),
+                                               cl::desc("Largest cost of a value that is recomputed in the loop instead of kept live"));
+
+static cl::opt<bool> EnableScalarReplacement("licm-scalar-replacement", cl::init(true),
+                                             cl::desc("Reuse array elements loaded by earlier iterations of a loop"));
+
+static cl::opt<unsigned> ScalarReplacementDistance("licm-scalar-replacement-distance", cl::init(4),
+                                                   cl::desc("Most iterations an array element is kept in a register"));
+
+static cl::opt<bool> EnableVectorization("licm-vectorize", cl::init(true),
+                                         cl::desc("Vectorize reductions in innermost loops with a constant trip count"));
+
+static cl::opt<unsigned> VectorWidth("licm-vector-width", cl::init(0),
+                                     cl::desc("Lanes of the vectorized loops, 0 fills a vector register of the target"));
+
+static cl::opt<bool> EnableUnroll("licm-unroll", cl::init(true),
+                                  cl::desc("Unroll innermost loops with a constant trip count after hoisting"));
+
+static cl::opt<unsigned> UnrollThreshold("licm-unroll-threshold", cl::init(128),
+                                         cl::desc("Most instructions a fully unrolled loop may have"));
+
+static cl::opt<unsigned> UnrollPartialThreshold("licm-unroll-partial-threshold", cl::init(64),
+                                                cl::desc("Most instructions in the body of a partially unrolled loop"));
+
+static cl::opt<unsigned> UnrollMaxFactor("licm-unroll-max-factor", cl::init(8),
+                                         cl::desc("Most copies of the body in a partially unrolled loop"));
+
+static cl::opt<bool> EnableStrengthReduction("licm-strength-reduce", cl::init(true),
+                                             cl::desc("Replace address and multiply chains of the loop counter by recurrences"));
+
+static cl::opt<unsigned> MaxRecurrences("licm-max-recurrences", cl::init(8),
+                                        cl::desc("Most recurrences strength reduction adds to a loop"));
+
+static cl::opt<bool> EnableSimplifyCFG("licm-simplify-cfg", cl::init(true),
+                                       cl::desc("Merge, forward and thread the blocks left behind once loops are transformed"));
+
+static cl::opt<std::string> ProfileFile("licm-profile", cl::init(""),
+                                        cl::desc("Loop profile written by a program built with -our-loop-profile-gen"));
+
+static cl::opt<unsigned> ProfileHotTripCount("licm-profile-hot-trip-count", cl::init(1000),
+                                             cl::desc("Average iterations per entry from which a profiled loop is unrolled more"));
+
+static cl::opt<bool> EnablePRE("licm-pre", cl::init(false),
+                               cl::desc("Run lazy code motion over the whole function before hoisting"));
+
+static cl::opt<bool> EnableUnswitch("licm-unswitch", cl::init(true),
+                                    cl::desc("Unswitch loops on loop invariant conditions before hoisting"));
+
+static cl::opt<unsigned> UnswitchBudget("licm-unswitch-budget", cl::init(200),
+                                        cl::desc("Number of instructions non-trivial unswitching may duplicate per function"));
+
 namespace {
     struct MyLICMPass : public FunctionPass {
         static char ID;
         MyLICMPass() : FunctionPass(ID) {}
 
+        // Owned by the pass and reused for every function, each resets its own state per run.
+        ConstantPropagation Propagation;
+        ConstantFolding Folding;
+        DeadCodeElimination Elimination;
+        AttributeInference Inference;
+        GlobalConstantPropagation Globals;
+        Reassociation Reassociator;
+        PartialRedundancyElimination Redundancy;
+        CFGSimplification Simplifier;
+        LoopProfile Profile;
+        bool HasProfile = false;
+
+        // Built on first use for every loop of the current function, dropped whenever the loop changes.
+        DenseMap<Loop *, std::unique_ptr<LoopSummary>> Summaries;
+        DominatorTree *DomTree = nullptr;
+
+        bool doInitialization(Module &M) override {
+            if (!ProfileFile.empty()) {
+                HasProfile = Profile.read(ProfileFile);
+            }
+
+            bool Changed = EnableGlobalConstants && Globals.runOnModule(M);
+            Changed |= EnableCallHoisting && Inference.runOnModule(M);
+            return Changed;
+        }
+
         bool runOnFunction(Function &F) override {
             bool Changed = false;
             LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
             DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+            DomTree = &DT;
+            Summaries.clear();
 
-            errs() << "Processing function: " << F.getName() << "\n";
+            passOutput() << "Processing function: " << F.getName() << "\n";
 
-            ConstantPropagation *Propagation = new ConstantPropagation();
-            ConstantFolding *Folding = new ConstantFolding();
-            DeadCodeElimination *Elimination = new DeadCodeElimination();        
+            // Loops are numbered as in the unoptimized function the profile was taken from.
+            if (HasProfile) {
+                Profile.annotate(F, LI);
+            }
 
             bool prepChanged;
             /*do {
                 prepChanged = false;
-                errs() << "Running Constant Propagation\n";
-                prepChanged |= Propagation->runOnFunction(F);
-                errs() << "Running Constant Folding\n";
-                prepChanged |= Folding->runOnFunction(F);
-                errs() << "Running Dead Code Elimination\n";
-                prepChanged |= Elimination->runOnFunction(F);
+                passOutput() << "Running Constant Propagation\n";
+                prepChanged |= Propagation.runOnFunction(F);
+                passOutput() << "Running Constant Folding\n";
+                prepChanged |= Folding.runOnFunction(F);
+                passOutput() << "Running Dead Code Elimination\n";
+                prepChanged |= Elimination.runOnFunction(F);
             } while(prepChanged);
             Changed = prepChanged;*/
 
+            Changed |= canonicalizeLoops(F, LI, DT);
+
+            if (EnableUnswitch) {
+                Changed |= unswitchLoops(F, LI, DT);
+            }
+
+            // Splits critical edges, loops can gain latches and exit blocks.
+            if (EnablePRE && Redundancy.runOnFunction(F)) {
+                Changed = true;
+                DT.recalculate(F);
+                LI.releaseMemory();
+                LI.analyze(DT);
+                Summaries.clear();
+            }
+
+            const TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+
             for (Loop *L: LI) {
                 if (!L->getLoopPreheader()) {
-                    errs() << "No loop preheader, skipping loop.\n";
+                    passOutput() << "No loop preheader, skipping loop.\n";
                     continue;
                 }
 
+                if (neverIterates(L)) {
+                    passOutput() << "Loop never iterates in the profile, skipping loop.\n";
+                    continue;
+                }
+
+                // Hoisting lets reassociation group invariants that were spread over an expression,
+                // so repeat until nothing moves.
                 std::vector<Instruction *> instructionsToMove;
+                do {
+                    instructionsToMove.clear();
 
-                for (BasicBlock *BB: L->blocks()) {
-                    for (Instruction &I: *BB) {
-                        Changed |= isInvariantInstruction(&I, L, DT, instructionsToMove);
+                    if (EnableReassociation) {
+                        for (BasicBlock *BB: L->blocks()) {
+                            Changed |= Reassociator.reassociateBlock(*BB, LI);
+                        }
+                    }
+
+                    if (EnableReciprocals) {
+                        for (BasicBlock *BB: L->blocks()) {
+                            Changed |= replaceInvariantDivisions(*BB, L);
+                        }
+                    }
+
+                    for (BasicBlock *BB: L->blocks()) {
+                        for (Instruction &I: *BB) {
+                            Changed |= isInvariantInstruction(&I, L, DT, instructionsToMove);
+                        }
+                    }
+
+                    SmallPtrSet<Instruction *, 16> toRematerialize;
+                    if (EnableRegisterBudget) {
+                        RegisterPressure Pressure(L, TTI, MaxLiveRegisters, RematerializationCost);
+                        Pressure.selectCandidates(instructionsToMove, toRematerialize);
                     }
-                }
 
-                for (Instruction *I: instructionsToMove) {
-                    errs() << "Instruction to move: " << *I << "\n";
-                    errs() << "Where to move it: " << *L->getLoopPreheader()->getTerminator() << "\n";
-                    I->moveBefore(L->getLoopPreheader()->getTerminator());
+                    // A rematerialized value stays in the loop, the hoisted instructions use a copy of it.
+                    ValueToValueMapTy Copies;
+                    for (Instruction *I: instructionsToMove) {
+                        if (toRematerialize.count(I)) {
+                            Instruction *Copy = I->clone();
+                            Copy->setName(I->getName() + ".remat");
+                            Copy->insertBefore(L->getLoopPreheader()->getTerminator());
+                            RemapInstruction(Copy, Copies, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+                            Copies[I] = Copy;
+                            passOutput() << "Instruction to rematerialize: " << *I << "\n";
+                            continue;
+                        }
+
+                        passOutput() << "Instruction to move: " << *I << "\n";
+                        passOutput() << "Where to move it: " << *L->getLoopPreheader()->getTerminator() << "\n";
+                        RemapInstruction(I, Copies, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+                        I->moveBefore(L->getLoopPreheader()->getTerminator());
+                        Changed = true;
+                    }
+                    Summaries.erase(L);
+                } while (!instructionsToMove.empty());
+            }
+
+            if (EnableScalarReplacement) {
+                for (Loop *L: LI.getLoopsInPreorder()) {
+                    Changed |= replaceArrayLoads(L, DT);
                 }
             }
 
+            if (EnableVectorization) {
+                Changed |= vectorizeLoops(F, LI, DT, TTI);
+            }
+
+            if (EnableUnroll) {
+                Changed |= unrollLoops(F, LI, DT);
+            }
+
+            if (EnableStrengthReduction) {
+                Changed |= reduceStrength(LI);
+            }
+
+            // Unswitching and unrolling leave folded branches and chains of blocks behind.
+            if (EnableSimplifyCFG && Simplifier.runOnFunction(F)) {
+                Changed = true;
+                DT.recalculate(F);
+                LI.releaseMemory();
+                LI.analyze(DT);
+                Summaries.clear();
+            }
+
             /*do {
                 prepChanged = false;
-                errs() << "Running Constant Propagation\n";
-                prepChanged |= Propagation->runOnFunction(F);
-                errs() << "Running Constant Folding\n";
-                prepChanged |= Folding->runOnFunction(F);
-                errs() << "Running Dead Code Elimination\n";
-                prepChanged |= Elimination->runOnFunction(F);
+                passOutput() << "Running Constant Propagation\n";
+                prepChanged |= Propagation.runOnFunction(F);
+                passOutput() << "Running Constant Folding\n";
+                prepChanged |= Folding.runOnFunction(F);
+                passOutput() << "Running Dead Code Elimination\n";
+                prepChanged |= Elimination.runOnFunction(F);
             } while(prepChanged);*/
 
-            errs() << Changed << " changed!\n";
+            passOutput() << Changed << " changed!\n";
             return Changed;
         }
 
         void getAnalysisUsage(AnalysisUsage &AU) const override {
             AU.addRequired<LoopInfoWrapperPass>();
             AU.addRequired<DominatorTreeWrapperPass>();
-            AU.setPreservesAll();
+            AU.addRequired<AssumptionCacheTracker>();
+            AU.addRequired<TargetTransformInfoWrapperPass>();
+            // Nothing is preserved, rotation, unswitching, unrolling and CFG simplification reshape the loops.
         }
 
         bool isInvariantInstruction(Instruction *I, Loop *L, DominatorTree &DT, std::vector<Instruction *>& instructionsToMove) {
             if (isDesiredInstructionType(I) &&
-                areAllOperandsConstantsOrComputedOutsideLoop(I, L) &&
+                areAllOperandsConstantsOrComputedOutsideLoop(I, L, instructionsToMove) &&
                 isSafeToSpeculativelyExecute(I) &&
-                doesBlockDominateAllExitBlocks(I->getParent(), L, &DT)) {
+                (isFloatingPointArithmetic(I) || doesBlockDominateAllExitBlocks(I->getParent(), L))) {
                 instructionsToMove.push_back(I);
             }
 
+            else if (auto *Load = dyn_cast<LoadInst>(I)) {
+                if (isInvariantLoad(Load, L)) {
+                    instructionsToMove.push_back(I);
+                }
+            }
+
+            else if (auto *Call = dyn_cast<CallInst>(I)) {
+                if (isInvariantCall(Call, L, instructionsToMove)) {
+                    instructionsToMove.push_back(I);
+                }
+            }
+
             else if (auto *SI = dyn_cast<StoreInst>(I)) {
                 if (!isChangedInLoop(SI, SI->getPointerOperand(), L)) {
                     Value *StoredVal = SI->getValueOperand();
@@ -109,14 +343,14 @@ namespace {
                 }
             }
 
-            else if (isIncrementOrDecrement(I) && I->getParent() != L->getHeader() && I->getParent() != L->getLoopLatch()) {
+            else if (isIncrementOrDecrement(I) && executesOncePerIteration(I->getParent(), L, DT)) {
                 Value *IterationCount = getLoopIterationCount(L);
                 if(IterationCount != nullptr)
                 {
-                    errs() << "IterationCount: " << *IterationCount << "\n";
+                    passOutput() << "IterationCount: " << *IterationCount << "\n";
                     ConstantInt *IterationsConst = dyn_cast<ConstantInt>(IterationCount);
                     if (IterationsConst != nullptr) {
-                        errs() << "IterationsConst: " << *IterationsConst << "\n";
+                        passOutput() << "IterationsConst: " << *IterationsConst << "\n";
                         if (auto *SI = dyn_cast<StoreInst>(I->getNextNode())) {
                             if (auto *LI = dyn_cast<LoadInst>(I->getPrevNode())) {
                                 if (!isReferencedInLoop(SI, LI, SI->getPointerOperand(), L)) {                                
@@ -138,7 +372,7 @@ namespace {
                                     instructionsToMove.push_back(SI);
 
                                     for (Instruction *Instr : instructionsToMove) {
-                                        errs() << *Instr << "\n";
+                                        passOutput() << *Instr << "\n";
                                     }
 
                                     return true;
@@ -152,70 +386,346 @@ namespace {
             return false;
         }
 
+        // Exact trip count of a counted loop "for (i = Start; i Pred Bound; i += Step)":
+        // a single exit tested either at the top of every iteration or, for rotated
+        // and do-while loops, by the latch right after the update, and a counter only
+        // the latch updates. A loop tested in its latch runs its body once before the
+        // first test, whether or not a guard skips it when Start already fails.
         Value* getLoopIterationCount(Loop *L) {
-            BasicBlock* Header = L->getHeader();
-            Value *HeaderOp = nullptr;
+            BasicBlock *Exiting = L->getExitingBlock();
+            BasicBlock *Latch = L->getLoopLatch();
+            BasicBlock *Preheader = L->getLoopPreheader();
+            if (Exiting == nullptr || Latch == nullptr || Preheader == nullptr) {
+                return nullptr;
+            }
 
-            for (Instruction &I : *Header) {
-                if (auto *CI = dyn_cast<CmpInst>(&I)) {
-                    if (CI->getOpcode() == Instruction::ICmp) {
-                        if(HeaderOp != nullptr){
-                            return nullptr;
+            BasicBlock *Current = L->getHeader();
+            while (Current != Exiting && Exiting != Latch) {
+                auto *BI = dyn_cast<BranchInst>(Current->getTerminator());
+                if (BI == nullptr || BI->isConditional()) {
+                    return nullptr;
+                }
+                Current = BI->getSuccessor(0);
+                if (!L->contains(Current) || Current == L->getHeader()) {
+                    return nullptr;
+                }
+            }
+
+            auto *ExitBranch = dyn_cast<BranchInst>(Exiting->getTerminator());
+            if (ExitBranch == nullptr || !ExitBranch->isConditional()) {
+                return nullptr;
+            }
+
+            auto *Cmp = dyn_cast<ICmpInst>(ExitBranch->getCondition());
+            if (Cmp == nullptr) {
+                return nullptr;
+            }
+
+            auto *CounterLoad = dyn_cast<LoadInst>(Cmp->getOperand(0));
+            auto *Bound = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+            if (CounterLoad == nullptr || Bound == nullptr || CounterLoad->getParent() != Exiting) {
+                return nullptr;
+            }
+
+            Value *Counter = CounterLoad->getPointerOperand();
+            StoreInst *Update = findCounterUpdate(L, Counter);
+            if (Update == nullptr) {
+                return nullptr;
+            }
+
+            // In a rotated loop the exit test has to see the updated counter.
+            if (Exiting == Latch && !Update->comesBefore(CounterLoad)) {
+                return nullptr;
+            }
+
+            auto *LatchOp = cast<ConstantInt>(cast<BinaryOperator>(Update->getValueOperand())->getOperand(1));
+
+            ConstantInt *StartOp = findCounterStart(L, Counter);
+            if (StartOp == nullptr) {
+                return nullptr;
+            }
+
+            CmpInst::Predicate Pred = Cmp->getPredicate();
+            if (!L->contains(ExitBranch->getSuccessor(0))) {
+                Pred = CmpInst::getInversePredicate(Pred);
+            }
+
+            int64_t Start = StartOp->getSExtValue(), End = Bound->getSExtValue(), Step = LatchOp->getSExtValue();
+            if (Pred == ICmpInst::ICMP_SLE && Step > 0) {
+                End++;
+                Pred = ICmpInst::ICMP_SLT;
+            }
+            else if (Pred == ICmpInst::ICMP_SGE && Step < 0) {
+                End--;
+                Pred = ICmpInst::ICMP_SGT;
+            }
+
+            int64_t Count;
+            if (Pred == ICmpInst::ICMP_SLT && Step > 0) {
+                Count = End > Start ? (End - Start + Step - 1) / Step : 0;
+            }
+            else if (Pred == ICmpInst::ICMP_SGT && Step < 0) {
+                Count = Start > End ? (Start - End - Step - 1) / -Step : 0;
+            }
+            else if (Pred == ICmpInst::ICMP_NE && (End - Start) % Step == 0 && (End - Start) / Step >= 0) {
+                Count = (End - Start) / Step;
+            }
+            else {
+                return nullptr;
+            }
+
+            if (Exiting == Latch) {
+                Count = std::max<int64_t>(Count, 1);
+            }
+
+            passOutput() << "Start: " << Start << " Bound: " << End << " Step: " << Step << " Iterations: " << Count << "\n";
+            return ConstantInt::get(Bound->getType(), Count);
+        }
+
+        // The initial store may sit above the preheader, e.g. before the guard of a rotated loop.
+        ConstantInt *findCounterStart(Loop *L, Value *Counter) {
+            for (BasicBlock *BB = L->getLoopPreheader(); BB != nullptr; BB = BB->getSinglePredecessor()) {
+                for (auto It = BB->rbegin(); It != BB->rend(); ++It) {
+                    if (auto *SI = dyn_cast<StoreInst>(&*It)) {
+                        if (SI->getPointerOperand() == Counter) {
+                            return dyn_cast<ConstantInt>(SI->getValueOperand());
                         }
-                        HeaderOp = CI->getOperand(1);
-                        if(!isa<ConstantInt>(HeaderOp) && isChangedInLoop(&I, HeaderOp, L)){
+                    }
+                    if (auto *Call = dyn_cast<CallBase>(&*It)) {
+                        if (Call->mayHaveSideEffects() && !isNonEscapingAlloca(Counter)) {
                             return nullptr;
                         }
                     }
                 }
+                if (BB == &BB->getParent()->getEntryBlock()) {
+                    break;
+                }
+            }
+            return nullptr;
+        }
+
+        // The original loop is left as the epilogue, unreachable when the vector width divides the trip count.
+        bool vectorizeLoops(Function &F, LoopInfo &LI, DominatorTree &DT, const TargetTransformInfo &TTI) {
+            bool Changed = false;
+
+            for (Loop *L: LI.getLoopsInPreorder()) {
+                if (!L->isInnermost() || L->getExitingBlock() != L->getLoopLatch() || hasValuesUsedOutsideLoop(L) ||
+                    neverIterates(L)) {
+                    continue;
+                }
+
+                auto *Count = dyn_cast_or_null<ConstantInt>(getLoopIterationCount(L));
+                if (Count == nullptr) {
+                    continue;
+                }
+
+                auto *Cmp = cast<ICmpInst>(cast<BranchInst>(L->getLoopLatch()->getTerminator())->getCondition());
+                Value *Counter = cast<LoadInst>(Cmp->getOperand(0))->getPointerOperand();
+                ReductionVectorizer Vectorizer(L, findCounterUpdate(L, Counter), findCounterStart(L, Counter)->getSExtValue(),
+                                               Count->getZExtValue(), TTI, VectorWidth);
+                Changed |= Vectorizer.run();
+            }
+
+            if (Changed) {
+                Elimination.removeUnreachableBlocks(F);
+                DT.recalculate(F);
+                LI.releaseMemory();
+                LI.analyze(DT);
+                Summaries.clear();
+            }
+            return Changed;
+        }
+
+        // Innermost rotated loops with an exact trip count. The copies of a fully unrolled loop read
+        // the counter as constants, so folding decides the branches on it and DCE drops the rest.
+        bool unrollLoops(Function &F, LoopInfo &LI, DominatorTree &DT) {
+            bool Changed = false;
+
+            for (Loop *L: LI.getLoopsInPreorder()) {
+                if (!L->isInnermost() || L->getExitingBlock() != L->getLoopLatch() || hasValuesUsedOutsideLoop(L) ||
+                    neverIterates(L)) {
+                    continue;
+                }
+
+                auto *Count = dyn_cast_or_null<ConstantInt>(getLoopIterationCount(L));
+                if (Count == nullptr) {
+                    continue;
+                }
+
+                // Code growth pays off most where the profile shows the loop spending its time.
+                unsigned Scale = isHotLoop(L) ? 2 : 1;
+                auto *Cmp = cast<ICmpInst>(cast<BranchInst>(L->getLoopLatch()->getTerminator())->getCondition());
+                Value *Counter = cast<LoadInst>(Cmp->getOperand(0))->getPointerOperand();
+                LoopUnroller Unroller(L, findCounterUpdate(L, Counter), findCounterStart(L, Counter)->getSExtValue(),
+                                      Count->getZExtValue(), UnrollThreshold * Scale, UnrollPartialThreshold * Scale,
+                                      UnrollMaxFactor * Scale);
+                Changed |= Unroller.run();
+            }
+
+            if (!Changed) {
+                return false;
+            }
+
+            bool Folded = true;
+            while (Folded) {
+                Folded = Folding.runOnFunction(F);
+                Folded |= Elimination.runOnFunction(F);
+            }
+
+            DT.recalculate(F);
+            LI.releaseMemory();
+            LI.analyze(DT);
+            Summaries.clear();
+            return true;
+        }
+
+        // Runs on what unrolling and vectorization left, both of them want the counter loads of the body.
+        bool reduceStrength(LoopInfo &LI) {
+            bool Changed = false;
+
+            for (Loop *L: LI.getLoopsInPreorder()) {
+                if (!L->isInnermost() || L->getExitingBlock() != L->getLoopLatch() || neverIterates(L)) {
+                    continue;
+                }
+
+                auto *Exit = dyn_cast<BranchInst>(L->getLoopLatch()->getTerminator());
+                auto *Cmp = Exit != nullptr && Exit->isConditional() ? dyn_cast<ICmpInst>(Exit->getCondition()) : nullptr;
+                auto *CounterLoad = Cmp != nullptr ? dyn_cast<LoadInst>(Cmp->getOperand(0)) : nullptr;
+                StoreInst *Update = CounterLoad != nullptr ? findCounterUpdate(L, CounterLoad->getPointerOperand()) : nullptr;
+                if (Update == nullptr) {
+                    continue;
+                }
+
+                auto *Count = dyn_cast_or_null<ConstantInt>(getLoopIterationCount(L));
+                StrengthReduction Reduction(L, Update, findCounterStart(L, Update->getPointerOperand()),
+                                            Count != nullptr ? Count->getZExtValue() : 0, MaxRecurrences);
+                Changed |= Reduction.run();
+            }
+
+            // A removed counter may have been read by the summaries of other loops.
+            if (Changed) {
+                Summaries.clear();
+            }
+            return Changed;
+        }
+
+        bool replaceArrayLoads(Loop *L, DominatorTree &DT) {
+            bool Changed = false;
+            SetVector<Value *> Counters;
+
+            for (BasicBlock *BB: L->blocks()) {
+                for (Instruction &I: *BB) {
+                    if (auto *Load = dyn_cast<LoadInst>(&I)) {
+                        Counters.insert(Load->getPointerOperand());
+                    }
+                }
             }
 
+            for (Value *Counter: Counters) {
+                if (StoreInst *Update = findCounterUpdate(L, Counter)) {
+                    ScalarReplacement Replacement(L, DT, Update, ScalarReplacementDistance);
+                    Changed |= Replacement.run();
+                }
+            }
 
-            BasicBlock* Latch = L->getLoopLatch();
-            Value *LatchOp = nullptr;
+            Summaries.erase(L);
+            return Changed;
+        }
+
+        // The only store to an induction variable "Counter += Step" of the loop, placed in the latch.
+        StoreInst *findCounterUpdate(Loop *L, Value *Counter) {
+            BasicBlock *Latch = L->getLoopLatch();
+            if (Latch == nullptr || !isNonEscapingAlloca(Counter) || getSummary(L).getStoreCount(Counter) != 1) {
+                return nullptr;
+            }
 
+            StoreInst *Update = nullptr;
             for (Instruction &I : *Latch) {
-                if (auto *AddInst = dyn_cast<BinaryOperator>(&I)) {
-                    if (AddInst->getOpcode() == Instruction::Add) {
-                        if(LatchOp != nullptr){
-                            return nullptr;
-                        }
-                        LatchOp = AddInst->getOperand(1);
-                        if (!isa<ConstantInt>(LatchOp)) {
-                            return nullptr;
-                        }
+                if (auto *SI = dyn_cast<StoreInst>(&I)) {
+                    if (SI->getPointerOperand() == Counter) {
+                        Update = SI;
                     }
                 }
             }
 
-            if (isa<ConstantInt>(HeaderOp) && isa<ConstantInt>(LatchOp)) {
-                IRBuilder<> builder(L->getLoopPreheader()->getTerminator());
+            if (Update == nullptr) {
+                return nullptr;
+            }
 
-                errs() << "HeaderOp: " << *HeaderOp << "\n";
-                errs() << "LatchOp: " << *LatchOp << "\n";
+            auto *Increment = dyn_cast<BinaryOperator>(Update->getValueOperand());
+            if (Increment == nullptr || Increment->getOpcode() != Instruction::Add || !Increment->hasNoSignedWrap()) {
+                return nullptr;
+            }
 
-                return  builder.CreateSDiv(HeaderOp, LatchOp);
+            auto *IncrementLoad = dyn_cast<LoadInst>(Increment->getOperand(0));
+            auto *LatchOp = dyn_cast<ConstantInt>(Increment->getOperand(1));
+            if (IncrementLoad == nullptr || IncrementLoad->getPointerOperand() != Counter || LatchOp == nullptr ||
+                LatchOp->isZero()) {
+                return nullptr;
             }
 
-            return nullptr;
+            return Update;
+        }
+
+        // Blocks on the path from the header to a top-tested exit run one extra time.
+        bool executesOncePerIteration(BasicBlock *BB, Loop *L, DominatorTree &DT) {
+            BasicBlock *Latch = L->getLoopLatch(), *Exiting = L->getExitingBlock();
+            if (Latch == nullptr || Exiting == nullptr || !DT.dominates(BB, Latch)) {
+                return false;
+            }
+            return Exiting == Latch || !DT.dominates(BB, Exiting);
         }
 
         bool isDesiredInstructionType(Instruction *I) {
             return isa<BinaryOperator>(I) ||
+                   isa<UnaryOperator>(I) ||
                    isa<SelectInst>(I) ||
                    isa<CastInst>(I) ||
                    isa<GetElementPtrInst>(I);
         }
 
-        bool areAllOperandsConstantsOrComputedOutsideLoop(Instruction *I, Loop *L) {
+        // Floating point arithmetic never traps in the default environment, the worst it computes is a NaN or
+        // an infinity nobody reads, so it is hoisted from blocks that do not run on every iteration as well.
+        bool isFloatingPointArithmetic(Instruction *I) {
+            return (isa<BinaryOperator>(I) || isa<UnaryOperator>(I)) && I->getType()->isFPOrFPVectorTy();
+        }
+
+        // With arcp a division by an invariant becomes a multiplication by its reciprocal, and the
+        // reciprocal is computed once before the loop.
+        bool replaceInvariantDivisions(BasicBlock &BB, Loop *L) {
+            bool Changed = false;
+
+            for (Instruction &I: make_early_inc_range(BB)) {
+                auto *Div = dyn_cast<BinaryOperator>(&I);
+                if (Div == nullptr || Div->getOpcode() != Instruction::FDiv || !Div->hasAllowReciprocal() ||
+                    !L->isLoopInvariant(Div->getOperand(1)) || L->isLoopInvariant(Div->getOperand(0))) {
+                    continue;
+                }
+
+                IRBuilder<> Builder(Div);
+                Builder.setFastMathFlags(Div->getFastMathFlags());
+                Value *Reciprocal = Builder.CreateFDiv(ConstantFP::get(Div->getType(), 1.0), Div->getOperand(1),
+                                                       "recip");
+                Value *Product = Builder.CreateFMul(Div->getOperand(0), Reciprocal, Div->getName());
+                passOutput() << "Dividing by reciprocal: " << *Div << "\n";
+                Div->replaceAllUsesWith(Product);
+                Div->eraseFromParent();
+                Changed = true;
+            }
+
+            return Changed;
+        }
+
+        // Operands already selected for hoisting count as computed outside the loop.
+        bool areAllOperandsConstantsOrComputedOutsideLoop(Instruction *I, Loop *L, ArrayRef<Instruction *> Hoisted) {
             for (Use &U: I->operands()) {
                 Value *V = U.get();
                 if (!isa<Constant>(V)) {
                     if (Instruction * OpInst = dyn_cast<Instruction>(V)) {
-                        if (L->contains(OpInst->getParent())) {
+                        if (L->contains(OpInst->getParent()) && !is_contained(Hoisted, OpInst)) {
                             return false;
                         }
-                    } else {
+                    } else if (!isa<Argument>(V)) {
                         return false;
                     }
                 }
@@ -223,26 +733,82 @@ namespace {
             return true;
         }
 
-        std::vector<BasicBlock *> getExitBlocks(Loop *L) {
-            std::vector < BasicBlock * > exitBlocks;
-            for (BasicBlock *BB: L->blocks()) {
-                for (BasicBlock *Succ: successors(BB)) {
-                    if (!L->contains(Succ)) {
-                        exitBlocks.push_back(Succ);
-                    }
-                }
+        // Loops without counts in the profile, and all loops without a profile, are left to the static heuristics.
+        bool neverIterates(Loop *L) {
+            uint64_t Entries, Backedges;
+            return HasProfile && LoopProfile::getCounts(L, Entries, Backedges) && Backedges == 0;
+        }
+
+        bool isHotLoop(Loop *L) {
+            uint64_t Entries, Backedges;
+            return HasProfile && LoopProfile::getCounts(L, Entries, Backedges) && Entries > 0 &&
+                   Backedges / Entries >= ProfileHotTripCount;
+        }
+
+        // Only a local whose address never escapes is known to be written by nothing but its stores.
+        bool isInvariantLoad(LoadInst *Load, Loop *L) {
+            Value *Ptr = Load->getPointerOperand();
+            if (Load->isVolatile() || !isDefinedOutsideLoop(Ptr, L)) {
+                return false;
+            }
+
+            // Nothing writes a constant global, but an offset into it is only known to be in bounds where it is used.
+            auto *Global = dyn_cast<GlobalVariable>(getUnderlyingObject(Ptr));
+            if (Global != nullptr && Global->isConstant()) {
+                return isSafeToSpeculativelyExecute(Load) || doesBlockDominateAllExitBlocks(Load->getParent(), L);
             }
-            return exitBlocks;
+
+            return isNonEscapingAlloca(Ptr) && getSummary(L).getStoreCount(Ptr) == 0;
         }
 
-        bool doesBlockDominateAllExitBlocks(BasicBlock *BB, Loop *L, DominatorTree *DT) {
-            std::vector < BasicBlock * > exitBlocks = getExitBlocks(L);
-            for (BasicBlock *ExitBB: exitBlocks) {
-                if (!DT->dominates(BB, ExitBB)) {
-                    return false;
+        // A call that returns, does not unwind and writes no memory can run once before the loop.
+        // A readonly call also needs a loop that writes nothing the callee can see, and only a
+        // readnone call is speculated, the others have to run on every path out of the loop.
+        bool isInvariantCall(CallInst *Call, Loop *L, ArrayRef<Instruction *> Hoisted) {
+            if (!EnableCallHoisting || isa<DbgInfoIntrinsic>(Call) || !Call->onlyReadsMemory() ||
+                !Call->doesNotThrow() || !Call->hasFnAttr(Attribute::WillReturn)) {
+                return false;
+            }
+
+            if (!areAllOperandsConstantsOrComputedOutsideLoop(Call, L, Hoisted)) {
+                return false;
+            }
+
+            if (Call->doesNotAccessMemory()) {
+                return true;
+            }
+
+            return !writesVisibleMemory(L) && doesBlockDominateAllExitBlocks(Call->getParent(), L);
+        }
+
+        bool writesVisibleMemory(Loop *L) {
+            LoopSummary &Summary = getSummary(L);
+            if (Summary.hasCallsWithSideEffects() || Summary.hasOtherWrites()) {
+                return true;
+            }
+
+            for (auto &Entry: Summary.getStoreCounts()) {
+                if (!isNonEscapingAlloca(Entry.first)) {
+                    return true;
                 }
             }
-            return true;
+            return false;
+        }
+
+        LoopSummary &getSummary(Loop *L) {
+            std::unique_ptr<LoopSummary> &Summary = Summaries[L];
+            if (!Summary) {
+                Summary = std::make_unique<LoopSummary>(L, *DomTree);
+            }
+            return *Summary;
+        }
+
+        ArrayRef<BasicBlock *> getExitBlocks(Loop *L) {
+            return getSummary(L).getExitBlocks();
+        }
+
+        bool doesBlockDominateAllExitBlocks(BasicBlock *BB, Loop *L) {
+            return getSummary(L).doesBlockDominateAllExitBlocks(BB);
         }
 
         bool isDefinedOutsideLoop(Value *V, Loop *L) {
@@ -252,15 +818,323 @@ namespace {
             return true;
         }
 
+        unsigned countOperand(Instruction *I, Value *Ptr) {
+            unsigned Count = 0;
+            for (Use &U: I->operands()) {
+                if (U.get() == Ptr) {
+                    Count++;
+                }
+            }
+            return Count;
+        }
+
         bool isReferencedInLoop(Instruction *StoreInst, Instruction *LoadInst, Value *Ptr, Loop *L) {
+            unsigned OwnReferences = countOperand(StoreInst, Ptr) + countOperand(LoadInst, Ptr);
+            return getSummary(L).getReferenceCount(Ptr) > OwnReferences;
+        }
+
+        // Calls may write through any pointer that is not a local whose address never escapes.
+        bool isChangedInLoop(Instruction *StartInst, Value *Ptr, Loop *L) {
+            LoopSummary &Summary = getSummary(L);
+            unsigned OwnStores = 0;
+            if (auto *SI = dyn_cast<StoreInst>(StartInst)) {
+                if (SI->getPointerOperand() == Ptr && L->contains(SI->getParent())) {
+                    OwnStores = 1;
+                }
+            }
+
+            if (Summary.getStoreCount(Ptr) > OwnStores) {
+                return true;
+            }
+
+            return (Summary.hasCallsWithSideEffects() || Summary.hasOtherWrites()) && !isNonEscapingAlloca(Ptr);
+        }
+
+        // Counter, start and step of an innermost loop with a constant trip count.
+        bool getCountedLoop(Loop *L, Value *&Counter, int64_t &Start, int64_t &Step, uint64_t &Count) {
+            auto *Iterations = dyn_cast_or_null<ConstantInt>(L->isInnermost() ? getLoopIterationCount(L) : nullptr);
+            if (Iterations == nullptr) {
+                return false;
+            }
+
+            auto *Cmp = cast<ICmpInst>(cast<BranchInst>(L->getExitingBlock()->getTerminator())->getCondition());
+            Counter = cast<LoadInst>(Cmp->getOperand(0))->getPointerOperand();
+            StoreInst *Update = findCounterUpdate(L, Counter);
+            Start = findCounterStart(L, Counter)->getSExtValue();
+            Step = cast<ConstantInt>(cast<BinaryOperator>(Update->getValueOperand())->getOperand(1))->getSExtValue();
+            Count = Iterations->getZExtValue();
+            return true;
+        }
+
+        // The loop whose exit leads to the preheader of L through blocks that only jump to the next one.
+        Loop *findFusionCandidate(Loop *L, LoopInfo &LI) {
+            BasicBlock *BB = L->getLoopPreheader();
+            while (BB != nullptr && LI.getLoopFor(BB) == L->getParentLoop()) {
+                BasicBlock *Pred = BB->getSinglePredecessor();
+                if (Pred == nullptr) {
+                    return nullptr;
+                }
+
+                Loop *Candidate = LI.getLoopFor(Pred);
+                if (Candidate != nullptr && Candidate != L->getParentLoop()) {
+                    bool Adjacent = Candidate->getHeader() == Pred && Candidate->getParentLoop() == L->getParentLoop() &&
+                                    Candidate->getExitBlock() == BB;
+                    return Adjacent ? Candidate : nullptr;
+                }
+
+                if (Pred->getSingleSuccessor() != BB) {
+                    return nullptr;
+                }
+                BB = Pred;
+            }
+            return nullptr;
+        }
+
+        // Loops over the same range are fused one pair at a time, a fused loop may be fused with the next one.
+        bool fuseLoops(Function &F, LoopInfo &LI, DominatorTree &DT) {
+            bool Changed = false, Fused = true;
+
+            while (Fused) {
+                Fused = false;
+
+                for (Loop *Second: LI.getLoopsInPreorder()) {
+                    Loop *First = findFusionCandidate(Second, LI);
+                    Value *FirstCounter, *SecondCounter;
+                    int64_t FirstStart, SecondStart, FirstStep, SecondStep;
+                    uint64_t FirstCount, SecondCount;
+                    if (First == nullptr || !getCountedLoop(First, FirstCounter, FirstStart, FirstStep, FirstCount) ||
+                        !getCountedLoop(Second, SecondCounter, SecondStart, SecondStep, SecondCount) ||
+                        FirstStart != SecondStart || FirstStep != SecondStep || FirstCount != SecondCount ||
+                        hasValuesUsedOutsideLoop(First) || hasValuesUsedOutsideLoop(Second)) {
+                        continue;
+                    }
+
+                    LoopFusion Fusion(First, Second, FirstCounter, SecondCounter, FirstStep);
+                    if (Fusion.run()) {
+                        Fused = true;
+                        break;
+                    }
+                }
+
+                if (Fused) {
+                    Changed = true;
+                    Elimination.removeUnreachableBlocks(F);
+                    DT.recalculate(F);
+                    LI.releaseMemory();
+                    LI.analyze(DT);
+                    Summaries.clear();
+                }
+            }
+
+            return Changed;
+        }
+
+        // Gives every loop a preheader, a single backedge and dedicated exits, then
+        // rotates header-tested loops so the body dominates the exiting latch.
+        bool canonicalizeLoops(Function &F, LoopInfo &LI, DominatorTree &DT) {
+            bool Changed = false;
+            AssumptionCache &AC = getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F);
+
+            for (Loop *L: LI) {
+                Changed |= simplifyLoop(L, &DT, &LI, nullptr, &AC, nullptr, false);
+            }
+
+            // Fusion needs loops that are still tested at the top, so it comes before rotation.
+            if (EnableFusion && fuseLoops(F, LI, DT)) {
+                Changed = true;
+                for (Loop *L: LI) {
+                    simplifyLoop(L, &DT, &LI, nullptr, &AC, nullptr, false);
+                }
+            }
+
+            if (!EnableRotation) {
+                if (Changed) {
+                    Summaries.clear();
+                }
+                return Changed;
+            }
+
+            const TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+            SimplifyQuery SQ(F.getParent()->getDataLayout());
+
+            SmallVector<Loop *, 8> Loops = LI.getLoopsInPreorder();
+            for (auto It = Loops.rbegin(); It != Loops.rend(); ++It) {
+                Loop *L = *It;
+                formLCSSARecursively(*L, DT, &LI, nullptr);
+                if (LoopRotation(L, &LI, &TTI, &AC, &DT, nullptr, nullptr, SQ, false, RotationMaxHeaderSize, false)) {
+                    passOutput() << "Rotated loop with header: " << L->getHeader()->getName() << "\n";
+                    Changed = true;
+                }
+            }
+
+            if (Changed) {
+                Summaries.clear();
+            }
+            return Changed;
+        }
+
+        bool unswitchLoops(Function &F, LoopInfo &LI, DominatorTree &DT) {
+            bool Changed = false, Unswitched = true;
+            unsigned Budget = UnswitchBudget;
+
+            while (Unswitched) {
+                Unswitched = false;
+
+                for (Loop *L: LI.getLoopsInPreorder()) {
+                    if (!L->getLoopPreheader()) {
+                        continue;
+                    }
+
+                    BranchInst *BI = findUnswitchCandidate(L);
+                    if (BI == nullptr) {
+                        continue;
+                    }
+
+                    // Copying a loop that never iterates saves nothing.
+                    if (isTrivialUnswitch(BI, L)) {
+                        Unswitched = unswitchTrivial(BI, L);
+                    } else if (!neverIterates(L)) {
+                        Unswitched = unswitchNonTrivial(BI, L, F, Budget);
+                    }
+
+                    if (Unswitched) {
+                        break;
+                    }
+                }
+
+                // Both copies now contain blocks only the folded branch led to.
+                if (Unswitched) {
+                    Changed = true;
+                    Elimination.removeUnreachableBlocks(F);
+                    DT.recalculate(F);
+                    LI.releaseMemory();
+                    LI.analyze(DT);
+                    Summaries.clear();
+                }
+            }
+
+            return Changed;
+        }
+
+        bool isInvariantCondition(Value *V, Loop *L, unsigned Depth = 0) {
+            Instruction *I = dyn_cast<Instruction>(V);
+            if (I == nullptr || !L->contains(I->getParent())) {
+                return true;
+            }
+
+            if (Depth > 8) {
+                return false;
+            }
+
+            if (auto *Load = dyn_cast<LoadInst>(I)) {
+                return isNonEscapingAlloca(Load->getPointerOperand()) &&
+                       !isChangedInLoop(Load, Load->getPointerOperand(), L);
+            }
+
+            if (!isa<CmpInst>(I) && !isa<BinaryOperator>(I) && !isa<CastInst>(I) && !isa<SelectInst>(I)) {
+                return false;
+            }
+
+            if (!isSafeToSpeculativelyExecute(I)) {
+                return false;
+            }
+
+            for (Use &U: I->operands()) {
+                if (!isInvariantCondition(U.get(), L, Depth + 1)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool isNonEscapingAlloca(Value *V) {
+            if (!isa<AllocaInst>(V)) {
+                return false;
+            }
+
+            for (User *U: V->users()) {
+                if (auto *SI = dyn_cast<StoreInst>(U)) {
+                    if (SI->getValueOperand() == V) {
+                        return false;
+                    }
+                } else if (!isa<LoadInst>(U)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        BranchInst *findUnswitchCandidate(Loop *L) {
+            BranchInst *Candidate = nullptr;
+
+            for (BasicBlock *BB: L->blocks()) {
+                auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+                if (BI == nullptr || !BI->isConditional() || isa<Constant>(BI->getCondition()) ||
+                    BI->getSuccessor(0) == BI->getSuccessor(1)) {
+                    continue;
+                }
+
+                if (!isInvariantCondition(BI->getCondition(), L)) {
+                    continue;
+                }
+
+                if (isTrivialUnswitch(BI, L)) {
+                    return BI;
+                }
+
+                if (Candidate == nullptr) {
+                    Candidate = BI;
+                }
+            }
+
+            return Candidate;
+        }
+
+        // Trivial: one side leaves the loop and the branch is the first thing
+        // with an effect that every iteration reaches, so it can be decided once.
+        bool isTrivialUnswitch(BranchInst *BI, Loop *L) {
+            if (L->contains(BI->getSuccessor(0)) == L->contains(BI->getSuccessor(1))) {
+                return false;
+            }
+
+            BasicBlock *Current = L->getHeader();
+            unsigned Steps = 0;
+
+            while (true) {
+                for (Instruction &I: *Current) {
+                    if (I.isTerminator()) {
+                        break;
+                    }
+                    if (I.mayHaveSideEffects()) {
+                        return false;
+                    }
+                }
+
+                if (Current == BI->getParent()) {
+                    return true;
+                }
+
+                auto *Next = dyn_cast<BranchInst>(Current->getTerminator());
+                if (Next == nullptr || Next->isConditional() || !L->contains(Next->getSuccessor(0)) ||
+                    ++Steps > L->getNumBlocks()) {
+                    return false;
+                }
+                Current = Next->getSuccessor(0);
+            }
+        }
+
+        bool hasValuesUsedOutsideLoop(Loop *L) {
             for (BasicBlock *BB: L->blocks()) {
                 for (Instruction &I: *BB) {
-                    if (&I != StoreInst && &I != LoadInst) {
-                        for (Use &U: I.operands()) {
-                            Value *V = U.get();
-                            if(V == Ptr){
-                                return true;
-                            }
+                    for (Use &U: I.uses()) {
+                        auto *UserInst = cast<Instruction>(U.getUser());
+                        if (L->contains(UserInst->getParent())) {
+                            continue;
+                        }
+
+                        auto *PN = dyn_cast<PHINode>(UserInst);
+                        if (PN == nullptr || !L->contains(PN->getIncomingBlock(U))) {
+                            return true;
                         }
                     }
                 }
@@ -268,20 +1142,119 @@ namespace {
             return false;
         }
 
-        bool isChangedInLoop(Instruction *StartInst, Value *Ptr, Loop *L) {
-            for (BasicBlock *BB : L->blocks()) {
-                for (Instruction &I : *BB) {
-                    if(&I != StartInst) {
-                        if (auto *SI = dyn_cast<StoreInst>(&I)) {
-                            if (SI->getPointerOperand() == Ptr) {
-                                return true;
-                            }
+        Value *hoistCondition(Value *V, Loop *L, Instruction *InsertBefore, ValueToValueMapTy &Hoisted) {
+            auto *I = dyn_cast<Instruction>(V);
+            if (I == nullptr || !L->contains(I->getParent())) {
+                return V;
+            }
+
+            if (Value *Copy = Hoisted.lookup(I)) {
+                return Copy;
+            }
+
+            Instruction *Copy = I->clone();
+            for (unsigned i = 0; i < Copy->getNumOperands(); i++) {
+                Copy->setOperand(i, hoistCondition(I->getOperand(i), L, InsertBefore, Hoisted));
+            }
+
+            if (I->hasName()) {
+                Copy->setName(I->getName() + ".unswitch");
+            }
+            Copy->insertBefore(InsertBefore);
+            Hoisted[I] = Copy;
+            return Copy;
+        }
+
+        void foldUnswitchedBranch(BranchInst *BI, bool Value) {
+            BI->setCondition(ConstantInt::get(Type::getInt1Ty(BI->getContext()), Value));
+            Folding.foldBranchInstruction(*BI);
+        }
+
+        bool unswitchTrivial(BranchInst *BI, Loop *L) {
+            BasicBlock *Preheader = L->getLoopPreheader();
+            bool ExitOnTrue = !L->contains(BI->getSuccessor(0));
+            BasicBlock *Exit = BI->getSuccessor(ExitOnTrue ? 0 : 1);
+
+            for (PHINode &PN: Exit->phis()) {
+                auto *Incoming = dyn_cast<Instruction>(PN.getIncomingValueForBlock(BI->getParent()));
+                if (Incoming != nullptr && L->contains(Incoming->getParent())) {
+                    return false;
+                }
+            }
+
+            passOutput() << "Trivially unswitching: " << *BI << "\n";
+
+            ValueToValueMapTy Hoisted;
+            Value *Condition = hoistCondition(BI->getCondition(), L, Preheader->getTerminator(), Hoisted);
+            BasicBlock *NewPreheader = SplitBlock(Preheader, Preheader->getTerminator());
+
+            for (PHINode &PN: Exit->phis()) {
+                PN.addIncoming(PN.getIncomingValueForBlock(BI->getParent()), Preheader);
+            }
+
+            Preheader->getTerminator()->eraseFromParent();
+            BranchInst::Create(ExitOnTrue ? Exit : NewPreheader, ExitOnTrue ? NewPreheader : Exit, Condition, Preheader);
+
+            foldUnswitchedBranch(BI, !ExitOnTrue);
+            return true;
+        }
+
+        bool unswitchNonTrivial(BranchInst *BI, Loop *L, Function &F, unsigned &Budget) {
+            unsigned Size = 0;
+            for (BasicBlock *BB: L->blocks()) {
+                Size += BB->size();
+            }
+
+            if (Size > Budget || hasValuesUsedOutsideLoop(L)) {
+                return false;
+            }
+
+            passOutput() << "Unswitching (" << Size << " instructions duplicated): " << *BI << "\n";
+            Budget -= Size;
+
+            BasicBlock *Preheader = L->getLoopPreheader();
+            ValueToValueMapTy Hoisted;
+            Value *Condition = hoistCondition(BI->getCondition(), L, Preheader->getTerminator(), Hoisted);
+            BasicBlock *TruePreheader = SplitBlock(Preheader, Preheader->getTerminator());
+
+            ValueToValueMapTy VMap;
+            SmallVector<BasicBlock *, 8> NewBlocks;
+            for (BasicBlock *BB: L->blocks()) {
+                BasicBlock *NewBB = CloneBasicBlock(BB, VMap, ".us", &F);
+                VMap[BB] = NewBB;
+                NewBlocks.push_back(NewBB);
+            }
+            remapInstructionsInBlocks(NewBlocks, VMap);
+
+            auto *NewHeader = cast<BasicBlock>(VMap[L->getHeader()]);
+            BasicBlock *FalsePreheader = BasicBlock::Create(F.getContext(), TruePreheader->getName() + ".us", &F, NewHeader);
+            BranchInst::Create(NewHeader, FalsePreheader);
+            NewHeader->replacePhiUsesWith(TruePreheader, FalsePreheader);
+
+            SmallVector<BasicBlock *, 4> ExitBlocks;
+            L->getUniqueExitBlocks(ExitBlocks);
+            for (BasicBlock *Exit: ExitBlocks) {
+                for (PHINode &PN: Exit->phis()) {
+                    SmallVector<std::pair<Value *, BasicBlock *>, 4> Incoming;
+                    for (unsigned i = 0; i < PN.getNumIncomingValues(); i++) {
+                        if (L->contains(PN.getIncomingBlock(i))) {
+                            Value *V = PN.getIncomingValue(i);
+                            Value *Mapped = VMap.lookup(V);
+                            Incoming.push_back({Mapped ? Mapped : V, cast<BasicBlock>(VMap[PN.getIncomingBlock(i)])});
                         }
                     }
-
+                    for (auto &Entry: Incoming) {
+                        PN.addIncoming(Entry.first, Entry.second);
+                    }
                 }
             }
-            return false;
+
+            Preheader->getTerminator()->eraseFromParent();
+            BranchInst::Create(TruePreheader, FalsePreheader, Condition, Preheader);
+
+            foldUnswitchedBranch(cast<BranchInst>(VMap[BI]), false);
+            foldUnswitchedBranch(BI, true);
+            return true;
         }
 
         bool isIncrementOrDecrement(Instruction *I) {
@@ -297,7 +1270,8 @@ namespace {
                             Value *storedValue = SI->getValueOperand();
 
                             if (storedPointer == loadedValue && storedValue == I) {
-                                if (isa<ConstantInt>(BI->getOperand(1)) || isa<ConstantInt>(BI->getOperand(0))) {
+                                if (isa<ConstantInt>(BI->getOperand(1)) ||
+                                    (BI->getOpcode() == Instruction::Add && isa<ConstantInt>(BI->getOperand(0)))) {
                                     return true;
                                 }
                             }
@@ -307,93 +1281,6 @@ namespace {
             }
             return false;
         }
-
-        void handleBinaryOperator(Instruction &I, std::vector<Instruction *> &InstructionsToRemove) {
-            Value *Lhs = I.getOperand(0), *Rhs = I.getOperand(1);
-            if (ConstantInt * LhsValue = dyn_cast<ConstantInt>(Lhs)) {
-                if (ConstantInt * RhsValue = dyn_cast<ConstantInt>(Rhs)) {
-                    int64_t Value = 0;
-                    switch (I.getOpcode()) {
-                        case Instruction::Add:
-                            Value = LhsValue->getSExtValue() + RhsValue->getSExtValue();
-                            break;
-                        case Instruction::Sub:
-                            Value = LhsValue->getSExtValue() - RhsValue->getSExtValue();
-                            break;
-                        case Instruction::Mul:
-                            Value = LhsValue->getSExtValue() * RhsValue->getSExtValue();
-                            break;
-                        case Instruction::SDiv:
-                            if (RhsValue->getSExtValue() == 0) {
-                                errs() << "Division by zero is not allowed!\n";
-                                return;
-                            }
-                            Value = LhsValue->getSExtValue() / RhsValue->getSExtValue();
-                            break;
-                        default:
-                            return;
-                    }
-
-                    I.replaceAllUsesWith(ConstantInt::get(I.getType(), Value));
-                    InstructionsToRemove.push_back(&I);
-                }
-            }
-        }
-
-
-        void handleCompareInstruction(Instruction &I, std::vector<Instruction *> &InstructionsToRemove) {
-            Value *Lhs = I.getOperand(0), *Rhs = I.getOperand(1);
-            if (ConstantInt * LhsValue = dyn_cast<ConstantInt>(Lhs)) {
-                if (ConstantInt * RhsValue = dyn_cast<ConstantInt>(Rhs)) {
-                    bool Value = false;
-                    ICmpInst *Cmp = cast<ICmpInst>(&I);
-                    switch (Cmp->getPredicate()) {
-                        case ICmpInst::ICMP_EQ:
-                            Value = LhsValue->getSExtValue() == RhsValue->getSExtValue();
-                            break;
-                        case ICmpInst::ICMP_NE:
-                            Value = LhsValue->getSExtValue() != RhsValue->getSExtValue();
-                            break;
-                        case ICmpInst::ICMP_SGT:
-                            Value = LhsValue->getSExtValue() > RhsValue->getSExtValue();
-                            break;
-                        case ICmpInst::ICMP_SLT:
-                            Value = LhsValue->getSExtValue() < RhsValue->getSExtValue();
-                            break;
-                        case ICmpInst::ICMP_SGE:
-                            Value = LhsValue->getSExtValue() >= RhsValue->getSExtValue();
-                            break;
-                        case ICmpInst::ICMP_SLE:
-                            Value = LhsValue->getSExtValue() <= RhsValue->getSExtValue();
-                            break;
-                        default:
-                            return;
-                    }
-
-                    I.replaceAllUsesWith(ConstantInt::get(I.getType(), Value));
-                    InstructionsToRemove.push_back(&I);
-                }
-            }
-        }
-
-
-        void handleBranchInstruction(Instruction &I, std::vector<Instruction *> &InstructionsToRemove) {
-            BranchInst *BranchInstr = dyn_cast<BranchInst>(&I);
-            if (BranchInstr->isConditional()) {
-                if (ConstantInt * Condition = dyn_cast<ConstantInt>(BranchInstr->getCondition())) {
-                    if (Condition->isOne()) {
-                        BasicBlock *TrueBB = BranchInstr->getSuccessor(0);
-                        BranchInst::Create(TrueBB, BranchInstr->getParent());
-                    } else {
-                        BasicBlock *FalseBB = BranchInstr->getSuccessor(1);
-                        BranchInst::Create(FalseBB, BranchInstr->getParent());
-                    }
-
-                    InstructionsToRemove.push_back(&I);
-                }
-            }
-        }
-
     };
 }
 
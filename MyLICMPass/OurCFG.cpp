@@ -4,43 +4,75 @@
 
 #include "OurCFG.h"
 
-OurCFG::OurCFG(llvm::Function &F)
+OurCFG::OurCFG(llvm::Function &F, BumpPtrAllocator &Allocator)
 {
   FunctionName = F.getName().str();
-  CreateCFG(F);
+  CreateCFG(F, Allocator);
 }
 
-void OurCFG::CreateCFG(Function &F)
+void OurCFG::CreateCFG(Function &F, BumpPtrAllocator &Allocator)
 {
+  DenseMap<BasicBlock *, unsigned> NumPredecessors;
+
   for (BasicBlock &BB : F) {
-//    for (BasicBlock *Successor : successors(&BB)) {
-//      AdjacencyList[&BB].push_back(Successor);
-//    }
-    for (Instruction &Instr : BB) {
-      if (BranchInst *BranchInstr = dyn_cast<BranchInst>(&Instr)) {
-        AdjacencyList[&BB].push_back(BranchInstr->getSuccessor(0));
-        if (BranchInstr->isConditional()) {
-          AdjacencyList[&BB].push_back(BranchInstr->getSuccessor(1));
-        }
-      }
+    unsigned Number = BlockNumbers.size();
+    BlockNumbers[&BB] = Number;
+    Instruction *Terminator = BB.getTerminator();
+    if (Terminator == nullptr) {
+      continue;
+    }
+
+    // Any terminator, so blocks only reached through a switch are not lost.
+    unsigned NumSuccessors = Terminator->getNumSuccessors();
+    BasicBlock **Successors = Allocator.Allocate<BasicBlock *>(NumSuccessors);
+    for (unsigned i = 0; i < NumSuccessors; i++) {
+      Successors[i] = Terminator->getSuccessor(i);
+      NumPredecessors[Successors[i]]++;
+    }
+    AdjacencyList[&BB] = ArrayRef<BasicBlock *>(Successors, NumSuccessors);
+  }
+
+  DenseMap<BasicBlock *, BasicBlock **> Predecessors;
+  DenseMap<BasicBlock *, unsigned> Filled;
+  for (const auto &p : NumPredecessors) {
+    Predecessors[p.first] = Allocator.Allocate<BasicBlock *>(p.second);
+  }
+
+  for (BasicBlock &BB : F) {
+    for (BasicBlock *Successor : AdjacencyList.lookup(&BB)) {
+      Predecessors[Successor][Filled[Successor]++] = &BB;
     }
   }
+
+  for (const auto &p : NumPredecessors) {
+    ReverseAdjacencyList[p.first] = ArrayRef<BasicBlock *>(Predecessors[p.first], p.second);
+  }
 }
 
-void OurCFG::DFS(llvm::BasicBlock *Current)
+// An explicit stack, long chains of blocks would overflow the call stack.
+void OurCFG::DFS(llvm::BasicBlock *Start)
 {
-  Visited.insert(Current);
+  Visited.clear();
+  Visited.resize(BlockNumbers.size());
+  Visited.set(BlockNumbers.lookup(Start));
 
-  for (BasicBlock *Successor : AdjacencyList[Current]) {
-    if (Visited.find(Successor) == Visited.end()) {
-      DFS(Successor);
+  SmallVector<BasicBlock *, 32> Stack{Start};
+  while (!Stack.empty()) {
+    BasicBlock *Current = Stack.pop_back_val();
+    for (BasicBlock *Successor : AdjacencyList.lookup(Current)) {
+      unsigned Number = BlockNumbers.lookup(Successor);
+      if (!Visited.test(Number)) {
+        Visited.set(Number);
+        Stack.push_back(Successor);
+      }
     }
   }
 }
 
 bool OurCFG::isReachable(llvm::BasicBlock *BB)
 {
-  return Visited.find(BB) != Visited.end();
+  auto It = BlockNumbers.find(BB);
+  return It != BlockNumbers.end() && It->second < Visited.size() && Visited.test(It->second);
 }
 
 void OurCFG::DumpGraphToFile()
@@ -63,17 +95,22 @@ void OurCFG::DumpBlockToFile(raw_fd_ostream &File, llvm::BasicBlock *Current)
   File << "\tNode" << Current << "[shape=record,color=\"#b70d28ff\", style=filled, fillcolor=\"#b70d2870\",label=\"{";
   for (const Instruction &Instr : *Current) {
     File << Instr << "\\l";
-    if (const BranchInst *BranchInstr = dyn_cast<BranchInst>(&Instr)) {
-      if (BranchInstr->isConditional()) {
-        File << "|{<s0>T|<s1>F}}\"];\n";
-      }
-      else {
-        File << "}\"];\n";
-      }
-    }
   }
 
   bool MultipleSuccessors = AdjacencyList[Current].size() > 1;
+  if (isa<BranchInst>(Current->getTerminator()) && MultipleSuccessors) {
+    File << "|{<s0>T|<s1>F}}\"];\n";
+  }
+  else if (MultipleSuccessors) {
+    File << "|{";
+    for (unsigned i = 0; i < AdjacencyList[Current].size(); i++) {
+      File << (i ? "|" : "") << "<s" << i << ">" << i;
+    }
+    File << "}}\"];\n";
+  }
+  else {
+    File << "}\"];\n";
+  }
 
   int index = 0;
   for (const BasicBlock *Successor : AdjacencyList[Current]) {
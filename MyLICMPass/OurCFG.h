@@ -8,25 +8,33 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Instruction.h"
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
 
 using namespace llvm;
 
 class OurCFG {
 private:
   std::string FunctionName;
-  std::unordered_set<BasicBlock *> Visited;
-  std::unordered_map<BasicBlock *, std::vector<BasicBlock *>> AdjacencyList;
-  void CreateCFG(Function &);
+  // Blocks are numbered in layout order, reachability is a bit per block number.
+  DenseMap<BasicBlock *, unsigned> BlockNumbers;
+  BitVector Visited;
+  // Successor and predecessor lists are allocated from the caller's arena and live as long as it does.
+  DenseMap<BasicBlock *, ArrayRef<BasicBlock *>> AdjacencyList;
+  DenseMap<BasicBlock *, ArrayRef<BasicBlock *>> ReverseAdjacencyList;
+  void CreateCFG(Function &, BumpPtrAllocator &);
   void DumpBlockToFile(raw_fd_ostream &, BasicBlock *);
 
 public:
-  OurCFG(Function &);
+  OurCFG(Function &, BumpPtrAllocator &);
   void DumpGraphToFile();
   void DFS(BasicBlock *);
   bool isReachable(BasicBlock *);
+  ArrayRef<BasicBlock *> getSuccessors(BasicBlock *BB) const { return AdjacencyList.lookup(BB); }
+  ArrayRef<BasicBlock *> getPredecessors(BasicBlock *BB) const { return ReverseAdjacencyList.lookup(BB); }
 };
 
 #endif // LLVM_PROJECT_OURCFG_H
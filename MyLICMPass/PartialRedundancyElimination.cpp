@@ -0,0 +1,497 @@
+#include "PartialRedundancyElimination.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+// Allocas only ever loaded from and stored to directly, so a store to one is
+// the only thing that can change the expressions built from its loads.
+void PartialRedundancyElimination::collectVariables(Function &F)
+{
+    for (Instruction &I : F.getEntryBlock()) {
+      auto *Alloca = dyn_cast<AllocaInst>(&I);
+      if (Alloca == nullptr) {
+        continue;
+      }
+
+      bool OnlyLoadedAndStored = all_of(Alloca->users(), [Alloca](User *U) {
+        if (auto *Load = dyn_cast<LoadInst>(U)) {
+          return Load->isSimple();
+        }
+        auto *Store = dyn_cast<StoreInst>(U);
+        return Store != nullptr && Store->isSimple() && Store->getValueOperand() != Alloca;
+      });
+
+      if (OnlyLoadedAndStored) {
+        Variables.insert(Alloca);
+      }
+    }
+}
+
+// Numbers the expression computed by I. Operands computed in the same block
+// are numbered first, so every subtree is an expression too.
+bool PartialRedundancyElimination::findExpression(Instruction *I, unsigned &Index)
+{
+    auto It = InstructionExpression.find(I);
+    if (It != InstructionExpression.end()) {
+      Index = It->second;
+      return true;
+    }
+
+    if (!(isa<BinaryOperator>(I) || isa<CmpInst>(I) || isa<CastInst>(I)) || !isSafeToSpeculativelyExecute(I)) {
+      return false;
+    }
+
+    std::vector<uintptr_t> Key = {I->getOpcode(), isa<CmpInst>(I) ? cast<CmpInst>(I)->getPredicate() : 0u,
+                                  I->getRawSubclassOptionalData(), reinterpret_cast<uintptr_t>(I->getType())};
+    SmallPtrSet<Value *, 4> Used;
+    unsigned Start = Position[I];
+
+    for (Value *Op : I->operands()) {
+      auto *OpInst = dyn_cast<Instruction>(Op);
+      auto *Load = dyn_cast<LoadInst>(Op);
+      unsigned OperandIndex;
+
+      if (isa<Constant>(Op) || isa<Argument>(Op)) {
+        Key.insert(Key.end(), {0, reinterpret_cast<uintptr_t>(Op)});
+      }
+      else if (Load != nullptr && Load->getParent() == I->getParent() && Variables.count(Load->getPointerOperand())) {
+        Value *Variable = Load->getPointerOperand();
+        Key.insert(Key.end(), {1, reinterpret_cast<uintptr_t>(Variable), reinterpret_cast<uintptr_t>(Op->getType())});
+        Used.insert(Variable);
+        Start = std::min(Start, Position[Load]);
+      }
+      else if (OpInst != nullptr && OpInst->getParent() == I->getParent() && findExpression(OpInst, OperandIndex)) {
+        Key.insert(Key.end(), {2, OperandIndex});
+        Used.insert(Expressions[OperandIndex].Variables.begin(), Expressions[OperandIndex].Variables.end());
+        Start = std::min(Start, TreeStart[OpInst]);
+      }
+      else {
+        return false;
+      }
+    }
+
+    auto Inserted = ExpressionIndex.insert({Key, Expressions.size()});
+    if (Inserted.second) {
+      Expressions.push_back(Expression());
+      Expressions.back().Representative = I;
+      Expressions.back().Variables = Used;
+    }
+
+    Index = Inserted.first->second;
+    InstructionExpression[I] = Index;
+    TreeStart[I] = Start;
+    return true;
+}
+
+static bool hasStoreBetween(const DenseMap<Value *, SmallVector<unsigned, 4>> &Stores,
+                            const SmallPtrSetImpl<Value *> &Variables, unsigned Begin, unsigned End)
+{
+    for (Value *Variable : Variables) {
+      for (unsigned StorePosition : Stores.lookup(Variable)) {
+        if (Begin < StorePosition && StorePosition < End) {
+          return true;
+        }
+      }
+    }
+    return false;
+}
+
+void PartialRedundancyElimination::collectLocalSets()
+{
+    for (BasicBlock *BB : Blocks) {
+      BlockSets &Local = Sets[BB];
+      DenseMap<Value *, SmallVector<unsigned, 4>> Stores;
+
+      unsigned Current = 0;
+      for (Instruction &I : *BB) {
+        Position[&I] = ++Current;
+        auto *Store = dyn_cast<StoreInst>(&I);
+        if (Store != nullptr && Variables.count(Store->getPointerOperand())) {
+          Stores[Store->getPointerOperand()].push_back(Current);
+        }
+      }
+
+      for (Instruction &I : *BB) {
+        // A cast of a single load is no cheaper than loading a temporary, it is only kept as a subtree.
+        unsigned Index;
+        if (isa<CastInst>(I) || !findExpression(&I, Index)) {
+          continue;
+        }
+
+        // Its variables must not change between the loads and the computation.
+        const SmallPtrSetImpl<Value *> &Used = Expressions[Index].Variables;
+        if (hasStoreBetween(Stores, Used, TreeStart[&I], Position[&I])) {
+          continue;
+        }
+
+        if (!hasStoreBetween(Stores, Used, 0, Position[&I])) {
+          Local.UpwardExposed.insert({Index, &I});
+        }
+        if (!hasStoreBetween(Stores, Used, Position[&I], Current + 1)) {
+          Local.DownwardExposed[Index] = &I;
+        }
+      }
+    }
+
+    // The sets are only sized once every expression is numbered.
+    for (BasicBlock *BB : Blocks) {
+      BlockSets &Local = Sets[BB];
+      Local.Antloc.resize(Expressions.size());
+      Local.Comp.resize(Expressions.size());
+      Local.Kill.resize(Expressions.size());
+
+      for (auto &Occurrence : Local.UpwardExposed) {
+        Local.Antloc.set(Occurrence.first);
+      }
+      for (auto &Occurrence : Local.DownwardExposed) {
+        Local.Comp.set(Occurrence.first);
+      }
+
+      for (Instruction &I : *BB) {
+        auto *Store = dyn_cast<StoreInst>(&I);
+        if (Store == nullptr || !Variables.count(Store->getPointerOperand())) {
+          continue;
+        }
+
+        for (unsigned i = 0; i < Expressions.size(); i++) {
+          if (Expressions[i].Variables.count(Store->getPointerOperand())) {
+            Local.Kill.set(i);
+          }
+        }
+      }
+    }
+}
+
+// Anticipated on entry: computed on every path before any of its variables changes.
+void PartialRedundancyElimination::computeAnticipated(OurCFG &CFG)
+{
+    for (BasicBlock *BB : Blocks) {
+      Sets[BB].AntIn = BitVector(Expressions.size(), true);
+    }
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+
+      for (BasicBlock *BB : reverse(Blocks)) {
+        BlockSets &Local = Sets[BB];
+        ArrayRef<BasicBlock *> Successors = CFG.getSuccessors(BB);
+
+        Local.AntOut = BitVector(Expressions.size(), !Successors.empty());
+        for (BasicBlock *Successor : Successors) {
+          Local.AntOut &= Sets[Successor].AntIn;
+        }
+
+        BitVector In = Local.AntOut;
+        In.reset(Local.Kill);
+        In |= Local.Antloc;
+
+        if (In != Local.AntIn) {
+          Local.AntIn = In;
+          Changed = true;
+        }
+      }
+    }
+}
+
+// Available on exit: computed on every path and none of its variables changed since.
+void PartialRedundancyElimination::computeAvailable(OurCFG &CFG)
+{
+    for (BasicBlock *BB : Blocks) {
+      Sets[BB].AvOut = BitVector(Expressions.size(), true);
+    }
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+
+      for (BasicBlock *BB : Blocks) {
+        BlockSets &Local = Sets[BB];
+        ArrayRef<BasicBlock *> Predecessors = CFG.getPredecessors(BB);
+
+        Local.AvIn = BitVector(Expressions.size(), !Predecessors.empty());
+        for (BasicBlock *Predecessor : Predecessors) {
+          Local.AvIn &= Sets[Predecessor].AvOut;
+        }
+
+        BitVector Out = Local.AvIn;
+        Out.reset(Local.Kill);
+        Out |= Local.Comp;
+
+        if (Out != Local.AvOut) {
+          Local.AvOut = Out;
+          Changed = true;
+        }
+      }
+    }
+}
+
+// Earliest on an edge: anticipated at its end, and neither available nor
+// safe to compute any earlier at its start.
+void PartialRedundancyElimination::computeEarliest(OurCFG &CFG)
+{
+    Earliest[Edge(nullptr, Blocks.front())] = Sets[Blocks.front()].AntIn;
+
+    for (BasicBlock *BB : Blocks) {
+      BlockSets &Local = Sets[BB];
+      BitVector NotEarlier = Local.AntOut;
+      NotEarlier.flip();
+      NotEarlier |= Local.Kill;
+      NotEarlier.reset(Local.AvOut);
+
+      for (BasicBlock *Successor : CFG.getSuccessors(BB)) {
+        BitVector Placeable = Sets[Successor].AntIn;
+        Placeable &= NotEarlier;
+        Earliest[Edge(BB, Successor)] = Placeable;
+      }
+    }
+}
+
+// Later on an edge: placement can still be postponed past it, because every
+// path from the earliest point got here without computing the expression.
+void PartialRedundancyElimination::computeLater(OurCFG &CFG)
+{
+    for (auto &Entry : Earliest) {
+      Later[Entry.first] = BitVector(Expressions.size(), true);
+    }
+    Later[Edge(nullptr, Blocks.front())] = Earliest[Edge(nullptr, Blocks.front())];
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+
+      for (BasicBlock *BB : Blocks) {
+        BlockSets &Local = Sets[BB];
+        ArrayRef<BasicBlock *> Predecessors = CFG.getPredecessors(BB);
+
+        Local.LaterIn = BitVector(Expressions.size(), true);
+        if (BB == Blocks.front()) {
+          Local.LaterIn = Later[Edge(nullptr, BB)];
+        }
+        for (BasicBlock *Predecessor : Predecessors) {
+          Local.LaterIn &= Later[Edge(Predecessor, BB)];
+        }
+
+        BitVector Passed = Local.LaterIn;
+        Passed.reset(Local.Antloc);
+
+        for (BasicBlock *Successor : CFG.getSuccessors(BB)) {
+          BitVector Out = Earliest[Edge(BB, Successor)];
+          Out |= Passed;
+
+          BitVector &Current = Later[Edge(BB, Successor)];
+          if (Out != Current) {
+            Current = Out;
+            Changed = true;
+          }
+        }
+      }
+    }
+}
+
+// With critical edges split, an edge owns either the end of its source or the start of its target.
+Instruction *PartialRedundancyElimination::getInsertionPoint(const Edge &E, OurCFG &CFG)
+{
+    if (CFG.getSuccessors(E.first).size() == 1) {
+      return E.first->getTerminator();
+    }
+
+    if (CFG.getPredecessors(E.second).size() == 1) {
+      return &*E.second->getFirstInsertionPt();
+    }
+
+    return nullptr;
+}
+
+// Recomputes the tree of I at the builder, reloading its variables there.
+Value *PartialRedundancyElimination::materialize(Instruction *I, IRBuilder<> &Builder)
+{
+    Instruction *Copy = I->clone();
+
+    for (unsigned i = 0; i < I->getNumOperands(); i++) {
+      Value *Op = I->getOperand(i);
+      auto *Load = dyn_cast<LoadInst>(Op);
+
+      if (Load != nullptr && Variables.count(Load->getPointerOperand())) {
+        Copy->setOperand(i, Builder.CreateAlignedLoad(Load->getType(), Load->getPointerOperand(), Load->getAlign()));
+      }
+      else if (isa<Instruction>(Op)) {
+        Copy->setOperand(i, materialize(cast<Instruction>(Op), Builder));
+      }
+    }
+
+    return Builder.Insert(Copy, I->getName());
+}
+
+bool PartialRedundancyElimination::transform(Function &F, OurCFG &CFG)
+{
+    std::vector<std::pair<Edge, unsigned>> Insertions;
+    std::vector<std::pair<Instruction *, unsigned>> Deletions;
+    BitVector Deleted(Expressions.size()), Unplaceable(Expressions.size());
+
+    for (BasicBlock *BB : Blocks) {
+      BlockSets &Local = Sets[BB];
+      BitVector Delete = Local.LaterIn;
+      Delete.flip();
+      Delete &= Local.Antloc;
+
+      for (unsigned i : Delete.set_bits()) {
+        Deletions.push_back({Local.UpwardExposed[i], i});
+        Deleted.set(i);
+      }
+
+      for (BasicBlock *Successor : CFG.getSuccessors(BB)) {
+        BitVector Insert = Later[Edge(BB, Successor)];
+        Insert.reset(Sets[Successor].LaterIn);
+
+        for (unsigned i : Insert.set_bits()) {
+          Insertions.push_back({Edge(BB, Successor), i});
+          if (getInsertionPoint(Edge(BB, Successor), CFG) == nullptr) {
+            Unplaceable.set(i);
+          }
+        }
+      }
+    }
+
+    Deleted.reset(Unplaceable);
+    if (Deleted.none()) {
+      return false;
+    }
+
+    IRBuilder<> EntryBuilder(&F.getEntryBlock(), F.getEntryBlock().getFirstInsertionPt());
+    DenseMap<unsigned, AllocaInst *> Temporaries;
+    for (unsigned i : Deleted.set_bits()) {
+      Temporaries[i] = EntryBuilder.CreateAlloca(Expressions[i].Representative->getType(), nullptr, "pre.tmp");
+    }
+
+    for (auto &Insertion : Insertions) {
+      if (!Deleted.test(Insertion.second)) {
+        continue;
+      }
+
+      Instruction *Representative = Expressions[Insertion.second].Representative;
+      IRBuilder<> Builder(getInsertionPoint(Insertion.first, CFG));
+      Builder.CreateStore(materialize(Representative, Builder), Temporaries[Insertion.second]);
+      passOutput() << "Inserting: " << *Representative << " on edge " << Insertion.first.first->getName() << " -> "
+             << Insertion.first.second->getName() << "\n";
+    }
+
+    // Computations that reach a deleted occurrence keep their value in the temporary.
+    for (BasicBlock *BB : Blocks) {
+      BlockSets &Local = Sets[BB];
+      for (auto &Occurrence : Local.DownwardExposed) {
+        unsigned i = Occurrence.first;
+        bool IsDeleted = Local.UpwardExposed.lookup(i) == Occurrence.second && !Local.LaterIn.test(i);
+        if (Deleted.test(i) && !IsDeleted) {
+          new StoreInst(Occurrence.second, Temporaries[i], Occurrence.second->getNextNode());
+        }
+      }
+    }
+
+    // Replacing an occurrence deletes the subtrees only it used, those may be occurrences as well.
+    std::vector<std::pair<WeakTrackingVH, unsigned>> Redundant;
+    for (auto &Deletion : Deletions) {
+      if (Deleted.test(Deletion.second)) {
+        Redundant.push_back({WeakTrackingVH(Deletion.first), Deletion.second});
+      }
+    }
+
+    for (auto &Occurrence : Redundant) {
+      auto *I = cast_or_null<Instruction>(Occurrence.first);
+      if (I == nullptr) {
+        continue;
+      }
+
+      passOutput() << "Redundant expression: " << *I << "\n";
+      AllocaInst *Temporary = Temporaries[Occurrence.second];
+      Value *Reloaded = new LoadInst(Temporary->getAllocatedType(), Temporary, "pre", I);
+      I->replaceAllUsesWith(Reloaded);
+      RecursivelyDeleteTriviallyDeadInstructions(I);
+    }
+
+    // A subtree is not reloaded where the whole tree was, then its temporary is never read.
+    for (auto &Entry : Temporaries) {
+      AllocaInst *Temporary = Entry.second;
+      if (any_of(Temporary->users(), [](User *U) { return isa<LoadInst>(U); })) {
+        continue;
+      }
+
+      while (!Temporary->use_empty()) {
+        auto *Store = cast<StoreInst>(Temporary->user_back());
+        Value *Computed = Store->getValueOperand();
+        Store->eraseFromParent();
+        RecursivelyDeleteTriviallyDeadInstructions(Computed);
+      }
+      Temporary->eraseFromParent();
+    }
+
+    return true;
+}
+
+bool PartialRedundancyElimination::runOnFunction(Function &F) {
+    Expressions.clear();
+    ExpressionIndex.clear();
+    InstructionExpression.clear();
+    Position.clear();
+    TreeStart.clear();
+    Sets.clear();
+    Earliest.clear();
+    Later.clear();
+    Variables.clear();
+    Blocks.clear();
+    Allocator.Reset();
+
+    if (F.isDeclaration()) {
+      return false;
+    }
+
+    // Placement needs an edge of its own to insert on, which these edges can not get.
+    for (BasicBlock &BB : F) {
+      if (BB.isEHPad() || isa<IndirectBrInst>(BB.getTerminator()) || isa<CallBrInst>(BB.getTerminator())) {
+        return false;
+      }
+    }
+
+    SmallPtrSet<BasicBlock *, 32> Original;
+    for (BasicBlock &BB : F) {
+      Original.insert(&BB);
+    }
+    bool Changed = SplitAllCriticalEdges(F) != 0;
+
+    for (BasicBlock &BB : F) {
+      Blocks.push_back(&BB);
+    }
+
+    collectVariables(F);
+    collectLocalSets();
+
+    if (!Expressions.empty()) {
+      OurCFG CFG(F, Allocator);
+      computeAnticipated(CFG);
+      computeAvailable(CFG);
+      computeEarliest(CFG);
+      computeLater(CFG);
+      Changed |= transform(F, CFG);
+    }
+
+    // Fold the split edges that nothing was placed on back into their successors.
+    std::vector<BasicBlock *> Split;
+    for (BasicBlock &BB : F) {
+      if (!Original.count(&BB) && &BB.front() == BB.getTerminator()) {
+        Split.push_back(&BB);
+      }
+    }
+    for (BasicBlock *BB : Split) {
+      TryToSimplifyUncondBranchFromEmptyBlock(BB);
+    }
+
+    return Changed;
+}
+
+char PartialRedundancyElimination::ID = 0;
+static RegisterPass<PartialRedundancyElimination> X("our-pre", "Our partial redundancy elimination pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,79 @@
+#ifndef LLVM_PROJECT_PARTIALREDUNDANCYELIMINATION_H
+#define LLVM_PROJECT_PARTIALREDUNDANCYELIMINATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <map>
+#include <vector>
+
+#include "OurCFG.h"
+
+using namespace llvm;
+
+// Lazy code motion (Knoop, Ruething and Steffen, in the edge based form of
+// Drechsler and Stadel) over the allocas of unoptimized code. An expression
+// is a tree of arithmetic, compares and casts in one block whose leaves are
+// constants, arguments and loads of non-escaping allocas, and a store to any
+// of those allocas kills it. Anticipability and availability are solved as
+// bitvector dataflow over OurCFG with critical edges split, and every
+// expression is computed into a temporary on the latest edges where it is
+// still anticipated on every path. The occurrences that become redundant
+// load the temporary instead. Invariants of a rotated loop are placed on its
+// preheader edge this way.
+class PartialRedundancyElimination : public FunctionPass {
+private:
+  typedef std::pair<BasicBlock *, BasicBlock *> Edge;
+
+  struct Expression {
+    // Any occurrence, its tree is copied to every insertion point.
+    Instruction *Representative;
+    SmallPtrSet<Value *, 4> Variables;
+  };
+
+  struct BlockSets {
+    // Computed before any of its variables is stored to, or after the last such store.
+    BitVector Antloc, Comp, Kill;
+    BitVector AntIn, AntOut, AvIn, AvOut, LaterIn;
+    DenseMap<unsigned, Instruction *> UpwardExposed, DownwardExposed;
+  };
+
+  std::vector<Expression> Expressions;
+  std::map<std::vector<uintptr_t>, unsigned> ExpressionIndex;
+  DenseMap<Instruction *, unsigned> InstructionExpression;
+  // Position of every instruction in its block, and of the first instruction of the tree it roots.
+  DenseMap<Instruction *, unsigned> Position, TreeStart;
+  DenseMap<BasicBlock *, BlockSets> Sets;
+  DenseMap<Edge, BitVector> Earliest, Later;
+  SmallPtrSet<Value *, 32> Variables;
+  // Blocks in layout order, the backward problem walks it in reverse.
+  std::vector<BasicBlock *> Blocks;
+  BumpPtrAllocator Allocator;
+
+  void collectVariables(Function &F);
+  bool findExpression(Instruction *I, unsigned &Index);
+  void collectLocalSets();
+  void computeAnticipated(OurCFG &CFG);
+  void computeAvailable(OurCFG &CFG);
+  void computeEarliest(OurCFG &CFG);
+  void computeLater(OurCFG &CFG);
+  Instruction *getInsertionPoint(const Edge &E, OurCFG &CFG);
+  Value *materialize(Instruction *I, IRBuilder<> &Builder);
+  bool transform(Function &F, OurCFG &CFG);
+
+public:
+  static char ID;
+  PartialRedundancyElimination() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override;
+};
+
+#endif // LLVM_PROJECT_PARTIALREDUNDANCYELIMINATION_H
@@ -0,0 +1,14 @@
+#include "PassOutput.h"
+
+static thread_local raw_ostream *ThreadOutput = nullptr;
+
+raw_ostream &passOutput()
+{
+    return ThreadOutput != nullptr ? *ThreadOutput : errs();
+}
+
+// nullptr returns the calling thread to errs().
+extern "C" void setPassOutput(raw_ostream *Output)
+{
+    ThreadOutput = Output;
+}
@@ -0,0 +1,16 @@
+#ifndef LLVM_PROJECT_PASSOUTPUT_H
+#define LLVM_PROJECT_PASSOUTPUT_H
+
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+// The stream the passes report their progress on, errs() unless the thread
+// running them was given one of its own. our-opt-server runs several
+// requests at once and looks up setPassOutput to return each request's
+// messages to its client instead of mixing them on its stderr.
+raw_ostream &passOutput();
+
+extern "C" void setPassOutput(raw_ostream *Output);
+
+#endif // LLVM_PROJECT_PASSOUTPUT_H
@@ -0,0 +1,454 @@
+#include "RangePropagation.h"
+#include "PassOutput.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CommandLine.h"
+
+static cl::opt<unsigned> WideningThreshold("range-widening-threshold", cl::init(2),
+                                           cl::desc("Number of visits of a loop header before its ranges are widened"));
+
+static cl::opt<unsigned> NarrowingSweeps("range-narrowing-sweeps", cl::init(2),
+                                         cl::desc("Number of descending sweeps run after widening"));
+
+static const unsigned MaxSweeps = 100;
+
+void RangePropagation::findAllVariables(Function &F)
+{
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        AllocaInst *Alloca = dyn_cast<AllocaInst>(&I);
+        if (Alloca == nullptr || !Alloca->getAllocatedType()->isIntegerTy()) {
+          continue;
+        }
+
+        // Only variables whose address never escapes, and that are only accessed as a whole value of
+        // the allocated type, can be tracked through loads and stores.
+        Type *Ty = Alloca->getAllocatedType();
+        bool Escapes = false;
+        for (User *U : Alloca->users()) {
+          if (LoadInst *Load = dyn_cast<LoadInst>(U)) {
+            if (!Load->isSimple() || Load->getType() != Ty) {
+              Escapes = true;
+              break;
+            }
+            continue;
+          }
+          StoreInst *Store = dyn_cast<StoreInst>(U);
+          if (Store == nullptr || !Store->isSimple() || Store->getValueOperand() == Alloca ||
+              Store->getValueOperand()->getType() != Ty) {
+            Escapes = true;
+            break;
+          }
+        }
+
+        if (!Escapes) {
+          VariableIndices[Alloca] = Variables.size();
+          Variables.push_back(Alloca);
+        }
+      }
+    }
+}
+
+void RangePropagation::findLoopHeaders(Function &F)
+{
+    SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 8> Backedges;
+    FindFunctionBackedges(F, Backedges);
+
+    for (const auto &Backedge : Backedges) {
+      LoopHeaders.insert(Backedge.second);
+    }
+}
+
+RangePropagation::RangeState RangePropagation::emptyState()
+{
+    RangeState State;
+    State.reserve(Variables.size());
+    for (Value *Variable : Variables) {
+      State.push_back(ConstantRange::getEmpty(cast<AllocaInst>(Variable)->getAllocatedType()->getIntegerBitWidth()));
+    }
+    return State;
+}
+
+ConstantRange RangePropagation::getRange(Value *V)
+{
+    if (ConstantInt *ConstInt = dyn_cast<ConstantInt>(V)) {
+      return ConstantRange(ConstInt->getValue());
+    }
+
+    auto It = ValueRanges.find(V);
+    if (It != ValueRanges.end()) {
+      return It->second;
+    }
+
+    return ConstantRange::getFull(V->getType()->getIntegerBitWidth());
+}
+
+void RangePropagation::setRange(Value *V, const ConstantRange &Range)
+{
+    auto Inserted = ValueRanges.try_emplace(V, Range);
+    if (!Inserted.second) {
+      Inserted.first->second = Range;
+    }
+}
+
+bool RangePropagation::isEdgeFeasible(BasicBlock *From, BasicBlock *To)
+{
+    if (!Reached[BlockIndices[From]]) {
+      return false;
+    }
+
+    BranchInst *Branch = dyn_cast<BranchInst>(From->getTerminator());
+    if (Branch == nullptr || !Branch->isConditional() || Branch->getSuccessor(0) == Branch->getSuccessor(1)) {
+      return true;
+    }
+
+    ConstantRange Condition = getRange(Branch->getCondition());
+    if (Condition.isEmptySet()) {
+      return false;
+    }
+
+    if (const APInt *Value = Condition.getSingleElement()) {
+      return Branch->getSuccessor(Value->isOne() ? 0 : 1) == To;
+    }
+
+    return true;
+}
+
+void RangePropagation::refineOnEdge(BasicBlock *From, BasicBlock *To, RangeState &State)
+{
+    BranchInst *Branch = dyn_cast<BranchInst>(From->getTerminator());
+    if (Branch == nullptr || !Branch->isConditional() || Branch->getSuccessor(0) == Branch->getSuccessor(1)) {
+      return;
+    }
+
+    ICmpInst *Cmp = dyn_cast<ICmpInst>(Branch->getCondition());
+    if (Cmp == nullptr || Cmp->getParent() != From || !Cmp->getOperand(0)->getType()->isIntegerTy()) {
+      return;
+    }
+
+    for (unsigned OpIndex = 0; OpIndex < 2; OpIndex++) {
+      LoadInst *Load = dyn_cast<LoadInst>(Cmp->getOperand(OpIndex));
+      if (Load == nullptr || Load->getParent() != From) {
+        continue;
+      }
+
+      auto It = VariableIndices.find(Load->getPointerOperand());
+      if (It == VariableIndices.end()) {
+        continue;
+      }
+
+      // The loaded value describes the variable on the edge only if nothing overwrites it before the branch.
+      bool StoredAfterLoad = false;
+      for (Instruction *I = Load->getNextNode(); I != nullptr; I = I->getNextNode()) {
+        StoreInst *Store = dyn_cast<StoreInst>(I);
+        if (Store != nullptr && Store->getPointerOperand() == Load->getPointerOperand()) {
+          StoredAfterLoad = true;
+          break;
+        }
+      }
+
+      if (StoredAfterLoad) {
+        continue;
+      }
+
+      CmpInst::Predicate Pred = OpIndex == 0 ? Cmp->getPredicate() : Cmp->getSwappedPredicate();
+      if (Branch->getSuccessor(1) == To) {
+        Pred = CmpInst::getInversePredicate(Pred);
+      }
+
+      ConstantRange Allowed = ConstantRange::makeAllowedICmpRegion(Pred, getRange(Cmp->getOperand(1 - OpIndex)));
+      State[It->second] = State[It->second].intersectWith(Allowed, ConstantRange::Signed);
+    }
+}
+
+void RangePropagation::joinStates(RangeState &Dest, const RangeState &Src)
+{
+    for (size_t i = 0; i < Dest.size(); i++) {
+      Dest[i] = Dest[i].unionWith(Src[i], ConstantRange::Signed);
+    }
+}
+
+// Any bound that is still moving is pushed to the end of the signed range.
+ConstantRange RangePropagation::widen(const ConstantRange &Old, const ConstantRange &New)
+{
+    if (Old.isEmptySet() || New.isEmptySet() || New == Old) {
+      return New;
+    }
+
+    unsigned BitWidth = New.getBitWidth();
+    APInt Lower = New.getSignedMin(), Upper = New.getSignedMax();
+
+    if (Lower.slt(Old.getSignedMin())) {
+      Lower = APInt::getSignedMinValue(BitWidth);
+    }
+
+    if (Upper.sgt(Old.getSignedMax())) {
+      Upper = APInt::getSignedMaxValue(BitWidth);
+    }
+
+    return ConstantRange::getNonEmpty(Lower, Upper + 1);
+}
+
+ConstantRange RangePropagation::evaluateCompare(ICmpInst *Cmp)
+{
+    ConstantRange Lhs = getRange(Cmp->getOperand(0)), Rhs = getRange(Cmp->getOperand(1));
+
+    if (Lhs.isEmptySet() || Rhs.isEmptySet()) {
+      return ConstantRange::getEmpty(1);
+    }
+
+    if (Lhs.icmp(Cmp->getPredicate(), Rhs)) {
+      return ConstantRange(APInt(1, 1));
+    }
+
+    if (Lhs.icmp(Cmp->getInversePredicate(), Rhs)) {
+      return ConstantRange(APInt(1, 0));
+    }
+
+    return ConstantRange::getFull(1);
+}
+
+void RangePropagation::transfer(BasicBlock &BB, RangeState &State)
+{
+    bool WidenPhis = LoopHeaders.count(&BB) && Visits[BlockIndices[&BB]] > WideningThreshold;
+
+    for (Instruction &I : BB) {
+      if (StoreInst *Store = dyn_cast<StoreInst>(&I)) {
+        auto It = VariableIndices.find(Store->getPointerOperand());
+        if (It != VariableIndices.end()) {
+          State[It->second] = getRange(Store->getValueOperand());
+        }
+        continue;
+      }
+
+      if (!I.getType()->isIntegerTy()) {
+        continue;
+      }
+
+      if (LoadInst *Load = dyn_cast<LoadInst>(&I)) {
+        auto It = VariableIndices.find(Load->getPointerOperand());
+        if (It != VariableIndices.end()) {
+          setRange(Load, State[It->second]);
+        }
+        else {
+          setRange(Load, ConstantRange::getFull(Load->getType()->getIntegerBitWidth()));
+        }
+      }
+      else if (BinaryOperator *BinOp = dyn_cast<BinaryOperator>(&I)) {
+        ConstantRange Lhs = getRange(BinOp->getOperand(0)), Rhs = getRange(BinOp->getOperand(1));
+        Instruction::BinaryOps Opcode = BinOp->getOpcode();
+
+        if ((Opcode == Instruction::Add || Opcode == Instruction::Sub || Opcode == Instruction::Mul) &&
+            (BinOp->hasNoSignedWrap() || BinOp->hasNoUnsignedWrap())) {
+          unsigned NoWrapKind = 0;
+          if (BinOp->hasNoSignedWrap()) {
+            NoWrapKind |= OverflowingBinaryOperator::NoSignedWrap;
+          }
+          if (BinOp->hasNoUnsignedWrap()) {
+            NoWrapKind |= OverflowingBinaryOperator::NoUnsignedWrap;
+          }
+          setRange(BinOp, Lhs.overflowingBinaryOp(Opcode, Rhs, NoWrapKind));
+        }
+        else {
+          setRange(BinOp, Lhs.binaryOp(Opcode, Rhs));
+        }
+      }
+      else if (CastInst *Cast = dyn_cast<CastInst>(&I)) {
+        if (Cast->getSrcTy()->isIntegerTy()) {
+          setRange(Cast, getRange(Cast->getOperand(0)).castOp(Cast->getOpcode(), Cast->getType()->getIntegerBitWidth()));
+        }
+        else {
+          setRange(Cast, ConstantRange::getFull(Cast->getType()->getIntegerBitWidth()));
+        }
+      }
+      else if (ICmpInst *Cmp = dyn_cast<ICmpInst>(&I)) {
+        if (Cmp->getOperand(0)->getType()->isIntegerTy()) {
+          setRange(Cmp, evaluateCompare(Cmp));
+        }
+        else {
+          setRange(Cmp, ConstantRange::getFull(1));
+        }
+      }
+      else if (SelectInst *Select = dyn_cast<SelectInst>(&I)) {
+        ConstantRange Condition = getRange(Select->getCondition());
+        const APInt *Value = Condition.getSingleElement();
+
+        if (Value != nullptr) {
+          setRange(Select, getRange(Value->isOne() ? Select->getTrueValue() : Select->getFalseValue()));
+        }
+        else {
+          setRange(Select, getRange(Select->getTrueValue()).unionWith(getRange(Select->getFalseValue()),
+                                                                       ConstantRange::Signed));
+        }
+      }
+      else if (PHINode *Phi = dyn_cast<PHINode>(&I)) {
+        ConstantRange Range = ConstantRange::getEmpty(Phi->getType()->getIntegerBitWidth());
+        for (unsigned i = 0; i < Phi->getNumIncomingValues(); i++) {
+          if (isEdgeFeasible(Phi->getIncomingBlock(i), &BB)) {
+            Range = Range.unionWith(getRange(Phi->getIncomingValue(i)), ConstantRange::Signed);
+          }
+        }
+
+        if (WidenPhis) {
+          auto It = ValueRanges.find(Phi);
+          if (It != ValueRanges.end()) {
+            Range = widen(It->second, Range.unionWith(It->second, ConstantRange::Signed));
+          }
+        }
+        setRange(Phi, Range);
+      }
+      else {
+        setRange(&I, ConstantRange::getFull(I.getType()->getIntegerBitWidth()));
+      }
+    }
+}
+
+bool RangePropagation::updateBlock(BasicBlock *BB, bool Widen)
+{
+    unsigned Index = BlockIndices[BB];
+    RangeState In = emptyState();
+    bool IsReached = false;
+
+    if (BB == &BB->getParent()->getEntryBlock()) {
+      for (size_t i = 0; i < In.size(); i++) {
+        In[i] = ConstantRange::getFull(In[i].getBitWidth());
+      }
+      IsReached = true;
+    }
+
+    for (BasicBlock *Pred : predecessors(BB)) {
+      if (!isEdgeFeasible(Pred, BB)) {
+        continue;
+      }
+
+      RangeState EdgeState = StateOut[BlockIndices[Pred]];
+      refineOnEdge(Pred, BB, EdgeState);
+      joinStates(In, EdgeState);
+      IsReached = true;
+    }
+
+    if (Widen && Reached[Index]) {
+      Visits[Index]++;
+      joinStates(In, StateIn[Index]);
+
+      if (LoopHeaders.count(BB) && Visits[Index] > WideningThreshold) {
+        for (size_t i = 0; i < In.size(); i++) {
+          In[i] = widen(StateIn[Index][i], In[i]);
+        }
+      }
+    }
+
+    if (!IsReached) {
+      bool Changed = Reached[Index];
+      Reached[Index] = false;
+      return Changed;
+    }
+
+    RangeState Out = In;
+    transfer(*BB, Out);
+
+    bool Changed = !Reached[Index] || In != StateIn[Index] || Out != StateOut[Index];
+    Reached[Index] = true;
+    StateIn[Index] = std::move(In);
+    StateOut[Index] = std::move(Out);
+    return Changed;
+}
+
+void RangePropagation::runAlgorithm(Function &F)
+{
+    ReversePostOrderTraversal<Function *> RPOT(&F);
+
+    unsigned Sweep = 0;
+    bool Changed = true;
+    while (Changed && Sweep++ < MaxSweeps) {
+      Changed = false;
+      DenseMap<Value *, ConstantRange> PreviousRanges = ValueRanges;
+
+      for (BasicBlock *BB : RPOT) {
+        Changed |= updateBlock(BB, true);
+      }
+
+      // PHIs can depend on values computed later in the sweep, so those have to be stable as well.
+      if (!Changed) {
+        for (const auto &Entry : ValueRanges) {
+          auto It = PreviousRanges.find(Entry.first);
+          if (It == PreviousRanges.end() || It->second != Entry.second) {
+            Changed = true;
+            break;
+          }
+        }
+      }
+    }
+
+    if (Changed) {
+      passOutput() << "Range propagation did not converge, skipping function.\n";
+      Reached.assign(Reached.size(), false);
+      return;
+    }
+
+    for (unsigned i = 0; i < NarrowingSweeps; i++) {
+      for (BasicBlock *BB : RPOT) {
+        updateBlock(BB, false);
+      }
+    }
+}
+
+bool RangePropagation::modifyIR(Function &F)
+{
+    bool Changed = false;
+
+    for (BasicBlock &BB : F) {
+      if (!Reached[BlockIndices[&BB]]) {
+        continue;
+      }
+
+      for (Instruction &I : BB) {
+        ICmpInst *Cmp = dyn_cast<ICmpInst>(&I);
+        if (Cmp == nullptr || Cmp->use_empty() || !Cmp->getType()->isIntegerTy(1)) {
+          continue;
+        }
+
+        ConstantRange Range = getRange(Cmp);
+        if (const APInt *Value = Range.getSingleElement()) {
+          passOutput() << "Range proves compare: " << *Cmp << " is " << (Value->isOne() ? "true" : "false") << "\n";
+          Cmp->replaceAllUsesWith(ConstantInt::get(Cmp->getType(), *Value));
+          Changed = true;
+        }
+      }
+    }
+
+    return Changed;
+}
+
+bool RangePropagation::runOnFunction(Function &F) {
+    Variables.clear();
+    VariableIndices.clear();
+    BlockIndices.clear();
+    LoopHeaders.clear();
+    ValueRanges.clear();
+
+    for (BasicBlock &BB : F) {
+      unsigned Index = BlockIndices.size();
+      BlockIndices[&BB] = Index;
+    }
+
+    findAllVariables(F);
+    findLoopHeaders(F);
+
+    StateIn.assign(BlockIndices.size(), emptyState());
+    StateOut.assign(BlockIndices.size(), emptyState());
+    Reached.assign(BlockIndices.size(), false);
+    Visits.assign(BlockIndices.size(), 0);
+
+    runAlgorithm(F);
+    return modifyIR(F);
+}
+
+char RangePropagation::ID = 0;
+static RegisterPass<RangePropagation> X("our-range-propagation", "Our interval based constant propagation pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
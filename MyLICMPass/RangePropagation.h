@@ -0,0 +1,57 @@
+#ifndef LLVM_PROJECT_RANGEPROPAGATION_H
+#define LLVM_PROJECT_RANGEPROPAGATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// Interval lattice over the integer allocas of a function. Empty range is
+// Bottom (not reached yet), full range is Top. Branch conditions narrow the
+// ranges on the outgoing edges and loop headers are widened so the analysis
+// terminates. Compares whose outcome is proven are replaced with constants,
+// which ConstantFolding then turns into unconditional branches.
+class RangePropagation : public FunctionPass {
+private:
+  typedef std::vector<ConstantRange> RangeState;
+
+  std::vector<Value *> Variables;
+  DenseMap<Value *, unsigned> VariableIndices;
+  DenseMap<BasicBlock *, unsigned> BlockIndices;
+  std::vector<RangeState> StateIn;
+  std::vector<RangeState> StateOut;
+  std::vector<bool> Reached;
+  std::vector<unsigned> Visits;
+  SmallPtrSet<const BasicBlock *, 8> LoopHeaders;
+  DenseMap<Value *, ConstantRange> ValueRanges;
+
+  void findAllVariables(Function &F);
+  void findLoopHeaders(Function &F);
+  RangeState emptyState();
+  ConstantRange getRange(Value *V);
+  void setRange(Value *V, const ConstantRange &Range);
+  bool isEdgeFeasible(BasicBlock *From, BasicBlock *To);
+  void refineOnEdge(BasicBlock *From, BasicBlock *To, RangeState &State);
+  void joinStates(RangeState &Dest, const RangeState &Src);
+  ConstantRange widen(const ConstantRange &Old, const ConstantRange &New);
+  void transfer(BasicBlock &BB, RangeState &State);
+  ConstantRange evaluateCompare(ICmpInst *Cmp);
+  bool updateBlock(BasicBlock *BB, bool Widen);
+  void runAlgorithm(Function &F);
+  bool modifyIR(Function &F);
+
+public:
+  static char ID;
+  RangePropagation() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override;
+};
+
+#endif // LLVM_PROJECT_RANGEPROPAGATION_H
@@ -0,0 +1,150 @@
+#include "Reassociation.h"
+#include "PassOutput.h"
+
+#include "llvm/IR/IRBuilder.h"
+
+#include <algorithm>
+
+unsigned Reassociation::getRank(Value *V, LoopInfo &LI)
+{
+    if (isa<Constant>(V)) {
+      return 0;
+    }
+
+    if (auto *I = dyn_cast<Instruction>(V)) {
+      return 2 + LI.getLoopDepth(I->getParent());
+    }
+
+    return 1;
+}
+
+// Only single use operands of the same operation in the same block are part
+// of the tree, anything else is a leaf.
+bool Reassociation::isTreeNode(Value *V, BinaryOperator *Root)
+{
+    auto *BO = dyn_cast<BinaryOperator>(V);
+    return BO != nullptr && BO->getOpcode() == Root->getOpcode() && BO->getParent() == Root->getParent() &&
+           BO->hasOneUse() && BO->isAssociative();
+}
+
+void Reassociation::collectTree(BinaryOperator *Node, BinaryOperator *Root, SmallVectorImpl<Value *> &Leaves,
+                                SmallVectorImpl<BinaryOperator *> &Nodes)
+{
+    Nodes.push_back(Node);
+
+    for (Value *Op : Node->operands()) {
+      if (isTreeNode(Op, Root)) {
+        collectTree(cast<BinaryOperator>(Op), Root, Leaves, Nodes);
+      }
+      else {
+        Leaves.push_back(Op);
+      }
+    }
+}
+
+bool Reassociation::isChainInRankOrder(BinaryOperator *Root, ArrayRef<Value *> Leaves, LoopInfo &LI)
+{
+    for (BinaryOperator *Node = Root; Node != nullptr;
+         Node = isTreeNode(Node->getOperand(0), Root) ? cast<BinaryOperator>(Node->getOperand(0)) : nullptr) {
+      if (isTreeNode(Node->getOperand(1), Root)) {
+        return false;
+      }
+    }
+
+    for (unsigned i = 1; i < Leaves.size(); i++) {
+      if (getRank(Leaves[i - 1], LI) > getRank(Leaves[i], LI)) {
+        return false;
+      }
+    }
+
+    return true;
+}
+
+bool Reassociation::reassociateTree(BinaryOperator *Root, LoopInfo &LI)
+{
+    SmallVector<Value *, 8> Leaves;
+    SmallVector<BinaryOperator *, 8> Nodes;
+    collectTree(Root, Root, Leaves, Nodes);
+
+    if (Leaves.size() < 3 || isChainInRankOrder(Root, Leaves, LI)) {
+      return false;
+    }
+
+    std::stable_sort(Leaves.begin(), Leaves.end(), [&](Value *A, Value *B) {
+      return getRank(A, LI) < getRank(B, LI);
+    });
+
+    // Rebuilding the tree invalidates nsw/nuw, fast-math flags are kept where every node had them.
+    IRBuilder<> Builder(Root);
+    if (isa<FPMathOperator>(Root)) {
+      FastMathFlags Flags = Root->getFastMathFlags();
+      for (BinaryOperator *Node : Nodes) {
+        Flags &= Node->getFastMathFlags();
+      }
+      Builder.setFastMathFlags(Flags);
+    }
+
+    Value *Chain = Leaves[0];
+    for (unsigned i = 1; i < Leaves.size(); i++) {
+      Chain = Builder.CreateBinOp(Root->getOpcode(), Chain, Leaves[i], "reass");
+    }
+
+    passOutput() << "Reassociated: " << *Root << " into: " << *Chain << "\n";
+    Root->replaceAllUsesWith(Chain);
+
+    // Nodes are in preorder, so every node is unused by the time it is erased.
+    for (BinaryOperator *Node : Nodes) {
+      Node->eraseFromParent();
+    }
+
+    return true;
+}
+
+bool Reassociation::reassociateBlock(BasicBlock &BB, LoopInfo &LI)
+{
+    bool Changed = false;
+    std::vector<BinaryOperator *> Roots;
+
+    for (Instruction &I : BB) {
+      auto *BO = dyn_cast<BinaryOperator>(&I);
+      if (BO == nullptr || !BO->isAssociative() || !BO->isCommutative()) {
+        continue;
+      }
+
+      if (BO->hasOneUse()) {
+        auto *User = dyn_cast<BinaryOperator>(BO->user_back());
+        if (User != nullptr && isTreeNode(BO, User)) {
+          continue;
+        }
+      }
+
+      Roots.push_back(BO);
+    }
+
+    for (BinaryOperator *Root : Roots) {
+      Changed |= reassociateTree(Root, LI);
+    }
+
+    return Changed;
+}
+
+bool Reassociation::runOnFunction(Function &F) {
+    bool Changed = false;
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+    for (BasicBlock &BB : F) {
+      Changed |= reassociateBlock(BB, LI);
+    }
+
+    return Changed;
+}
+
+void Reassociation::getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.setPreservesCFG();
+}
+
+char Reassociation::ID = 0;
+static RegisterPass<Reassociation> X("our-reassociate", "Our reassociation pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,37 @@
+#ifndef LLVM_PROJECT_REASSOCIATION_H
+#define LLVM_PROJECT_REASSOCIATION_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/SmallVector.h"
+
+using namespace llvm;
+
+// Rewrites trees of one associative and commutative operation (integer add,
+// mul, and, or, xor, and floating point add and mul under reassoc and nsz
+// fast-math flags) into a left-leaning chain whose operands are sorted by
+// rank: constants, then arguments, then instructions by loop depth. Operands
+// that are invariant in a loop end up in their own subtree at the bottom of
+// the chain, e.g. (i + a) + b becomes (a + b) + i, which MyLICMPass can hoist.
+class Reassociation : public FunctionPass {
+private:
+  unsigned getRank(Value *V, LoopInfo &LI);
+  bool isTreeNode(Value *V, BinaryOperator *Root);
+  void collectTree(BinaryOperator *Node, BinaryOperator *Root, SmallVectorImpl<Value *> &Leaves,
+                   SmallVectorImpl<BinaryOperator *> &Nodes);
+  bool isChainInRankOrder(BinaryOperator *Root, ArrayRef<Value *> Leaves, LoopInfo &LI);
+  bool reassociateTree(BinaryOperator *Root, LoopInfo &LI);
+
+public:
+  static char ID;
+  Reassociation() : FunctionPass(ID) {}
+
+  bool reassociateBlock(BasicBlock &BB, LoopInfo &LI);
+  bool runOnFunction(Function &F) override;
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+};
+
+#endif // LLVM_PROJECT_REASSOCIATION_H
@@ -0,0 +1,470 @@
+#include "ReductionVectorizer.h"
+#include "PassOutput.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/raw_ostream.h"
+
+ReductionVectorizer::ReductionVectorizer(Loop *L, StoreInst *Update, int64_t Start, uint64_t TripCount,
+                                         const TargetTransformInfo &TTI, unsigned Width)
+    : L(L), Update(Update), Start(Start), TripCount(TripCount), TTI(TTI), Width(Width)
+{
+    Counter = Update->getPointerOperand();
+}
+
+bool ReductionVectorizer::isNonEscapingAlloca(Value *V)
+{
+    if (!isa<AllocaInst>(V)) {
+      return false;
+    }
+
+    return all_of(V->users(), [V](User *U) {
+      if (auto *Load = dyn_cast<LoadInst>(U)) {
+        return Load->isSimple();
+      }
+      auto *Store = dyn_cast<StoreInst>(U);
+      return Store != nullptr && Store->isSimple() && Store->getValueOperand() != V;
+    });
+}
+
+// A load of the counter that sees this iteration's value, not the updated one.
+bool ReductionVectorizer::isCurrentCounterLoad(Value *V)
+{
+    auto *Load = dyn_cast<LoadInst>(V);
+    return Load != nullptr && Load->getPointerOperand() == Counter && Load->getParent() == Block &&
+           Load->comesBefore(Update);
+}
+
+// The loop only writes the counter and the accumulators, any other load reads the same value every iteration.
+bool ReductionVectorizer::isInvariant(Value *V)
+{
+    auto *I = dyn_cast<Instruction>(V);
+    if (I == nullptr || !L->contains(I)) {
+      return true;
+    }
+
+    if (auto *Load = dyn_cast<LoadInst>(I)) {
+      Value *Ptr = Load->getPointerOperand();
+      bool Accumulator = any_of(Reductions, [Ptr](const Reduction &R) {
+        return R.Variable == Ptr;
+      });
+      return Load->isSimple() && Ptr != Counter && !Accumulator && isInvariant(Ptr);
+    }
+
+    if (!isa<GetElementPtrInst>(I) && !isa<BinaryOperator>(I) && !isa<CastInst>(I) && !isa<CmpInst>(I) &&
+        !isa<SelectInst>(I)) {
+      return false;
+    }
+
+    return all_of(I->operands(), [this](Value *Op) {
+      return isInvariant(Op);
+    });
+}
+
+// "a[i]": every index but the last is invariant, the last is the counter and
+// the element is the loaded value, so VF iterations read consecutive memory.
+GetElementPtrInst *ReductionVectorizer::matchArrayAddress(LoadInst *Load)
+{
+    auto *GEP = dyn_cast<GetElementPtrInst>(Load->getPointerOperand());
+    if (!Load->isSimple() || GEP == nullptr || !L->contains(GEP) || GEP->getResultElementType() != Load->getType() ||
+        !isInvariant(GEP->getPointerOperand())) {
+      return nullptr;
+    }
+
+    for (unsigned i = 1; i < GEP->getNumOperands() - 1; i++) {
+      if (!isInvariant(GEP->getOperand(i))) {
+        return nullptr;
+      }
+    }
+
+    Value *Index = GEP->getOperand(GEP->getNumOperands() - 1);
+    if (isa<SExtInst>(Index) || isa<ZExtInst>(Index)) {
+      Index = cast<CastInst>(Index)->getOperand(0);
+    }
+    return isCurrentCounterLoad(Index) ? GEP : nullptr;
+}
+
+// "s = s op x", or "s = (x < s) ? x : s" and the other ways to write a min/max as a select.
+bool ReductionVectorizer::matchReduction(StoreInst *Store, Reduction &R)
+{
+    auto *Variable = dyn_cast<AllocaInst>(Store->getPointerOperand());
+    auto *Operation = dyn_cast<Instruction>(Store->getValueOperand());
+    if (Variable == nullptr || Variable == Counter || !isNonEscapingAlloca(Variable) || Operation == nullptr ||
+        Operation->getParent() != Block || !Operation->hasOneUse()) {
+      return false;
+    }
+
+    Type *Ty = Variable->getAllocatedType();
+    if (!Ty->isIntegerTy() && !Ty->isFloatingPointTy()) {
+      return false;
+    }
+
+    LoadInst *Load = nullptr;
+    for (User *U : Variable->users()) {
+      auto *I = cast<Instruction>(U);
+      if (I->getParent() != Block) {
+        continue;
+      }
+      if (auto *Other = dyn_cast<LoadInst>(I)) {
+        if (Load != nullptr || !Other->comesBefore(Store) || Other->getType() != Ty) {
+          return false;
+        }
+        Load = Other;
+      }
+      else if (I != Store) {
+        return false;
+      }
+    }
+
+    if (Load == nullptr) {
+      return false;
+    }
+
+    R.Variable = Variable;
+    R.Load = Load;
+    R.Store = Store;
+    R.Operation = Operation;
+
+    if (auto *BO = dyn_cast<BinaryOperator>(Operation)) {
+      if (!Load->hasOneUse() || (BO->getOperand(0) != Load && BO->getOperand(1) != Load)) {
+        return false;
+      }
+
+      switch (BO->getOpcode()) {
+        case Instruction::Add: R.Kind = ReductionKind::Add; return true;
+        case Instruction::Mul: R.Kind = ReductionKind::Mul; return true;
+        case Instruction::And: R.Kind = ReductionKind::And; return true;
+        case Instruction::Or: R.Kind = ReductionKind::Or; return true;
+        case Instruction::Xor: R.Kind = ReductionKind::Xor; return true;
+        case Instruction::FAdd: R.Kind = ReductionKind::FAdd; return BO->hasAllowReassoc();
+        case Instruction::FMul: R.Kind = ReductionKind::FMul; return BO->hasAllowReassoc();
+        default: return false;
+      }
+    }
+
+    auto *Select = dyn_cast<SelectInst>(Operation);
+    auto *Cmp = Select != nullptr ? dyn_cast<CmpInst>(Select->getCondition()) : nullptr;
+    if (Cmp == nullptr || !Cmp->hasOneUse() || Load->getNumUses() != 2 ||
+        (Select->getTrueValue() != Load && Select->getFalseValue() != Load)) {
+      return false;
+    }
+
+    // Normalized to "(A Pred B) ? A : B".
+    CmpInst::Predicate Pred = Cmp->getPredicate();
+    if (Cmp->getOperand(0) == Select->getFalseValue() && Cmp->getOperand(1) == Select->getTrueValue()) {
+      Pred = CmpInst::getSwappedPredicate(Pred);
+    }
+    else if (Cmp->getOperand(0) != Select->getTrueValue() || Cmp->getOperand(1) != Select->getFalseValue()) {
+      return false;
+    }
+
+    switch (Pred) {
+      case CmpInst::ICMP_SLT: case CmpInst::ICMP_SLE: R.Kind = ReductionKind::SMin; return true;
+      case CmpInst::ICMP_SGT: case CmpInst::ICMP_SGE: R.Kind = ReductionKind::SMax; return true;
+      case CmpInst::ICMP_ULT: case CmpInst::ICMP_ULE: R.Kind = ReductionKind::UMin; return true;
+      case CmpInst::ICMP_UGT: case CmpInst::ICMP_UGE: R.Kind = ReductionKind::UMax; return true;
+      case CmpInst::FCMP_OLT: case CmpInst::FCMP_OLE: case CmpInst::FCMP_ULT: case CmpInst::FCMP_ULE:
+        R.Kind = ReductionKind::FMin;
+        return Cmp->hasNoNaNs();
+      case CmpInst::FCMP_OGT: case CmpInst::FCMP_OGE: case CmpInst::FCMP_UGT: case CmpInst::FCMP_UGE:
+        R.Kind = ReductionKind::FMax;
+        return Cmp->hasNoNaNs();
+      default:
+        return false;
+    }
+}
+
+// Lane by lane the same computation, with the accumulator of R as the only variable read.
+bool ReductionVectorizer::canWiden(Value *V, const Reduction &R)
+{
+    bool Accumulator = any_of(Reductions, [V](const Reduction &Other) {
+      return Other.Load == V;
+    });
+    if (Accumulator) {
+      return V == R.Load;
+    }
+
+    if (Checked.count(V)) {
+      return true;
+    }
+
+    Type *Ty = V->getType();
+    if (!Ty->isIntegerTy() && !Ty->isFloatingPointTy()) {
+      return false;
+    }
+
+    bool Widenable = false;
+    if (isInvariant(V) || isCurrentCounterLoad(V)) {
+      Widenable = true;
+    }
+    else if (auto *Load = dyn_cast<LoadInst>(V)) {
+      Widenable = matchArrayAddress(Load) != nullptr;
+    }
+    else if (isa<BinaryOperator>(V) || isa<CastInst>(V) || isa<CmpInst>(V) || isa<SelectInst>(V)) {
+      Widenable = all_of(cast<Instruction>(V)->operands(), [this, &R](Value *Op) {
+        return canWiden(Op, R);
+      });
+    }
+
+    if (Widenable) {
+      Checked.insert(V);
+      if (!Ty->isIntegerTy(1)) {
+        ElementBits = std::max<unsigned>(ElementBits, Ty->getPrimitiveSizeInBits());
+      }
+    }
+    return Widenable;
+}
+
+bool ReductionVectorizer::canVectorize()
+{
+    Block = L->getHeader();
+    Preheader = L->getLoopPreheader();
+    if (L->getNumBlocks() != 1 || Preheader == nullptr || Update->getParent() != Block || isa<PHINode>(Block->front())) {
+      return false;
+    }
+
+    auto *Step = cast<ConstantInt>(cast<BinaryOperator>(Update->getValueOperand())->getOperand(1));
+    auto *Branch = dyn_cast<BranchInst>(Block->getTerminator());
+    if (!Step->isOne() || Branch == nullptr || !Branch->isConditional()) {
+      return false;
+    }
+
+    Exit = Branch->getSuccessor(Branch->getSuccessor(0) == Block ? 1 : 0);
+    auto *Cmp = dyn_cast<ICmpInst>(Branch->getCondition());
+    ExitLoad = Cmp != nullptr ? dyn_cast<LoadInst>(Cmp->getOperand(0)) : nullptr;
+    if (ExitLoad == nullptr || ExitLoad->getPointerOperand() != Counter || isa<PHINode>(Exit->front())) {
+      return false;
+    }
+
+    for (Instruction &I : *Block) {
+      if (auto *Store = dyn_cast<StoreInst>(&I)) {
+        Reduction R;
+        if (Store != Update && !matchReduction(Store, R)) {
+          return false;
+        }
+        if (Store != Update) {
+          Reductions.push_back(R);
+        }
+      }
+      else if (I.mayHaveSideEffects()) {
+        return false;
+      }
+    }
+
+    if (Reductions.empty()) {
+      return false;
+    }
+
+    for (Reduction &R : Reductions) {
+      if (!canWiden(R.Operation, R)) {
+        return false;
+      }
+    }
+    return ElementBits > 0;
+}
+
+Value *ReductionVectorizer::getInvariant(Value *V, IRBuilder<> &Pre)
+{
+    auto *I = dyn_cast<Instruction>(V);
+    if (I == nullptr || !L->contains(I)) {
+      return V;
+    }
+
+    auto It = Invariants.find(V);
+    if (It != Invariants.end()) {
+      return It->second;
+    }
+
+    Instruction *Copy = I->clone();
+    for (unsigned i = 0; i < Copy->getNumOperands(); i++) {
+      Copy->setOperand(i, getInvariant(I->getOperand(i), Pre));
+    }
+    Pre.Insert(Copy, I->getName());
+    Invariants[V] = Copy;
+    return Copy;
+}
+
+Value *ReductionVectorizer::widen(Value *V, IRBuilder<> &Builder, IRBuilder<> &Pre)
+{
+    auto It = Widened.find(V);
+    if (It != Widened.end()) {
+      return It->second;
+    }
+
+    Value *Result;
+    if (isInvariant(V)) {
+      Result = Pre.CreateVectorSplat(VF, getInvariant(V, Pre));
+    }
+    else if (isCurrentCounterLoad(V)) {
+      SmallVector<Constant *, 16> Lanes;
+      for (unsigned k = 0; k < VF; k++) {
+        Lanes.push_back(ConstantInt::get(V->getType(), k));
+      }
+      Result = Builder.CreateAdd(Builder.CreateVectorSplat(VF, Induction), ConstantVector::get(Lanes), "vec.counter");
+    }
+    else if (auto *Load = dyn_cast<LoadInst>(V)) {
+      GetElementPtrInst *GEP = matchArrayAddress(Load);
+      SmallVector<Value *, 4> Indices;
+      for (unsigned i = 1; i < GEP->getNumOperands() - 1; i++) {
+        Indices.push_back(getInvariant(GEP->getOperand(i), Pre));
+      }
+
+      Value *Index = GEP->getOperand(GEP->getNumOperands() - 1);
+      Value *First = Induction;
+      if (auto *Cast = dyn_cast<CastInst>(Index)) {
+        First = Builder.CreateCast(Cast->getOpcode(), Induction, Cast->getType());
+      }
+      Indices.push_back(First);
+
+      Value *Base = getInvariant(GEP->getPointerOperand(), Pre);
+      Value *Ptr = GEP->isInBounds() ? Builder.CreateInBoundsGEP(GEP->getSourceElementType(), Base, Indices)
+                                     : Builder.CreateGEP(GEP->getSourceElementType(), Base, Indices);
+      auto *VecTy = FixedVectorType::get(Load->getType(), VF);
+      Ptr = Builder.CreateBitCast(Ptr, PointerType::get(VecTy, GEP->getAddressSpace()));
+      Result = Builder.CreateAlignedLoad(VecTy, Ptr, Load->getAlign(), Load->getName() + ".vec");
+    }
+    else {
+      auto *I = cast<Instruction>(V);
+      SmallVector<Value *, 3> Operands;
+      for (Value *Op : I->operands()) {
+        Operands.push_back(widen(Op, Builder, Pre));
+      }
+
+      if (auto *BO = dyn_cast<BinaryOperator>(I)) {
+        Result = Builder.CreateBinOp(BO->getOpcode(), Operands[0], Operands[1], I->getName() + ".vec");
+      }
+      else if (auto *Cast = dyn_cast<CastInst>(I)) {
+        Result = Builder.CreateCast(Cast->getOpcode(), Operands[0], FixedVectorType::get(I->getType(), VF),
+                                    I->getName() + ".vec");
+      }
+      else if (auto *Cmp = dyn_cast<CmpInst>(I)) {
+        Result = Builder.CreateCmp(Cmp->getPredicate(), Operands[0], Operands[1], I->getName() + ".vec");
+      }
+      else {
+        Result = Builder.CreateSelect(Operands[0], Operands[1], Operands[2], I->getName() + ".vec");
+      }
+
+      if (auto *NewI = dyn_cast<Instruction>(Result)) {
+        NewI->copyIRFlags(I);
+      }
+    }
+
+    Widened[V] = Result;
+    return Result;
+}
+
+Value *ReductionVectorizer::getIdentity(const Reduction &R)
+{
+    auto *VecTy = FixedVectorType::get(R.Load->getType(), VF);
+    switch (R.Kind) {
+      case ReductionKind::Add: case ReductionKind::Or: case ReductionKind::Xor:
+        return Constant::getNullValue(VecTy);
+      case ReductionKind::Mul:
+        return ConstantInt::get(VecTy, 1);
+      case ReductionKind::And:
+        return Constant::getAllOnesValue(VecTy);
+      case ReductionKind::FAdd:
+        return ConstantFP::getNegativeZero(VecTy);
+      case ReductionKind::FMul:
+        return ConstantFP::get(VecTy, 1.0);
+      default:
+        // Every lane starts from the initial value, taking it again changes no minimum or maximum.
+        return nullptr;
+    }
+}
+
+// The initial value is not in the lanes of the sums and products, it is combined with their total.
+Value *ReductionVectorizer::reduce(const Reduction &R, Value *Vector, IRBuilder<> &Builder)
+{
+    if (isa<FPMathOperator>(R.Operation)) {
+      Builder.setFastMathFlags(R.Operation->getFastMathFlags());
+    }
+    else if (auto *Select = dyn_cast<SelectInst>(R.Operation)) {
+      if (isa<FPMathOperator>(Select->getCondition())) {
+        Builder.setFastMathFlags(cast<Instruction>(Select->getCondition())->getFastMathFlags());
+      }
+    }
+
+    switch (R.Kind) {
+      case ReductionKind::Add: return Builder.CreateAdd(R.Initial, Builder.CreateAddReduce(Vector));
+      case ReductionKind::Mul: return Builder.CreateMul(R.Initial, Builder.CreateMulReduce(Vector));
+      case ReductionKind::And: return Builder.CreateAnd(R.Initial, Builder.CreateAndReduce(Vector));
+      case ReductionKind::Or: return Builder.CreateOr(R.Initial, Builder.CreateOrReduce(Vector));
+      case ReductionKind::Xor: return Builder.CreateXor(R.Initial, Builder.CreateXorReduce(Vector));
+      case ReductionKind::FAdd: return Builder.CreateFAddReduce(R.Initial, Vector);
+      case ReductionKind::FMul: return Builder.CreateFMulReduce(R.Initial, Vector);
+      case ReductionKind::SMin: return Builder.CreateIntMinReduce(Vector, true);
+      case ReductionKind::SMax: return Builder.CreateIntMaxReduce(Vector, true);
+      case ReductionKind::UMin: return Builder.CreateIntMinReduce(Vector, false);
+      case ReductionKind::UMax: return Builder.CreateIntMaxReduce(Vector, false);
+      case ReductionKind::FMin: return Builder.CreateFPMinReduce(Vector);
+      case ReductionKind::FMax: return Builder.CreateFPMaxReduce(Vector);
+    }
+    llvm_unreachable("unknown reduction kind");
+}
+
+bool ReductionVectorizer::run()
+{
+    if (!canVectorize()) {
+      return false;
+    }
+
+    VF = Width;
+    if (VF == 0) {
+      VF = TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedValue() / ElementBits;
+    }
+    while ((VF & (VF - 1)) != 0) {
+      VF &= VF - 1;
+    }
+
+    if (VF < 2 || TripCount < VF) {
+      return false;
+    }
+
+    uint64_t Remainder = TripCount % VF;
+
+    passOutput() << "Vectorizing loop with header: " << Block->getName() << " by " << VF << " (" << Reductions.size()
+           << " reductions), remainder " << Remainder << "\n";
+
+    Function *F = Block->getParent();
+    BasicBlock *Body = BasicBlock::Create(F->getContext(), Block->getName() + ".vec", F, Block);
+    BasicBlock *Middle = BasicBlock::Create(F->getContext(), Block->getName() + ".vec.exit", F, Block);
+    Preheader->getTerminator()->replaceSuccessorWith(Block, Body);
+
+    IRBuilder<> Pre(Preheader->getTerminator());
+    IRBuilder<> Builder(Body);
+    Type *CounterTy = ExitLoad->getType();
+    Induction = Builder.CreatePHI(CounterTy, 2, "vec.index");
+    Induction->addIncoming(ConstantInt::getSigned(CounterTy, Start), Preheader);
+
+    for (Reduction &R : Reductions) {
+      R.Initial = Pre.CreateLoad(R.Load->getType(), R.Variable, R.Variable->getName() + ".init");
+      R.Phi = Builder.CreatePHI(FixedVectorType::get(R.Load->getType(), VF), 2, R.Variable->getName() + ".vec");
+      Value *Identity = getIdentity(R);
+      R.Phi->addIncoming(Identity != nullptr ? Identity : Pre.CreateVectorSplat(VF, R.Initial), Preheader);
+      Widened[R.Load] = R.Phi;
+    }
+
+    for (Reduction &R : Reductions) {
+      Value *Next = widen(R.Operation, Builder, Pre);
+      // Partial sums may overflow where the sum in the original order did not.
+      if (auto *Overflowing = dyn_cast<OverflowingBinaryOperator>(Next)) {
+        cast<Instruction>(Overflowing)->setHasNoSignedWrap(false);
+        cast<Instruction>(Overflowing)->setHasNoUnsignedWrap(false);
+      }
+      R.Phi->addIncoming(Next, Body);
+    }
+
+    Value *End = ConstantInt::getSigned(CounterTy, Start + int64_t(TripCount - Remainder));
+    Value *Next = Builder.CreateAdd(Induction, ConstantInt::get(CounterTy, VF), "vec.index.next");
+    Induction->addIncoming(Next, Body);
+    Builder.CreateCondBr(Builder.CreateICmpNE(Next, End), Body, Middle);
+
+    IRBuilder<> Out(Middle);
+    for (Reduction &R : Reductions) {
+      Out.CreateStore(reduce(R, R.Phi->getIncomingValueForBlock(Body), Out), R.Variable);
+    }
+    Out.CreateStore(End, Counter);
+    Out.CreateBr(Remainder > 0 ? Block : Exit);
+    return true;
+}
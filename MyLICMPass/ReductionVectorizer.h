@@ -0,0 +1,77 @@
+#ifndef LLVM_PROJECT_REDUCTIONVECTORIZER_H
+#define LLVM_PROJECT_REDUCTIONVECTORIZER_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+using namespace llvm;
+
+// Vectorization of reductions in a rotated innermost loop of a single block
+// with an exact trip count and a counter "i += 1". Every variable the loop
+// stores, apart from the counter, has to be an accumulator "s = s op x" of
+// a local variable (add, mul, and, or, xor, fadd and fmul that may be
+// reassociated, and min/max written as a select). x may read arrays at a[i],
+// the counter and loop invariants. The vector loop keeps a partial result of
+// every accumulator per lane and runs the largest multiple of the vector
+// width iterations, then a middle block reduces the lanes, stores the
+// results and the counter, and the original loop runs what remains.
+class ReductionVectorizer {
+private:
+  enum class ReductionKind { Add, Mul, And, Or, Xor, FAdd, FMul, SMin, SMax, UMin, UMax, FMin, FMax };
+
+  struct Reduction {
+    AllocaInst *Variable;
+    LoadInst *Load;
+    StoreInst *Store;
+    Instruction *Operation;
+    ReductionKind Kind;
+    Value *Initial = nullptr;
+    PHINode *Phi = nullptr;
+  };
+
+  Loop *L;
+  StoreInst *Update;
+  Value *Counter;
+  int64_t Start;
+  uint64_t TripCount;
+  const TargetTransformInfo &TTI;
+  unsigned Width;
+
+  BasicBlock *Block = nullptr, *Preheader = nullptr, *Exit = nullptr;
+  LoadInst *ExitLoad = nullptr;
+  SmallVector<Reduction, 4> Reductions;
+  SmallPtrSet<Value *, 16> Checked;
+  unsigned ElementBits = 0;
+
+  // Emission state.
+  unsigned VF = 0;
+  PHINode *Induction = nullptr;
+  DenseMap<Value *, Value *> Invariants;
+  DenseMap<Value *, Value *> Widened;
+
+  bool isNonEscapingAlloca(Value *V);
+  bool isCurrentCounterLoad(Value *V);
+  bool isInvariant(Value *V);
+  GetElementPtrInst *matchArrayAddress(LoadInst *Load);
+  bool matchReduction(StoreInst *Store, Reduction &R);
+  bool canWiden(Value *V, const Reduction &R);
+  bool canVectorize();
+
+  Value *getInvariant(Value *V, IRBuilder<> &Pre);
+  Value *widen(Value *V, IRBuilder<> &Builder, IRBuilder<> &Pre);
+  Value *getIdentity(const Reduction &R);
+  Value *reduce(const Reduction &R, Value *Vector, IRBuilder<> &Builder);
+
+public:
+  ReductionVectorizer(Loop *L, StoreInst *Update, int64_t Start, uint64_t TripCount, const TargetTransformInfo &TTI,
+                      unsigned Width);
+
+  bool run();
+};
+
+#endif // LLVM_PROJECT_REDUCTIONVECTORIZER_H
@@ -0,0 +1,183 @@
+#include "RegisterPressure.h"
+#include "PassOutput.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+unsigned RegisterPressure::getRegisterClass(Value *V) const
+{
+    Type *Ty = V->getType();
+    return TTI.getRegisterClassForType(Ty->isVectorTy(), Ty);
+}
+
+unsigned RegisterPressure::getBudget(unsigned RegisterClass) const
+{
+    return MaxRegisters != 0 ? MaxRegisters : TTI.getNumberOfRegisters(RegisterClass);
+}
+
+unsigned RegisterPressure::getCost(Instruction *I) const
+{
+    InstructionCost Cost = TTI.getInstructionCost(I, TargetTransformInfo::TCK_SizeAndLatency);
+    if (!Cost.isValid() || *Cost.getValue() < 1) {
+      return 1;
+    }
+    return *Cost.getValue();
+}
+
+// A hoisted value also saves the candidates that only exist to compute it.
+unsigned RegisterPressure::getSavings(Instruction *I) const
+{
+    unsigned Savings = getCost(I);
+    for (Value *Op : I->operands()) {
+      auto *OpInst = dyn_cast<Instruction>(Op);
+      if (OpInst != nullptr && Hoisted.count(OpInst) &&
+          all_of(OpInst->users(), [I](User *U) { return U == I; })) {
+        Savings += getSavings(OpInst);
+      }
+    }
+    return Savings;
+}
+
+bool RegisterPressure::isLiveAcrossLoop(Instruction *I) const
+{
+    if (I->getType()->isVoidTy()) {
+      return false;
+    }
+
+    for (User *U : I->users()) {
+      auto *UserInst = dyn_cast<Instruction>(U);
+      if (UserInst != nullptr && L->contains(UserInst) && !Hoisted.count(UserInst)) {
+        return true;
+      }
+    }
+    return false;
+}
+
+// Values defined before the loop and used in it, and the values carried
+// around the backedge. Stack slots are addressed off the frame and need none.
+void RegisterPressure::countLiveIns()
+{
+    SmallPtrSet<Value *, 16> Values;
+
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (Hoisted.count(&I)) {
+          continue;
+        }
+
+        if (isa<PHINode>(I) && BB == L->getHeader()) {
+          Values.insert(&I);
+        }
+
+        for (Value *Op : I.operands()) {
+          auto *OpInst = dyn_cast<Instruction>(Op);
+          if (isa<Argument>(Op) || (OpInst != nullptr && !L->contains(OpInst) && !isa<AllocaInst>(OpInst))) {
+            Values.insert(Op);
+          }
+        }
+      }
+    }
+
+    for (Value *V : Values) {
+      LiveIn[getRegisterClass(V)]++;
+    }
+}
+
+void RegisterPressure::keepInLoop(Instruction *I)
+{
+    Hoisted.erase(I);
+    Rematerialized.erase(I);
+
+    for (User *U : I->users()) {
+      auto *UserInst = dyn_cast<Instruction>(U);
+      if (UserInst != nullptr && (Hoisted.count(UserInst) || Rematerialized.count(UserInst))) {
+        keepInLoop(UserInst);
+      }
+    }
+}
+
+// The live-across candidate with the least savings in the first register class over its budget.
+Instruction *RegisterPressure::findOverBudget(ArrayRef<Instruction *> Candidates) const
+{
+    DenseMap<unsigned, unsigned> Pressure = LiveIn;
+    for (Instruction *I : Candidates) {
+      if (Hoisted.count(I) && isLiveAcrossLoop(I)) {
+        Pressure[getRegisterClass(I)]++;
+      }
+    }
+
+    for (auto &Entry : Pressure) {
+      if (Entry.second <= getBudget(Entry.first)) {
+        continue;
+      }
+
+      Instruction *Cheapest = nullptr;
+      unsigned CheapestSavings = 0;
+      for (Instruction *I : Candidates) {
+        if (!Hoisted.count(I) || !isLiveAcrossLoop(I) || getRegisterClass(I) != Entry.first) {
+          continue;
+        }
+
+        unsigned Savings = getSavings(I);
+        if (Cheapest == nullptr || Savings <= CheapestSavings) {
+          Cheapest = I;
+          CheapestSavings = Savings;
+        }
+      }
+
+      if (Cheapest != nullptr) {
+        passOutput() << "Register class " << TTI.getRegisterClassName(Entry.first) << " over budget (" << Entry.second
+               << " of " << getBudget(Entry.first) << "), not keeping live: " << *Cheapest << "\n";
+        return Cheapest;
+      }
+    }
+
+    return nullptr;
+}
+
+void RegisterPressure::selectCandidates(std::vector<Instruction *> &Candidates,
+                                        SmallPtrSetImpl<Instruction *> &ToRematerialize)
+{
+    Hoisted.clear();
+    Rematerialized.clear();
+    LiveIn.clear();
+
+    Hoisted.insert(Candidates.begin(), Candidates.end());
+    countLiveIns();
+
+    while (Instruction *I = findOverBudget(Candidates)) {
+      if (getCost(I) <= RematerializationCost && !isa<CallBase>(I)) {
+        Hoisted.erase(I);
+        Rematerialized.insert(I);
+      }
+      else {
+        keepInLoop(I);
+      }
+    }
+
+    // A copy is only worth making for a hoisted user, candidates come before their users.
+    SmallPtrSet<Instruction *, 16> Needed;
+    for (auto It = Candidates.rbegin(); It != Candidates.rend(); ++It) {
+      if (!Rematerialized.count(*It)) {
+        continue;
+      }
+
+      for (User *U : (*It)->users()) {
+        auto *UserInst = dyn_cast<Instruction>(U);
+        if (UserInst != nullptr && (Hoisted.count(UserInst) || Needed.count(UserInst))) {
+          Needed.insert(*It);
+          break;
+        }
+      }
+    }
+
+    std::vector<Instruction *> Selected;
+    for (Instruction *I : Candidates) {
+      if (Hoisted.count(I) || Needed.count(I)) {
+        Selected.push_back(I);
+      }
+    }
+
+    Candidates = std::move(Selected);
+    ToRematerialize.insert(Needed.begin(), Needed.end());
+}
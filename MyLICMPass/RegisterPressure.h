@@ -0,0 +1,50 @@
+#ifndef LLVM_PROJECT_REGISTERPRESSURE_H
+#define LLVM_PROJECT_REGISTERPRESSURE_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// Register pressure model for the values live across a loop, one budget per
+// target register class. Every hoisted value that the loop still uses stays
+// live through all iterations, so hoisting candidates are admitted by their
+// savings per iteration until a class is full. Cheap values over the budget
+// are rematerialized instead: the loop keeps its own copy and only the
+// hoisted users get one in the preheader. Everything else over the budget
+// stays in the loop together with the candidates computed from it.
+class RegisterPressure {
+private:
+  Loop *L;
+  const TargetTransformInfo &TTI;
+  unsigned MaxRegisters;
+  unsigned RematerializationCost;
+
+  SmallPtrSet<Instruction *, 16> Hoisted;
+  SmallPtrSet<Instruction *, 16> Rematerialized;
+  DenseMap<unsigned, unsigned> LiveIn;
+
+  unsigned getRegisterClass(Value *V) const;
+  unsigned getBudget(unsigned RegisterClass) const;
+  unsigned getCost(Instruction *I) const;
+  unsigned getSavings(Instruction *I) const;
+  bool isLiveAcrossLoop(Instruction *I) const;
+  void countLiveIns();
+  void keepInLoop(Instruction *I);
+  Instruction *findOverBudget(ArrayRef<Instruction *> Candidates) const;
+
+public:
+  RegisterPressure(Loop *L, const TargetTransformInfo &TTI, unsigned MaxRegisters, unsigned RematerializationCost)
+      : L(L), TTI(TTI), MaxRegisters(MaxRegisters), RematerializationCost(RematerializationCost) {}
+
+  // Narrows Candidates (in hoisting order) down to the instructions that
+  // should leave the loop. Those in ToRematerialize are copied, not moved.
+  void selectCandidates(std::vector<Instruction *> &Candidates, SmallPtrSetImpl<Instruction *> &ToRematerialize);
+};
+
+#endif // LLVM_PROJECT_REGISTERPRESSURE_H
@@ -0,0 +1,255 @@
+#include "ScalarReplacement.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+#include <algorithm>
+
+ScalarReplacement::ScalarReplacement(Loop *L, DominatorTree &DT, StoreInst *Update, unsigned MaxDistance)
+    : L(L), DT(DT), Update(Update), MaxDistance(MaxDistance)
+{
+    Counter = Update->getPointerOperand();
+    Step = cast<ConstantInt>(cast<BinaryOperator>(Update->getValueOperand())->getOperand(1))->getSExtValue();
+}
+
+// A load of the counter that sees this iteration's value, not the updated one.
+bool ScalarReplacement::isCurrentCounterLoad(Value *V)
+{
+    auto *Load = dyn_cast<LoadInst>(V);
+    if (Load == nullptr || Load->getPointerOperand() != Counter || !L->contains(Load)) {
+      return false;
+    }
+
+    return Load->getParent() != Update->getParent() || Load->comesBefore(Update);
+}
+
+// Matches "load (gep Base, Indices..., cast(i + Offset))" executed once per iteration.
+bool ScalarReplacement::matchLoad(LoadInst *Load, ArrayReference &Reference, int64_t &Offset)
+{
+    if (!Load->isSimple() || !DT.dominates(Load->getParent(), L->getLoopLatch())) {
+      return false;
+    }
+
+    auto *GEP = dyn_cast<GetElementPtrInst>(Load->getPointerOperand());
+    if (GEP == nullptr || GEP->getNumIndices() == 0) {
+      return false;
+    }
+
+    auto IsInvariant = [this](Value *V) {
+      auto *I = dyn_cast<Instruction>(V);
+      return I == nullptr || !L->contains(I);
+    };
+
+    Reference.Base = GEP->getPointerOperand();
+    Reference.SourceType = GEP->getSourceElementType();
+    Reference.LoadType = Load->getType();
+    Reference.Indices.clear();
+    if (!IsInvariant(Reference.Base)) {
+      return false;
+    }
+
+    for (unsigned i = 1; i < GEP->getNumOperands() - 1; i++) {
+      if (!IsInvariant(GEP->getOperand(i))) {
+        return false;
+      }
+      Reference.Indices.push_back(GEP->getOperand(i));
+    }
+
+    Value *Index = GEP->getOperand(GEP->getNumOperands() - 1);
+    Reference.IndexType = Index->getType();
+    Reference.CastOpcode = 0;
+    if (isa<SExtInst>(Index) || isa<ZExtInst>(Index)) {
+      Reference.CastOpcode = cast<CastInst>(Index)->getOpcode();
+      Index = cast<CastInst>(Index)->getOperand(0);
+    }
+
+    Offset = 0;
+    if (auto *BO = dyn_cast<BinaryOperator>(Index)) {
+      auto *C0 = dyn_cast<ConstantInt>(BO->getOperand(0));
+      auto *C1 = dyn_cast<ConstantInt>(BO->getOperand(1));
+      if (BO->getOpcode() == Instruction::Add && C1 != nullptr) {
+        Offset = C1->getSExtValue();
+        Index = BO->getOperand(0);
+      }
+      else if (BO->getOpcode() == Instruction::Add && C0 != nullptr) {
+        Offset = C0->getSExtValue();
+        Index = BO->getOperand(1);
+      }
+      else if (BO->getOpcode() == Instruction::Sub && C1 != nullptr) {
+        Offset = -C1->getSExtValue();
+        Index = BO->getOperand(0);
+      }
+    }
+
+    return isCurrentCounterLoad(Index);
+}
+
+void ScalarReplacement::collectReferences()
+{
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        auto *Load = dyn_cast<LoadInst>(&I);
+        ArrayReference Candidate;
+        int64_t Offset;
+        if (Load == nullptr || !matchLoad(Load, Candidate, Offset)) {
+          continue;
+        }
+
+        ArrayReference *Reference = nullptr;
+        for (ArrayReference &Existing : References) {
+          if (Existing.Base == Candidate.Base && Existing.SourceType == Candidate.SourceType &&
+              Existing.Indices == Candidate.Indices && Existing.CastOpcode == Candidate.CastOpcode &&
+              Existing.IndexType == Candidate.IndexType && Existing.LoadType == Candidate.LoadType) {
+            Reference = &Existing;
+            break;
+          }
+        }
+
+        if (Reference == nullptr) {
+          References.push_back(Candidate);
+          Reference = &References.back();
+        }
+        Reference->Offsets[Offset].push_back(Load);
+      }
+    }
+}
+
+// Stores only count when they may hit Object: scalar locals never do, and
+// two distinct identified objects (globals, allocas) never overlap.
+bool ScalarReplacement::mayBeWrittenInLoop(Value *Object)
+{
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        auto *SI = dyn_cast<StoreInst>(&I);
+        if (SI == nullptr) {
+          if (I.mayWriteToMemory()) {
+            return true;
+          }
+          continue;
+        }
+
+        const Value *Target = getUnderlyingObject(SI->getPointerOperand());
+        bool IsScalarLocal = isa<AllocaInst>(Target) && all_of(Target->users(), [Target](const User *U) {
+          auto *Store = dyn_cast<StoreInst>(U);
+          return isa<LoadInst>(U) || (Store != nullptr && Store->getValueOperand() != Target);
+        });
+
+        if (IsScalarLocal || (isIdentifiedObject(Target) && isIdentifiedObject(Object) && Target != Object)) {
+          continue;
+        }
+        return true;
+      }
+    }
+
+    return false;
+}
+
+Value *ScalarReplacement::getInitialCounter()
+{
+    if (InitialCounter == nullptr) {
+      IRBuilder<> Builder(L->getLoopPreheader()->getTerminator());
+      InitialCounter = Builder.CreateLoad(Update->getValueOperand()->getType(), Counter, "sr.iv");
+    }
+    return InitialCounter;
+}
+
+// The rotated loop is guarded, so the preheader only runs when the first
+// iteration loads the same addresses, or ones between them.
+Value *ScalarReplacement::loadBeforeLoop(ArrayReference &Reference, int64_t Offset, Align Alignment)
+{
+    Value *Start = getInitialCounter();
+    IRBuilder<> Builder(L->getLoopPreheader()->getTerminator());
+
+    Value *Index = Offset == 0 ? Start : Builder.CreateAdd(Start, ConstantInt::get(Start->getType(), Offset, true));
+    if (Reference.CastOpcode != 0) {
+      Index = Builder.CreateCast(static_cast<Instruction::CastOps>(Reference.CastOpcode), Index, Reference.IndexType);
+    }
+
+    SmallVector<Value *, 4> Indices(Reference.Indices.begin(), Reference.Indices.end());
+    Indices.push_back(Index);
+    Value *Ptr = Builder.CreateGEP(Reference.SourceType, Reference.Base, Indices);
+    return Builder.CreateAlignedLoad(Reference.LoadType, Ptr, Alignment, "sr.init");
+}
+
+// Offset Lead - j * Step in this iteration is offset Lead - (j - 1) * Step of the
+// previous one, so each PHI takes the value of its neighbour around the backedge.
+unsigned ScalarReplacement::replaceChain(ArrayReference &Reference, int64_t Lead)
+{
+    unsigned Length = 0;
+    for (unsigned j = 1; j <= MaxDistance; j++) {
+      if (Reference.Offsets.count(Lead - j * Step)) {
+        Length = j;
+      }
+    }
+
+    if (Length == 0) {
+      return 0;
+    }
+
+    LoadInst *LeadLoad = Reference.Offsets[Lead].front();
+    BasicBlock *Header = L->getHeader();
+    Value *Previous = LeadLoad;
+
+    // Elements in between are only known to be as aligned as the least aligned reference.
+    Align Alignment = LeadLoad->getAlign();
+    for (auto &Entry : Reference.Offsets) {
+      for (LoadInst *Load : Entry.second) {
+        Alignment = std::min(Alignment, Load->getAlign());
+      }
+    }
+
+    for (unsigned j = 1; j <= Length; j++) {
+      int64_t Offset = Lead - j * Step;
+      PHINode *PN = PHINode::Create(Reference.LoadType, 2, "sr", &Header->front());
+      PN->addIncoming(loadBeforeLoop(Reference, Offset, Alignment), L->getLoopPreheader());
+      PN->addIncoming(Previous, L->getLoopLatch());
+      Previous = PN;
+
+      auto It = Reference.Offsets.find(Offset);
+      if (It == Reference.Offsets.end()) {
+        continue;
+      }
+
+      for (LoadInst *Load : It->second) {
+        passOutput() << "Reusing the load of an earlier iteration for: " << *Load << "\n";
+        Value *Ptr = Load->getPointerOperand();
+        Load->replaceAllUsesWith(PN);
+        Load->eraseFromParent();
+        RecursivelyDeleteTriviallyDeadInstructions(Ptr);
+      }
+      Reference.Offsets.erase(It);
+    }
+
+    return Length;
+}
+
+bool ScalarReplacement::run()
+{
+    BasicBlock *Latch = L->getLoopLatch();
+    if (!L->isInnermost() || L->getLoopPreheader() == nullptr || Latch == nullptr ||
+        L->getExitingBlock() != Latch || Update->getParent() != Latch || Step == 0) {
+      return false;
+    }
+
+    collectReferences();
+
+    bool Changed = false;
+    for (ArrayReference &Reference : References) {
+      if (Reference.Offsets.size() < 2 || mayBeWrittenInLoop(getUnderlyingObject(Reference.Base))) {
+        continue;
+      }
+
+      // The reference furthest ahead in the direction of the counter is the one still loaded.
+      while (!Reference.Offsets.empty()) {
+        int64_t Lead = Step > 0 ? Reference.Offsets.rbegin()->first : Reference.Offsets.begin()->first;
+        Changed |= replaceChain(Reference, Lead) != 0;
+        Reference.Offsets.erase(Lead);
+      }
+    }
+
+    return Changed;
+}
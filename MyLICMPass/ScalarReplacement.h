@@ -0,0 +1,56 @@
+#ifndef LLVM_PROJECT_SCALARREPLACEMENT_H
+#define LLVM_PROJECT_SCALARREPLACEMENT_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <map>
+#include <vector>
+
+using namespace llvm;
+
+// Scalar replacement of array references in a rotated loop with a counter
+// "i += Step" updated in the latch. Loads of a[i + c] whose addresses differ
+// by multiples of Step read what an earlier iteration already loaded, so only
+// the one furthest ahead is kept and the others are fed through a chain of
+// header PHIs (rotating registers) that the preheader initializes. The loop
+// must not write memory the arrays could live in.
+class ScalarReplacement {
+private:
+  // Loads that only differ in the constant added to the counter.
+  struct ArrayReference {
+    Value *Base;
+    Type *SourceType;
+    SmallVector<Value *, 2> Indices;
+    unsigned CastOpcode;
+    Type *IndexType;
+    Type *LoadType;
+    std::map<int64_t, SmallVector<LoadInst *, 2>> Offsets;
+  };
+
+  Loop *L;
+  DominatorTree &DT;
+  StoreInst *Update;
+  Value *Counter;
+  int64_t Step;
+  unsigned MaxDistance;
+  std::vector<ArrayReference> References;
+  Value *InitialCounter = nullptr;
+
+  bool isCurrentCounterLoad(Value *V);
+  bool matchLoad(LoadInst *Load, ArrayReference &Reference, int64_t &Offset);
+  void collectReferences();
+  bool mayBeWrittenInLoop(Value *Object);
+  Value *getInitialCounter();
+  Value *loadBeforeLoop(ArrayReference &Reference, int64_t Offset, Align Alignment);
+  unsigned replaceChain(ArrayReference &Reference, int64_t Lead);
+
+public:
+  ScalarReplacement(Loop *L, DominatorTree &DT, StoreInst *Update, unsigned MaxDistance);
+
+  bool run();
+};
+
+#endif // LLVM_PROJECT_SCALARREPLACEMENT_H
@@ -0,0 +1,211 @@
+#include "StoreForwarding.h"
+#include "PassOutput.h"
+
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+
+// Only whole-value accesses of the allocated type, so a forwarded value
+// always has the type of the load it replaces.
+void StoreForwarding::findAllVariables(Function &F)
+{
+    for (Instruction &I : F.getEntryBlock()) {
+      auto *Alloca = dyn_cast<AllocaInst>(&I);
+      if (Alloca == nullptr || Alloca->isArrayAllocation()) {
+        continue;
+      }
+
+      Type *Ty = Alloca->getAllocatedType();
+      bool Promotable = all_of(Alloca->users(), [Alloca, Ty](User *U) {
+        if (auto *Load = dyn_cast<LoadInst>(U)) {
+          return Load->isSimple() && Load->getType() == Ty;
+        }
+        auto *Store = dyn_cast<StoreInst>(U);
+        return Store != nullptr && Store->isSimple() && Store->getValueOperand() != Alloca &&
+               Store->getValueOperand()->getType() == Ty;
+      });
+
+      if (Promotable) {
+        VariableIndices[Alloca] = Variables.size();
+        Variables.push_back(Alloca);
+      }
+    }
+}
+
+void StoreForwarding::collectStores(Function &F)
+{
+    for (BasicBlock &BB : F) {
+      BlockState &State = States[&BB];
+      State.Stored.resize(Variables.size());
+
+      for (Instruction &I : BB) {
+        auto *Store = dyn_cast<StoreInst>(&I);
+        if (Store == nullptr) {
+          continue;
+        }
+
+        auto It = VariableIndices.find(Store->getPointerOperand());
+        if (It != VariableIndices.end()) {
+          State.Stored.set(It->second);
+        }
+      }
+    }
+}
+
+// Defined on entry: every path from the function entry stores to the variable.
+// Unreachable blocks have no such path and are never defined.
+void StoreForwarding::computeDefined(Function &F, OurCFG &CFG)
+{
+    CFG.DFS(&F.getEntryBlock());
+    for (BasicBlock &BB : F) {
+      States[&BB].DefinedOut = BitVector(Variables.size(), CFG.isReachable(&BB));
+    }
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+
+      for (BasicBlock &BB : F) {
+        BlockState &State = States[&BB];
+        ArrayRef<BasicBlock *> Predecessors = CFG.getPredecessors(&BB);
+
+        State.DefinedIn = BitVector(Variables.size(), !Predecessors.empty() && CFG.isReachable(&BB));
+        for (BasicBlock *Predecessor : Predecessors) {
+          State.DefinedIn &= States[Predecessor].DefinedOut;
+        }
+
+        BitVector Out = State.DefinedIn;
+        Out |= State.Stored;
+
+        if (Out != State.DefinedOut) {
+          State.DefinedOut = Out;
+          Changed = true;
+        }
+      }
+    }
+}
+
+// A value collected before an earlier load was forwarded may be that load.
+Value *StoreForwarding::resolve(Value *V)
+{
+    while (auto *Load = dyn_cast<LoadInst>(V)) {
+      auto It = Replaced.find(Load);
+      if (It == Replaced.end()) {
+        break;
+      }
+      V = It->second;
+    }
+    return V;
+}
+
+bool StoreForwarding::forwardVariable(Function &F, AllocaInst *Variable)
+{
+    unsigned Index = VariableIndices[Variable];
+    SSAUpdater SSA(&InsertedPHIs);
+    SSA.Initialize(Variable->getAllocatedType(), Variable->getName());
+
+    // The value each block leaves in the variable, read now since earlier variables may have rewritten it.
+    for (BasicBlock &BB : F) {
+      if (!States[&BB].Stored.test(Index)) {
+        continue;
+      }
+
+      Value *Last = nullptr;
+      for (Instruction &I : BB) {
+        auto *Store = dyn_cast<StoreInst>(&I);
+        if (Store != nullptr && Store->getPointerOperand() == Variable) {
+          Last = Store->getValueOperand();
+        }
+      }
+      SSA.AddAvailableValue(&BB, resolve(Last));
+    }
+
+    std::vector<std::pair<LoadInst *, Value *>> Forwarded;
+    for (BasicBlock &BB : F) {
+      Value *Current = nullptr;
+
+      for (Instruction &I : BB) {
+        if (auto *Store = dyn_cast<StoreInst>(&I)) {
+          if (Store->getPointerOperand() == Variable) {
+            Current = Store->getValueOperand();
+          }
+          continue;
+        }
+
+        auto *Load = dyn_cast<LoadInst>(&I);
+        if (Load == nullptr || Load->getPointerOperand() != Variable) {
+          continue;
+        }
+
+        if (Current != nullptr) {
+          Forwarded.push_back({Load, Current});
+        }
+        else if (States[&BB].DefinedIn.test(Index)) {
+          Forwarded.push_back({Load, SSA.GetValueInMiddleOfBlock(&BB)});
+        }
+      }
+    }
+
+    bool Changed = false;
+    for (auto &Forward : Forwarded) {
+      Value *Replacement = resolve(Forward.second);
+      if (Replacement == Forward.first) {
+        continue;
+      }
+
+      passOutput() << "Forwarding to: " << *Forward.first << " the value: " << *Replacement << "\n";
+      Forward.first->replaceAllUsesWith(Replacement);
+      Replaced[Forward.first] = Replacement;
+      Changed = true;
+    }
+
+    return Changed;
+}
+
+bool StoreForwarding::runOnFunction(Function &F) {
+    Variables.clear();
+    VariableIndices.clear();
+    States.clear();
+    Replaced.clear();
+    InsertedPHIs.clear();
+    Allocator.Reset();
+
+    if (F.isDeclaration()) {
+      return false;
+    }
+
+    findAllVariables(F);
+    collectStores(F);
+
+    OurCFG CFG(F, Allocator);
+    computeDefined(F, CFG);
+
+    bool Changed = false;
+    for (AllocaInst *Variable : Variables) {
+      Changed |= forwardVariable(F, Variable);
+    }
+
+    for (auto &Forward : Replaced) {
+      Forward.first->eraseFromParent();
+    }
+
+    // Merges of one value, e.g. a variable stored once before a branch.
+    bool Simplified = true;
+    while (Simplified) {
+      Simplified = false;
+      for (PHINode *&PN : InsertedPHIs) {
+        Value *Same = PN != nullptr ? PN->hasConstantValue() : nullptr;
+        if (Same != nullptr && Same != PN) {
+          PN->replaceAllUsesWith(Same);
+          PN->eraseFromParent();
+          PN = nullptr;
+          Simplified = true;
+        }
+      }
+    }
+
+    return Changed;
+}
+
+char StoreForwarding::ID = 0;
+static RegisterPass<StoreForwarding> X("our-store-forwarding", "Our store to load forwarding pass",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
@@ -0,0 +1,53 @@
+#ifndef LLVM_PROJECT_STOREFORWARDING_H
+#define LLVM_PROJECT_STOREFORWARDING_H
+
+#include "llvm/Pass.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <vector>
+
+#include "OurCFG.h"
+
+using namespace llvm;
+
+// Store to load forwarding for any stored value, not just constants. For
+// every alloca that is only loaded and stored as a whole, the last value
+// stored in each block is tracked along the CFG. A load after a store in its
+// block takes that value directly, and a load that every path from the entry
+// reaches through some store takes the value reaching its block, with PHIs
+// where different stores meet. Loads that may see the uninitialized
+// variable are left alone, the stores themselves are left to DCE.
+class StoreForwarding : public FunctionPass {
+private:
+  struct BlockState {
+    BitVector Stored, DefinedIn, DefinedOut;
+  };
+
+  std::vector<AllocaInst *> Variables;
+  DenseMap<Value *, unsigned> VariableIndices;
+  DenseMap<BasicBlock *, BlockState> States;
+  // Forwarded loads, erased once every variable is done since a stored value may be one of them.
+  DenseMap<LoadInst *, Value *> Replaced;
+  SmallVector<PHINode *, 16> InsertedPHIs;
+  BumpPtrAllocator Allocator;
+
+  void findAllVariables(Function &F);
+  void collectStores(Function &F);
+  void computeDefined(Function &F, OurCFG &CFG);
+  Value *resolve(Value *V);
+  bool forwardVariable(Function &F, AllocaInst *Variable);
+
+public:
+  static char ID;
+  StoreForwarding() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override;
+};
+
+#endif // LLVM_PROJECT_STOREFORWARDING_H
@@ -0,0 +1,426 @@
+#include "StrengthReduction.h"
+#include "PassOutput.h"
+
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+StrengthReduction::StrengthReduction(Loop *L, StoreInst *Update, ConstantInt *Start, uint64_t TripCount,
+                                     unsigned MaxRecurrences)
+    : L(L), Update(Update), Start(Start), TripCount(TripCount), MaxRecurrences(MaxRecurrences),
+      DL(L->getHeader()->getModule()->getDataLayout())
+{
+    Counter = Update->getPointerOperand();
+    Step = cast<ConstantInt>(cast<BinaryOperator>(Update->getValueOperand())->getOperand(1))->getSExtValue();
+}
+
+// A load of the counter that sees this iteration's value, not the updated one.
+bool StrengthReduction::isCurrentCounterLoad(Value *V)
+{
+    auto *Load = dyn_cast<LoadInst>(V);
+    if (Load == nullptr || Load->getPointerOperand() != Counter || !L->contains(Load)) {
+      return false;
+    }
+
+    return Load->getParent() != Update->getParent() || Load->comesBefore(Update);
+}
+
+bool StrengthReduction::isInvariant(Value *V)
+{
+    auto *I = dyn_cast<Instruction>(V);
+    return I == nullptr || !L->contains(I);
+}
+
+// Varies is set when V depends on the counter, Scales when that goes through a multiplication,
+// a shift or a GEP. Below a sign extension, and in GEP indices that are extended to the index
+// width, the arithmetic has to be nsw so that extending each value extends the whole sequence.
+bool StrengthReduction::isAffine(Value *V, bool NoWrap, bool &Varies, bool &Scales, unsigned Depth)
+{
+    if (Depth > 8) {
+      return false;
+    }
+
+    if (isCurrentCounterLoad(V)) {
+      Varies = true;
+      return true;
+    }
+
+    if (isInvariant(V)) {
+      return true;
+    }
+
+    if (auto *GEP = dyn_cast<GetElementPtrInst>(V)) {
+      if (!isInvariant(GEP->getPointerOperand())) {
+        return false;
+      }
+
+      unsigned IndexWidth = DL.getIndexTypeSizeInBits(GEP->getType());
+      for (Use &Index : GEP->indices()) {
+        bool IndexVaries = false;
+        if (!isAffine(Index, Index->getType()->getScalarSizeInBits() < IndexWidth, IndexVaries, Scales, Depth + 1)) {
+          return false;
+        }
+        Varies |= IndexVaries;
+        Scales |= IndexVaries;
+      }
+      return true;
+    }
+
+    if (auto *Ext = dyn_cast<SExtInst>(V)) {
+      return isAffine(Ext->getOperand(0), true, Varies, Scales, Depth + 1);
+    }
+
+    auto *BO = dyn_cast<BinaryOperator>(V);
+    if (BO == nullptr || (NoWrap && !BO->hasNoSignedWrap())) {
+      return false;
+    }
+
+    bool LhsVaries = false, RhsVaries = false;
+    if (BO->getOpcode() == Instruction::Add || BO->getOpcode() == Instruction::Sub) {
+      if (!isAffine(BO->getOperand(0), NoWrap, LhsVaries, Scales, Depth + 1) ||
+          !isAffine(BO->getOperand(1), NoWrap, RhsVaries, Scales, Depth + 1)) {
+        return false;
+      }
+    }
+    else if (BO->getOpcode() == Instruction::Mul) {
+      if (!isAffine(BO->getOperand(0), NoWrap, LhsVaries, Scales, Depth + 1) ||
+          !isAffine(BO->getOperand(1), NoWrap, RhsVaries, Scales, Depth + 1) || (LhsVaries && RhsVaries)) {
+        return false;
+      }
+      // The stride is computed in the preheader from the other factor, so it has to be defined there.
+      if ((LhsVaries && !isInvariant(BO->getOperand(1))) || (RhsVaries && !isInvariant(BO->getOperand(0)))) {
+        return false;
+      }
+      Scales |= LhsVaries || RhsVaries;
+    }
+    else if (BO->getOpcode() == Instruction::Shl) {
+      if (!isa<ConstantInt>(BO->getOperand(1)) || !isAffine(BO->getOperand(0), NoWrap, LhsVaries, Scales, Depth + 1)) {
+        return false;
+      }
+      Scales |= LhsVaries;
+    }
+    else {
+      return false;
+    }
+
+    Varies |= LhsVaries || RhsVaries;
+    return true;
+}
+
+// Every access reloads the counter, so the same expression shows up once per use.
+bool StrengthReduction::isSameExpression(Value *A, Value *B)
+{
+    if (A == B || (isCurrentCounterLoad(A) && isCurrentCounterLoad(B))) {
+      return true;
+    }
+
+    auto *IA = dyn_cast<Instruction>(A), *IB = dyn_cast<Instruction>(B);
+    if (IA == nullptr || IB == nullptr || isInvariant(IA) || isInvariant(IB) || isa<LoadInst>(IA) ||
+        !IA->isSameOperationAs(IB)) {
+      return false;
+    }
+
+    for (unsigned i = 0; i < IA->getNumOperands(); i++) {
+      if (!isSameExpression(IA->getOperand(i), IB->getOperand(i))) {
+        return false;
+      }
+    }
+    return true;
+}
+
+// The largest affine expressions, whose value something else than another affine expression uses.
+void StrengthReduction::collectRoots()
+{
+    for (BasicBlock *BB : L->blocks()) {
+      for (Instruction &I : *BB) {
+        bool Varies = false, Scales = false;
+        if (isCurrentCounterLoad(&I) || !isAffine(&I, false, Varies, Scales) || !Varies || !Scales) {
+          continue;
+        }
+
+        bool OnlyInLargerExpressions = all_of(I.users(), [this](User *U) {
+          auto *UserInst = cast<Instruction>(U);
+          bool UserVaries = false, UserScales = false;
+          return L->contains(UserInst) && isAffine(UserInst, false, UserVaries, UserScales);
+        });
+        if (OnlyInLargerExpressions) {
+          continue;
+        }
+
+        auto Same = find_if(Recurrences, [&](Recurrence &R) { return isSameExpression(R.Roots.front(), &I); });
+        if (Same != Recurrences.end()) {
+          Same->Roots.push_back(&I);
+        }
+        else if (Recurrences.size() < MaxRecurrences) {
+          Recurrences.emplace_back();
+          Recurrences.back().Roots.push_back(&I);
+        }
+      }
+    }
+}
+
+Value *StrengthReduction::getInitialCounter(IRBuilder<> &Builder)
+{
+    if (Start != nullptr) {
+      return Start;
+    }
+
+    if (InitialCounter == nullptr) {
+      InitialCounter = Builder.CreateLoad(Update->getValueOperand()->getType(), Counter, "lsr.iv");
+    }
+    return InitialCounter;
+}
+
+// The expression with the counter it starts from, computed in the preheader. The rotated loop is
+// guarded, but a root in a block the first iteration skips may overflow there, so the copies drop
+// nsw and inbounds.
+Value *StrengthReduction::expandInitial(Value *V, IRBuilder<> &Builder)
+{
+    if (isCurrentCounterLoad(V)) {
+      return getInitialCounter(Builder);
+    }
+
+    if (isInvariant(V)) {
+      return V;
+    }
+
+    auto *I = cast<Instruction>(V);
+    Instruction *Copy = I->clone();
+    for (unsigned i = 0; i < I->getNumOperands(); i++) {
+      Copy->setOperand(i, expandInitial(I->getOperand(i), Builder));
+    }
+    Copy->dropPoisonGeneratingFlags();
+    if (Constant *Folded = ConstantFoldInstruction(Copy, DL)) {
+      Copy->deleteValue();
+      return Folded;
+    }
+    return Builder.Insert(Copy, I->getName() + ".init");
+}
+
+// Counters mostly step by one, the stride of i * n is then n itself.
+static Value *multiply(Value *Stride, Value *Factor, IRBuilder<> &Builder)
+{
+    auto *Constant = dyn_cast<ConstantInt>(Stride);
+    return Constant != nullptr && Constant->isOne() ? Factor : Builder.CreateMul(Stride, Factor);
+}
+
+// What the expression grows by from one iteration to the next, nullptr where it does not vary,
+// including loop instructions that only combine invariants.
+// Strides of pointers are in bytes.
+Value *StrengthReduction::getStride(Value *V, IRBuilder<> &Builder)
+{
+    if (isCurrentCounterLoad(V)) {
+      return ConstantInt::get(V->getType(), Step, true);
+    }
+
+    if (isInvariant(V)) {
+      return nullptr;
+    }
+
+    if (auto *GEP = dyn_cast<GetElementPtrInst>(V)) {
+      Type *IndexTy = DL.getIndexType(GEP->getType());
+      Value *Stride = nullptr;
+      for (gep_type_iterator It = gep_type_begin(GEP), End = gep_type_end(GEP); It != End; ++It) {
+        Value *IndexStride = getStride(It.getOperand(), Builder);
+        if (IndexStride == nullptr) {
+          continue;
+        }
+
+        Value *Bytes = Builder.CreateMul(Builder.CreateSExtOrTrunc(IndexStride, IndexTy),
+                                         ConstantInt::get(IndexTy, DL.getTypeAllocSize(It.getIndexedType())));
+        Stride = Stride == nullptr ? Bytes : Builder.CreateAdd(Stride, Bytes);
+      }
+      return Stride;
+    }
+
+    auto *I = cast<Instruction>(V);
+    Value *Lhs = getStride(I->getOperand(0), Builder);
+    if (isa<SExtInst>(I)) {
+      return Lhs == nullptr ? nullptr : Builder.CreateSExt(Lhs, I->getType());
+    }
+
+    Value *Rhs = getStride(I->getOperand(1), Builder);
+    if (Lhs == nullptr && Rhs == nullptr) {
+      return nullptr;
+    }
+
+    switch (I->getOpcode()) {
+      case Instruction::Add:
+        return Lhs != nullptr && Rhs != nullptr ? Builder.CreateAdd(Lhs, Rhs) : Lhs != nullptr ? Lhs : Rhs;
+      case Instruction::Sub:
+        if (Rhs == nullptr) {
+          return Lhs;
+        }
+        return Lhs != nullptr ? Builder.CreateSub(Lhs, Rhs) : Builder.CreateNeg(Rhs);
+      case Instruction::Mul:
+        return Lhs != nullptr ? multiply(Lhs, I->getOperand(1), Builder) : multiply(Rhs, I->getOperand(0), Builder);
+      default:
+        return Builder.CreateShl(Lhs, I->getOperand(1));
+    }
+}
+
+// The rotated loop goes on while the updated counter passes the test, which holds for the first
+// TripCount - 1 updates. A recurrence with a constant stride that cannot wrap in TripCount steps
+// reaches Initial + TripCount * Stride at the same point and never before.
+bool StrengthReduction::replaceExitTest()
+{
+    BasicBlock *Latch = L->getLoopLatch();
+    auto *Exit = cast<BranchInst>(Latch->getTerminator());
+    auto *Cmp = dyn_cast<ICmpInst>(Exit->getCondition());
+    auto *CounterLoad = Cmp != nullptr ? dyn_cast<LoadInst>(Cmp->getOperand(0)) : nullptr;
+    if (TripCount == 0 || CounterLoad == nullptr || CounterLoad->getPointerOperand() != Counter ||
+        CounterLoad->getParent() != Latch || !Update->comesBefore(CounterLoad) || !Cmp->hasOneUse()) {
+      return false;
+    }
+
+    for (Recurrence &R : Recurrences) {
+      auto *Stride = dyn_cast<ConstantInt>(R.Stride);
+      unsigned Width = R.Phi->getType()->isPointerTy() ? DL.getIndexTypeSizeInBits(R.Phi->getType())
+                                                       : R.Phi->getType()->getIntegerBitWidth();
+      if (Stride == nullptr || Stride->isZero() || Width < 8 || Width > 64) {
+        continue;
+      }
+
+      int64_t Amount = Stride->getSExtValue();
+      uint64_t Magnitude = Amount < 0 ? -uint64_t(Amount) : uint64_t(Amount);
+      if (TripCount >= (uint64_t(1) << (Width - 2)) / Magnitude) {
+        continue;
+      }
+
+      IRBuilder<> Builder(L->getLoopPreheader()->getTerminator());
+      Value *Distance = ConstantInt::get(Stride->getType(), int64_t(TripCount) * Amount, true);
+      Value *Final = R.Phi->getType()->isPointerTy() ? Builder.CreateGEP(Builder.getInt8Ty(), R.Initial, Distance, "lsr.end")
+                                                     : Builder.CreateAdd(R.Initial, Distance, "lsr.end");
+
+      bool ContinuesOnTrue = L->contains(Exit->getSuccessor(0));
+      Builder.SetInsertPoint(Exit);
+      Exit->setCondition(ContinuesOnTrue ? Builder.CreateICmpNE(R.Next, Final, "lsr.cond")
+                                         : Builder.CreateICmpEQ(R.Next, Final, "lsr.cond"));
+      passOutput() << "Testing the exit of the loop with header " << L->getHeader()->getName() << " on: " << *R.Phi << "\n";
+      RecursivelyDeleteTriviallyDeadInstructions(Cmp);
+      return true;
+    }
+
+    return false;
+}
+
+// A counter that is only stored to, apart from the load of its own update, is dead. The counter
+// does not escape, so a load after a store to it in the same block, like the guard of the rotated
+// loop, reads the stored value.
+bool StrengthReduction::removeCounter()
+{
+    auto *Increment = cast<BinaryOperator>(Update->getValueOperand());
+    auto *IncrementLoad = cast<LoadInst>(Increment->getOperand(0));
+    if (!isa<AllocaInst>(Counter) || !Increment->hasOneUse() || !IncrementLoad->hasOneUse()) {
+      return false;
+    }
+
+    SmallVector<StoreInst *, 4> Stores;
+    SmallVector<std::pair<LoadInst *, Value *>, 4> Forwarded;
+    for (User *U : Counter->users()) {
+      if (auto *SI = dyn_cast<StoreInst>(U)) {
+        if (SI->getPointerOperand() != Counter) {
+          return false;
+        }
+        Stores.push_back(SI);
+        continue;
+      }
+
+      auto *Load = dyn_cast<LoadInst>(U);
+      if (Load == nullptr) {
+        return false;
+      }
+      if (Load == IncrementLoad) {
+        continue;
+      }
+
+      StoreInst *Reaching = nullptr;
+      for (auto It = Load->getReverseIterator(); It != Load->getParent()->rend() && Reaching == nullptr; ++It) {
+        auto *SI = dyn_cast<StoreInst>(&*It);
+        if (SI != nullptr && SI->getPointerOperand() == Counter) {
+          Reaching = SI;
+        }
+      }
+      // The update itself is removed, so a load after it in the latch cannot be forwarded.
+      if (Reaching == nullptr || Reaching == Update) {
+        return false;
+      }
+      Forwarded.emplace_back(Load, Reaching->getValueOperand());
+    }
+
+    passOutput() << "Removing the counter of the loop with header " << L->getHeader()->getName() << "\n";
+    for (auto &Forward : Forwarded) {
+      Forward.first->replaceAllUsesWith(Forward.second);
+      Forward.first->eraseFromParent();
+    }
+    for (StoreInst *SI : Stores) {
+      if (SI == Update) {
+        continue;
+      }
+      Value *Stored = SI->getValueOperand();
+      SI->eraseFromParent();
+      RecursivelyDeleteTriviallyDeadInstructions(Stored);
+    }
+    Update->eraseFromParent();
+    Increment->eraseFromParent();
+    IncrementLoad->eraseFromParent();
+    cast<AllocaInst>(Counter)->eraseFromParent();
+    return true;
+}
+
+bool StrengthReduction::run()
+{
+    BasicBlock *Latch = L->getLoopLatch();
+    BasicBlock *Preheader = L->getLoopPreheader();
+    if (!L->isInnermost() || Preheader == nullptr || Latch == nullptr || L->getExitingBlock() != Latch ||
+        Update->getParent() != Latch || Step == 0) {
+      return false;
+    }
+
+    collectRoots();
+
+    // Strides and initial values are computed before any root is replaced, a root may be part of another.
+    IRBuilder<> Builder(Preheader->getTerminator());
+    for (auto It = Recurrences.begin(); It != Recurrences.end();) {
+      It->Stride = getStride(It->Roots.front(), Builder);
+      auto *Constant = dyn_cast_or_null<ConstantInt>(It->Stride);
+      if (It->Stride == nullptr || (Constant != nullptr && Constant->isZero())) {
+        It = Recurrences.erase(It);
+        continue;
+      }
+      It->Initial = expandInitial(It->Roots.front(), Builder);
+      ++It;
+    }
+
+    if (Recurrences.empty()) {
+      return false;
+    }
+
+    BasicBlock *Header = L->getHeader();
+    IRBuilder<> LatchBuilder(Latch->getTerminator());
+    for (Recurrence &R : Recurrences) {
+      Instruction *Root = R.Roots.front();
+      R.Phi = PHINode::Create(Root->getType(), 2, "lsr", &Header->front());
+      R.Next = Root->getType()->isPointerTy() ? LatchBuilder.CreateGEP(LatchBuilder.getInt8Ty(), R.Phi, R.Stride, "lsr.next")
+                                              : LatchBuilder.CreateAdd(R.Phi, R.Stride, "lsr.next");
+      R.Phi->addIncoming(R.Initial, Preheader);
+      R.Phi->addIncoming(R.Next, Latch);
+
+      for (Instruction *Root : R.Roots) {
+        passOutput() << "Strength reducing: " << *Root << "\n";
+        Root->replaceAllUsesWith(R.Phi);
+      }
+    }
+
+    for (Recurrence &R : Recurrences) {
+      for (Instruction *Root : R.Roots) {
+        RecursivelyDeleteTriviallyDeadInstructions(Root);
+      }
+    }
+
+    if (replaceExitTest()) {
+      removeCounter();
+    }
+    return true;
+}
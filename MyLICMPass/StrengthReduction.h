@@ -0,0 +1,66 @@
+#ifndef LLVM_PROJECT_STRENGTHREDUCTION_H
+#define LLVM_PROJECT_STRENGTHREDUCTION_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// Strength reduction of induction expressions in a rotated loop with a
+// counter "i += Step" updated in the latch. Address computations (GEPs) and
+// multiplications that are affine in the counter, built from it with adds,
+// subs, multiplications by invariants, shifts by constants and sign
+// extensions, are recomputed in every iteration. Each distinct one becomes a
+// header PHI that starts at its value in the first iteration and grows by
+// its stride in the latch, a[i * n + j] then costs one add per iteration.
+//
+// With a known trip count the exit test is rewritten to compare one of the
+// new recurrences against its final value, and a counter nothing reads any
+// more is removed altogether.
+class StrengthReduction {
+private:
+  struct Recurrence {
+    SmallVector<Instruction *, 2> Roots;
+    Value *Initial = nullptr;
+    Value *Stride = nullptr;
+    PHINode *Phi = nullptr;
+    Value *Next = nullptr;
+  };
+
+  Loop *L;
+  StoreInst *Update;
+  Value *Counter;
+  int64_t Step;
+  ConstantInt *Start;
+  uint64_t TripCount;
+  unsigned MaxRecurrences;
+  const DataLayout &DL;
+  std::vector<Recurrence> Recurrences;
+  Value *InitialCounter = nullptr;
+
+  bool isCurrentCounterLoad(Value *V);
+  bool isInvariant(Value *V);
+  bool isAffine(Value *V, bool NoWrap, bool &Varies, bool &Scales, unsigned Depth = 0);
+  bool isSameExpression(Value *A, Value *B);
+  void collectRoots();
+  Value *getInitialCounter(IRBuilder<> &Builder);
+  Value *expandInitial(Value *V, IRBuilder<> &Builder);
+  Value *getStride(Value *V, IRBuilder<> &Builder);
+  bool replaceExitTest();
+  bool removeCounter();
+
+public:
+  // Start is the constant the counter starts from, nullptr if it is only known at run time, and a
+  // TripCount of 0 stands for an unknown one.
+  StrengthReduction(Loop *L, StoreInst *Update, ConstantInt *Start, uint64_t TripCount, unsigned MaxRecurrences);
+
+  bool run();
+};
+
+#endif // LLVM_PROJECT_STRENGTHREDUCTION_H
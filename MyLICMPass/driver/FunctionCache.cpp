@@ -0,0 +1,107 @@
+#include "FunctionCache.h"
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <chrono>
+
+FunctionCache::FunctionCache(StringRef Directory, StringRef Options, ArrayRef<std::string> Plugins,
+                             uint64_t MaxSizeBytes)
+    : Directory(Directory.str())
+{
+    MD5 Hash;
+    Hash.update(LLVM_VERSION_STRING);
+    Hash.update(Options);
+
+    // A rebuilt plugin may optimize differently, so its contents are part of every key.
+    for (const std::string &Path : Plugins) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> Plugin = MemoryBuffer::getFile(Path);
+      if (Plugin) {
+        Hash.update((*Plugin)->getBuffer());
+      }
+    }
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    Salt = Result.digest().str().str();
+
+    // Pruning only looks at the llvmcache-* files and only evicts by size.
+    Policy.Interval = std::chrono::seconds(0);
+    Policy.Expiration = std::chrono::seconds(0);
+    Policy.MaxSizePercentageOfAvailableSpace = 0;
+    Policy.MaxSizeBytes = MaxSizeBytes;
+
+    if (std::error_code EC = sys::fs::create_directories(Directory)) {
+      errs() << "our-lazy-opt: can not create the cache directory " << Directory << ": " << EC.message() << "\n";
+    }
+}
+
+std::string FunctionCache::getPath(StringRef Key) const
+{
+    SmallString<128> Path(Directory);
+    sys::path::append(Path, "llvmcache-" + Key);
+    return Path.str().str();
+}
+
+std::string FunctionCache::getKey(const Module &Part) const
+{
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(Part, OS);
+
+    MD5 Hash;
+    Hash.update(Salt);
+    Hash.update(StringRef(Bitcode.data(), Bitcode.size()));
+
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return Result.digest().str().str();
+}
+
+bool FunctionCache::lookup(StringRef Key, const Twine &Path)
+{
+    std::string CachePath = getPath(Key);
+    if (!sys::fs::exists(CachePath) || sys::fs::copy_file(CachePath, Path)) {
+      return false;
+    }
+
+    // Pruning evicts by access time, which noatime mounts would never update.
+    int FD;
+    if (!sys::fs::openFileForRead(CachePath, FD)) {
+      sys::TimePoint<> Now = std::chrono::system_clock::now();
+      sys::fs::setLastAccessAndModificationTime(FD, Now, Now);
+      sys::fs::closeFile(FD);
+    }
+    return true;
+}
+
+// Copied next to the entry first, renaming it into place is atomic.
+void FunctionCache::insert(StringRef Key, const Twine &Path)
+{
+    SmallString<128> Model(Directory);
+    sys::path::append(Model, "tmp-%%%%%%%%");
+
+    SmallString<128> TempPath;
+    int FD;
+    if (sys::fs::createUniqueFile(Model, FD, TempPath)) {
+      return;
+    }
+    sys::fs::closeFile(FD);
+
+    if (sys::fs::copy_file(Path, TempPath) || sys::fs::rename(TempPath, getPath(Key))) {
+      sys::fs::remove(TempPath);
+    }
+}
+
+void FunctionCache::prune()
+{
+    pruneCache(Directory, Policy);
+}
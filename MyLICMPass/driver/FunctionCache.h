@@ -0,0 +1,39 @@
+#ifndef LLVM_PROJECT_FUNCTIONCACHE_H
+#define LLVM_PROJECT_FUNCTIONCACHE_H
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+
+#include <string>
+
+using namespace llvm;
+
+// Content addressed cache of optimized parts for our-lazy-opt. The key of a
+// part is the MD5 of its unoptimized bitcode (the function and the
+// declarations it refers to), salted with the options of the run, the LLVM
+// version and the contents of the loaded plugins. Entries are written to a
+// temporary file and renamed into place, so concurrent runs never see half
+// of one, and the least recently used ones are evicted once the directory
+// grows past its size bound.
+class FunctionCache {
+private:
+  std::string Directory;
+  std::string Salt;
+  CachePruningPolicy Policy;
+
+  std::string getPath(StringRef Key) const;
+
+public:
+  FunctionCache(StringRef Directory, StringRef Options, ArrayRef<std::string> Plugins, uint64_t MaxSizeBytes);
+
+  std::string getKey(const Module &Part) const;
+  // Copies the optimized part cached under Key to Path, false on a miss.
+  bool lookup(StringRef Key, const Twine &Path);
+  void insert(StringRef Key, const Twine &Path);
+  void prune();
+};
+
+#endif // LLVM_PROJECT_FUNCTIONCACHE_H
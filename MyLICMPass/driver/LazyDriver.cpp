@@ -0,0 +1,363 @@
+// our-lazy-opt: runs the function passes of the MyLICMPass plugin over a
+// bitcode module one function at a time.
+//
+// opt parses every function body before the first pass runs. This driver
+// opens the bitcode lazily, materializes one function, moves it into a
+// module of its own, frees its body in the input module and only then
+// optimizes and writes it. Peak memory follows the largest function, not
+// the module. The output directory holds globals.bc with every global
+// variable and declaration, and one part per function definition:
+//
+//   our-lazy-opt -load lib/MyLICMPass.so -passes=my-licm big.bc -o parts
+//   llvm-link parts/*.bc -o big.opt.bc
+//
+// Module passes (-our-ipcp, -our-function-attrs) need the whole module and
+// are rejected. Local symbols are made hidden external so the parts can
+// refer to each other.
+//
+// With -cache-dir, optimized parts are kept on disk under the hash of the
+// unoptimized part and the options of the run. A function that did not
+// change since an earlier run is copied from the cache instead of being
+// optimized again.
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "FunctionCache.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
+
+static cl::opt<std::string> OutputDirectory("o", cl::Required, cl::value_desc("directory"),
+                                            cl::desc("Directory the optimized parts are written to"));
+
+static cl::list<std::string> PassNames("passes", cl::CommaSeparated, cl::value_desc("pass,..."),
+                                       cl::desc("Function passes to run on every function, in order (default my-licm)"));
+
+static cl::opt<bool> VerifyParts("verify-parts", cl::init(true),
+                                 cl::desc("Verify every part before it is written"));
+
+static cl::opt<std::string> CacheDirectory("cache-dir", cl::value_desc("directory"),
+                                           cl::desc("Directory optimized parts are cached in (default no cache)"));
+
+static cl::opt<unsigned> CacheSizeMB("cache-size-mb", cl::init(1024),
+                                     cl::desc("Size in MB the cache is pruned to, least recently used parts first (0 for no bound)"));
+
+static ExitOnError ExitOnErr("our-lazy-opt: ");
+
+// Every part is a separate module, so nothing may stay local to one of them.
+static void externalizeLocals(Module &M)
+{
+    unsigned Unnamed = 0;
+    auto Externalize = [&Unnamed](GlobalValue &GV) {
+      if (!GV.hasName()) {
+        GV.setName("__our_lazy_opt." + Twine(Unnamed++));
+      }
+      if (GV.hasLocalLinkage()) {
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+        GV.setVisibility(GlobalValue::HiddenVisibility);
+      }
+    };
+
+    for (GlobalVariable &GV : M.globals()) {
+      Externalize(GV);
+    }
+    for (Function &F : M) {
+      Externalize(F);
+    }
+    for (GlobalAlias &GA : M.aliases()) {
+      Externalize(GA);
+    }
+}
+
+static void collectGlobals(const Constant *C, SmallPtrSetImpl<const GlobalValue *> &Globals,
+                           SmallPtrSetImpl<const Constant *> &Visited)
+{
+    if (!Visited.insert(C).second) {
+      return;
+    }
+
+    if (auto *GV = dyn_cast<GlobalValue>(C)) {
+      Globals.insert(GV);
+      return;
+    }
+
+    for (const Value *Op : C->operands()) {
+      collectGlobals(cast<Constant>(Op), Globals, Visited);
+    }
+}
+
+// A declaration of GV in Part, globals are declared with the type of the value they hold.
+static GlobalValue *declareIn(Module &Part, const GlobalValue *GV)
+{
+    if (auto *FTy = dyn_cast<FunctionType>(GV->getValueType())) {
+      Function *Declaration = Function::Create(FTy, GlobalValue::ExternalLinkage, GV->getAddressSpace(),
+                                               GV->getName(), &Part);
+      if (auto *F = dyn_cast<Function>(GV)) {
+        Declaration->setAttributes(F->getAttributes());
+        Declaration->setCallingConv(F->getCallingConv());
+      }
+      Declaration->setVisibility(GV->getVisibility());
+      return Declaration;
+    }
+
+    auto *Declaration = new GlobalVariable(Part, GV->getValueType(), false, GlobalValue::ExternalLinkage, nullptr,
+                                           GV->getName(), nullptr, GV->getThreadLocalMode(), GV->getAddressSpace());
+    if (auto *Var = dyn_cast<GlobalVariable>(GV)) {
+      Declaration->setConstant(Var->isConstant());
+      Declaration->setAlignment(Var->getAlign());
+    }
+    Declaration->setVisibility(GV->getVisibility());
+    return Declaration;
+}
+
+// Moves the body of F into a module of its own that declares everything F refers to.
+static std::unique_ptr<Module> extractFunction(Function &F)
+{
+    Module &M = *F.getParent();
+    auto Part = std::make_unique<Module>(F.getName(), M.getContext());
+    Part->setDataLayout(M.getDataLayout());
+    Part->setTargetTriple(M.getTargetTriple());
+    SmallVector<Module::ModuleFlagEntry, 8> Flags;
+    M.getModuleFlagsMetadata(Flags);
+    for (const Module::ModuleFlagEntry &Flag : Flags) {
+      Part->addModuleFlag(Flag.Behavior, Flag.Key->getString(), Flag.Val);
+    }
+
+    SmallPtrSet<const GlobalValue *, 32> Globals;
+    SmallPtrSet<const Constant *, 32> Visited;
+    for (Instruction &I : instructions(F)) {
+      for (Value *Op : I.operands()) {
+        if (auto *C = dyn_cast<Constant>(Op)) {
+          collectGlobals(C, Globals, Visited);
+        }
+      }
+    }
+    if (F.hasPersonalityFn()) {
+      collectGlobals(F.getPersonalityFn(), Globals, Visited);
+    }
+
+    Function *NewF = Function::Create(F.getFunctionType(), F.getLinkage(), F.getAddressSpace(), F.getName(),
+                                      Part.get());
+    ValueToValueMapTy VMap;
+    VMap[&F] = NewF;
+    // Declared by name, not by address, so the same function always gives the same part.
+    std::vector<const GlobalValue *> Referenced(Globals.begin(), Globals.end());
+    llvm::sort(Referenced, [](const GlobalValue *A, const GlobalValue *B) {
+      return A->getName() < B->getName();
+    });
+    for (const GlobalValue *GV : Referenced) {
+      if (GV != &F) {
+        VMap[GV] = declareIn(*Part, GV);
+      }
+    }
+
+    Function::arg_iterator NewArg = NewF->arg_begin();
+    for (Argument &Arg : F.args()) {
+      NewArg->setName(Arg.getName());
+      VMap[&Arg] = &*NewArg++;
+    }
+
+    SmallVector<ReturnInst *, 8> Returns;
+    CloneFunctionInto(NewF, &F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+
+    // Cloning into another module always creates the compile unit list, even for no debug info.
+    NamedMDNode *CompileUnits = Part->getNamedMetadata("llvm.dbg.cu");
+    if (CompileUnits != nullptr && CompileUnits->getNumOperands() == 0) {
+      Part->eraseNamedMetadata(CompileUnits);
+    }
+    NewF->setVisibility(F.getVisibility());
+    return Part;
+}
+
+static std::unique_ptr<TargetMachine> createTargetMachine(const Module &M)
+{
+    if (M.getTargetTriple().empty()) {
+      return nullptr;
+    }
+
+    std::string Error;
+    const Target *T = TargetRegistry::lookupTarget(M.getTargetTriple(), Error);
+    if (T == nullptr) {
+      errs() << "our-lazy-opt: " << Error << ", using the default cost model\n";
+      return nullptr;
+    }
+
+    return std::unique_ptr<TargetMachine>(T->createTargetMachine(M.getTargetTriple(), "", "", TargetOptions(), {}));
+}
+
+static void optimize(Module &Part, TargetMachine *TM)
+{
+    legacy::FunctionPassManager FPM(&Part);
+    if (TM != nullptr) {
+      FPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+    }
+
+    for (const std::string &Name : PassNames) {
+      const PassInfo *PI = PassRegistry::getPassRegistry()->getPassInfo(Name);
+      if (PI == nullptr || PI->getNormalCtor() == nullptr) {
+        ExitOnErr(createStringError(inconvertibleErrorCode(), "unknown pass '%s', is the plugin loaded?",
+                                    Name.c_str()));
+      }
+
+      Pass *P = PI->getNormalCtor()();
+      if (P->getPassKind() != PT_Function) {
+        delete P;
+        ExitOnErr(createStringError(inconvertibleErrorCode(), "'%s' is not a function pass", Name.c_str()));
+      }
+      FPM.add(P);
+    }
+
+    FPM.doInitialization();
+    for (Function &F : Part) {
+      if (!F.isDeclaration()) {
+        FPM.run(F);
+      }
+    }
+    FPM.doFinalization();
+}
+
+static std::string getPartPath(const Twine &FileName)
+{
+    SmallString<128> Path(OutputDirectory);
+    sys::path::append(Path, FileName);
+    return Path.str().str();
+}
+
+// Everything on the command line that can change what the passes do, i.e.
+// all of it but the input, the output directory and the cache options.
+static std::string getCacheOptions(int argc, char **argv)
+{
+    std::string Options;
+    for (int i = 1; i < argc; i++) {
+      StringRef Arg(argv[i]);
+      if (Arg == "-o" || Arg == "--o") {
+        i++;
+        continue;
+      }
+      if (Arg == InputFilename || Arg.startswith("-o=") || Arg.startswith("--o=") ||
+          Arg.startswith("-cache-") || Arg.startswith("--cache-")) {
+        continue;
+      }
+      Options += Arg;
+      Options += '\0';
+    }
+    return Options;
+}
+
+static void writePart(Module &Part, const std::string &Path)
+{
+    if (VerifyParts && verifyModule(Part, &errs())) {
+      ExitOnErr(createStringError(inconvertibleErrorCode(), "broken module produced for '%s'",
+                                  Part.getModuleIdentifier().c_str()));
+    }
+
+    std::error_code EC;
+    raw_fd_ostream Out(Path, EC, sys::fs::OF_None);
+    ExitOnErr(errorCodeToError(EC));
+    WriteBitcodeToFile(Part, Out);
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM X(argc, argv);
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeAnalysis(Registry);
+    initializeTransformUtils(Registry);
+    initializeTarget(Registry);
+
+    cl::ParseCommandLineOptions(argc, argv, "function at a time optimizer for the MyLICMPass plugin\n");
+    if (PassNames.empty()) {
+      PassNames.push_back("my-licm");
+    }
+
+    LLVMContext Context;
+    std::unique_ptr<MemoryBuffer> Buffer = ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFilename)));
+    std::unique_ptr<Module> M = ExitOnErr(getOwningLazyBitcodeModule(std::move(Buffer), Context));
+    ExitOnErr(errorCodeToError(sys::fs::create_directories(OutputDirectory)));
+
+    externalizeLocals(*M);
+    std::unique_ptr<TargetMachine> TM = createTargetMachine(*M);
+
+    // Global variables, aliases and declarations, without a single function body.
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Globals = CloneModule(*M, VMap, [](const GlobalValue *GV) {
+      return !isa<Function>(GV);
+    });
+    writePart(*Globals, getPartPath("globals.bc"));
+    Globals.reset();
+
+    std::unique_ptr<FunctionCache> Cache;
+    if (!CacheDirectory.empty()) {
+      std::vector<std::string> Plugins;
+      for (unsigned i = 0; i < PluginLoader::getNumPlugins(); i++) {
+        Plugins.push_back(PluginLoader::getPlugin(i));
+      }
+      Cache = std::make_unique<FunctionCache>(CacheDirectory, getCacheOptions(argc, argv), Plugins,
+                                              uint64_t(CacheSizeMB) << 20);
+    }
+
+    unsigned Index = 0, Hits = 0;
+    for (Function &F : *M) {
+      if (!F.isMaterializable()) {
+        continue;
+      }
+
+      ExitOnErr(F.materialize());
+      std::unique_ptr<Module> Part = extractFunction(F);
+      F.deleteBody();
+
+      std::string Path = getPartPath("f" + Twine(Index++) + ".bc");
+      std::string Key = Cache ? Cache->getKey(*Part) : "";
+      if (Cache && Cache->lookup(Key, Path)) {
+        Hits++;
+        continue;
+      }
+
+      optimize(*Part, TM.get());
+      writePart(*Part, Path);
+      if (Cache) {
+        Cache->insert(Key, Path);
+      }
+    }
+
+    if (Cache) {
+      Cache->prune();
+      errs() << "our-lazy-opt: " << Hits << " of " << Index << " functions from the cache\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,177 @@
+// our-opt: drop-in replacement for the opt command line of the MyLICMPass
+// plugin that lets a running our-opt-server do the work:
+//
+//   our-opt -S -load lib/MyLICMPass.so -enable-new-pm=0 -my-licm in.ll -o out.ll
+//
+// The client reads the input and writes the output itself, the server only
+// sees the module and the rest of the command line. The socket is taken from
+// $OUR_OPT_SOCKET (see OptConnection::getDefaultSocketPath). When no server
+// answers, or the server cannot run the command line, the same command line
+// is run by plain opt: $OUR_OPT_FALLBACK, the opt next to our-opt or the
+// first one on the PATH.
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/ADT/SmallString.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "OptConnection.h"
+
+using namespace llvm;
+
+static int MainAddress;
+
+static int runOpt(const char *Argv0, ArrayRef<std::string> Args, StringRef Reason)
+{
+    std::string Opt;
+    if (auto Fallback = sys::Process::GetEnv("OUR_OPT_FALLBACK")) {
+      Opt = *Fallback;
+    }
+    else {
+      SmallString<256> Sibling(sys::path::parent_path(sys::fs::getMainExecutable(Argv0, &MainAddress)));
+      sys::path::append(Sibling, "opt");
+      if (sys::fs::can_execute(Sibling)) {
+        Opt = Sibling.str().str();
+      }
+      else if (ErrorOr<std::string> Found = sys::findProgramByName("opt")) {
+        Opt = *Found;
+      }
+      else {
+        errs() << "our-opt: " << Reason << " and opt is not found\n";
+        return 1;
+      }
+    }
+
+    errs() << "our-opt: " << Reason << ", running " << Opt << "\n";
+    std::vector<StringRef> OptArgs{Opt};
+    OptArgs.insert(OptArgs.end(), Args.begin(), Args.end());
+    std::string Error;
+    int Result = sys::ExecuteAndWait(Opt, OptArgs, {}, {}, 0, 0, &Error);
+    if (Result < 0) {
+      errs() << "our-opt: " << Error << "\n";
+      return 1;
+    }
+    return Result;
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM X(argc, argv);
+
+    // -o and -load are the only options that may take their value as the next argument.
+    std::vector<std::string> Args(argv + 1, argv + argc), Request;
+    std::string InputFilename = "-", OutputFilename = "-";
+    unsigned NumInputs = 0, InputIndex = Args.size();
+    for (unsigned i = 0; i < Args.size(); i++) {
+      StringRef Arg(Args[i]);
+      StringRef Name = Arg.startswith("--") ? Arg.drop_front() : Arg;
+      bool IsOutput = Name == "-o" || Name.startswith("-o=");
+      bool IsPlugin = Name == "-load" || Name.startswith("-load=");
+
+      if (IsOutput || IsPlugin) {
+        StringRef Value = Name.contains('=') ? Name.split('=').second
+                                             : i + 1 < Args.size() ? StringRef(Args[++i]) : StringRef();
+        if (IsOutput) {
+          OutputFilename = Value.str();
+          continue;
+        }
+
+        // The server compares plugins by where they are, not by how the client named them.
+        SmallString<256> Plugin;
+        Request.push_back("-load=" + (sys::fs::real_path(Value, Plugin) ? Value.str() : Plugin.str().str()));
+      }
+      else if (Name == "-" || !Name.startswith("-")) {
+        InputFilename = Arg.str();
+        InputIndex = i;
+        NumInputs++;
+      }
+      else {
+        Request.push_back(Arg.str());
+      }
+    }
+    Request.push_back(InputFilename);
+
+    if (NumInputs > 1) {
+      return runOpt(argv[0], Args, "more than one input");
+    }
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Input = MemoryBuffer::getFileOrSTDIN(InputFilename);
+    if (!Input) {
+      errs() << "our-opt: " << InputFilename << ": " << Input.getError().message() << "\n";
+      return 1;
+    }
+
+    // A fallback after stdin was read gets the module from a temporary file.
+    auto Fallback = [&](StringRef Reason) {
+      if (InputFilename != "-") {
+        return runOpt(argv[0], Args, Reason);
+      }
+
+      SmallString<128> Copy;
+      int FD;
+      if (sys::fs::createTemporaryFile("our-opt", "in", FD, Copy)) {
+        errs() << "our-opt: " << Reason << " and the input cannot be saved for opt\n";
+        return 1;
+      }
+      {
+        raw_fd_ostream Out(FD, true);
+        Out << (*Input)->getBuffer();
+      }
+      std::vector<std::string> OptArgs(Args);
+      if (InputIndex < OptArgs.size()) {
+        OptArgs[InputIndex] = Copy.str().str();
+      }
+      else {
+        OptArgs.push_back(Copy.str().str());
+      }
+      int Result = runOpt(argv[0], OptArgs, Reason);
+      sys::fs::remove(Copy);
+      return Result;
+    };
+
+    std::string Path = OptConnection::getDefaultSocketPath();
+    Expected<std::unique_ptr<OptConnection>> Connection = OptConnection::connect(Path);
+    if (!Connection) {
+      consumeError(Connection.takeError());
+      return Fallback("no server on " + Path);
+    }
+
+    std::string Arguments;
+    for (const std::string &Arg : Request) {
+      Arguments += Arg;
+      Arguments += '\0';
+    }
+
+    std::string Status, Diagnostics, Output;
+    if (!(*Connection)->send(Arguments) || !(*Connection)->send((*Input)->getBuffer()) ||
+        !(*Connection)->receive(Status) || !(*Connection)->receive(Diagnostics) || !(*Connection)->receive(Output) ||
+        Status.size() != 1) {
+      return Fallback("the server closed the connection");
+    }
+
+    if (Status[0] == OptConnection::Unsupported) {
+      return Fallback(StringRef(Diagnostics).rtrim());
+    }
+
+    errs() << Diagnostics;
+    if (Status[0] != OptConnection::Optimized) {
+      return 1;
+    }
+
+    std::error_code EC;
+    raw_fd_ostream Out(OutputFilename, EC, sys::fs::OF_None);
+    if (EC) {
+      errs() << "our-opt: " << OutputFilename << ": " << EC.message() << "\n";
+      return 1;
+    }
+    Out << Output;
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "OptConnection.h"
+
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Errno.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/ADT/SmallString.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Larger messages are taken for a corrupt length rather than allocated.
+static const uint64_t MaxMessageSize = uint64_t(1) << 32;
+
+static Error makeSocketError(const Twine &What, StringRef Path)
+{
+    return createStringError(std::error_code(errno, std::generic_category()), "%s '%s': %s", What.str().c_str(),
+                             Path.str().c_str(), sys::StrError().c_str());
+}
+
+static Expected<sockaddr_un> getAddress(StringRef Path)
+{
+    sockaddr_un Address;
+    std::memset(&Address, 0, sizeof(Address));
+    Address.sun_family = AF_UNIX;
+    if (Path.size() >= sizeof(Address.sun_path)) {
+      return createStringError(inconvertibleErrorCode(), "socket path '%s' is too long", Path.str().c_str());
+    }
+
+    std::memcpy(Address.sun_path, Path.data(), Path.size());
+    return Address;
+}
+
+OptConnection::~OptConnection()
+{
+    ::close(FD);
+}
+
+std::string OptConnection::getDefaultSocketPath()
+{
+    if (auto Path = sys::Process::GetEnv("OUR_OPT_SOCKET")) {
+      return *Path;
+    }
+
+    SmallString<128> Path;
+    sys::path::system_temp_directory(true, Path);
+    sys::path::append(Path, "our-opt-server.sock");
+    return Path.str().str();
+}
+
+Expected<std::unique_ptr<OptConnection>> OptConnection::connect(StringRef Path)
+{
+    Expected<sockaddr_un> Address = getAddress(Path);
+    if (!Address) {
+      return Address.takeError();
+    }
+
+    int FD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD < 0) {
+      return makeSocketError("cannot create a socket for", Path);
+    }
+
+    if (::connect(FD, reinterpret_cast<sockaddr *>(&*Address), sizeof(*Address)) < 0) {
+      Error E = makeSocketError("cannot connect to", Path);
+      ::close(FD);
+      return E;
+    }
+
+    return std::unique_ptr<OptConnection>(new OptConnection(FD));
+}
+
+Expected<int> OptConnection::listen(StringRef Path, unsigned Backlog)
+{
+    Expected<sockaddr_un> Address = getAddress(Path);
+    if (!Address) {
+      return Address.takeError();
+    }
+
+    if (sys::fs::exists(Path)) {
+      if (Expected<std::unique_ptr<OptConnection>> Running = connect(Path)) {
+        return createStringError(inconvertibleErrorCode(), "a server is already listening on '%s'",
+                                 Path.str().c_str());
+      }
+      else {
+        consumeError(Running.takeError());
+      }
+      // sys::fs::remove only removes files, directories and links.
+      ::unlink(Path.str().c_str());
+    }
+
+    int FD = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (FD < 0) {
+      return makeSocketError("cannot create a socket for", Path);
+    }
+
+    if (::bind(FD, reinterpret_cast<sockaddr *>(&*Address), sizeof(*Address)) < 0 ||
+        ::listen(FD, Backlog) < 0) {
+      Error E = makeSocketError("cannot listen on", Path);
+      ::close(FD);
+      return E;
+    }
+
+    return FD;
+}
+
+std::unique_ptr<OptConnection> OptConnection::accept(int ListenFD)
+{
+    int FD = sys::RetryAfterSignal(-1, ::accept, ListenFD, nullptr, nullptr);
+    if (FD < 0) {
+      return nullptr;
+    }
+
+    return std::unique_ptr<OptConnection>(new OptConnection(FD));
+}
+
+bool OptConnection::send(StringRef Message)
+{
+    char Length[8];
+    support::endian::write64le(Length, Message.size());
+    std::string Data(Length, sizeof(Length));
+    Data += Message;
+
+    for (size_t Sent = 0; Sent < Data.size();) {
+      ssize_t Written = sys::RetryAfterSignal(-1, ::send, FD, Data.data() + Sent, Data.size() - Sent, MSG_NOSIGNAL);
+      if (Written <= 0) {
+        return false;
+      }
+      Sent += Written;
+    }
+    return true;
+}
+
+bool OptConnection::receive(std::string &Message)
+{
+    auto ReadAll = [this](char *Buffer, size_t Size) {
+      for (size_t Received = 0; Received < Size;) {
+        ssize_t Read = sys::RetryAfterSignal(-1, ::recv, FD, Buffer + Received, Size - Received, 0);
+        if (Read <= 0) {
+          return false;
+        }
+        Received += Read;
+      }
+      return true;
+    };
+
+    char Length[8];
+    if (!ReadAll(Length, sizeof(Length))) {
+      return false;
+    }
+
+    uint64_t Size = support::endian::read64le(Length);
+    if (Size > MaxMessageSize) {
+      return false;
+    }
+
+    Message.resize(Size);
+    return ReadAll(&Message[0], Size);
+}
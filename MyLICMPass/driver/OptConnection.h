@@ -0,0 +1,50 @@
+#ifndef LLVM_PROJECT_OPTCONNECTION_H
+#define LLVM_PROJECT_OPTCONNECTION_H
+
+#include "llvm/Support/Error.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <memory>
+#include <string>
+
+using namespace llvm;
+
+// One end of a connection between our-opt and our-opt-server over a Unix
+// domain socket. Everything sent is a message: its length as 8 little endian
+// bytes, then its bytes. A request is the command line of the client without
+// its output, its arguments separated by NUL, followed by the input module as
+// text IR or bitcode. The input file on the command line only names the
+// module. The response is a status byte (see Status), the diagnostics of the
+// run and the optimized module.
+class OptConnection {
+private:
+  int FD;
+
+  explicit OptConnection(int FD) : FD(FD) {}
+
+public:
+  enum Status : char {
+    Optimized = '0',
+    // The module is broken or a pass failed, as in a failing opt run.
+    Failed = '1',
+    // The server cannot run this command line (another plugin or other
+    // options than it was started with), plain opt has to.
+    Unsupported = '2'
+  };
+
+  ~OptConnection();
+  OptConnection(const OptConnection &) = delete;
+  OptConnection &operator=(const OptConnection &) = delete;
+
+  // $OUR_OPT_SOCKET, or our-opt-server.sock in the temporary directory.
+  static std::string getDefaultSocketPath();
+  static Expected<std::unique_ptr<OptConnection>> connect(StringRef Path);
+  // Binds a listening socket to Path, replacing a stale one no server answers on.
+  static Expected<int> listen(StringRef Path, unsigned Backlog);
+  static std::unique_ptr<OptConnection> accept(int ListenFD);
+
+  bool send(StringRef Message);
+  bool receive(std::string &Message);
+};
+
+#endif // LLVM_PROJECT_OPTCONNECTION_H
@@ -0,0 +1,341 @@
+// our-opt-server: keeps the MyLICMPass plugin loaded and runs its passes for
+// our-opt clients over a Unix domain socket.
+//
+// Every opt run pays for starting the process, loading the plugin,
+// registering the passes and parsing the command line before the first
+// pass runs, which dominates for small modules. The server does all of that
+// once:
+//
+//   our-opt-server -load lib/MyLICMPass.so [pass options] &
+//   our-opt -S -load lib/MyLICMPass.so -enable-new-pm=0 -my-licm in.ll -o out.ll
+//
+// Options of the passes (e.g. -licm-unroll=false) are global, so they are
+// fixed when the server starts. A request that loads another plugin or
+// passes other options is answered with OptConnection::Unsupported and the
+// client runs plain opt instead.
+//
+// Requests are served by -workers threads, each with an LLVMContext of its
+// own. A context is reused for -context-reuse requests and then replaced,
+// since the constants and types it uniques are never freed while it lives.
+//
+// The passes of the plugin report their progress on a stream of the thread
+// running them, which is the diagnostics of the request, so the client
+// prints what opt would. Passes of other plugins write to the server's
+// stderr.
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "OptConnection.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> SocketPath("socket", cl::value_desc("path"),
+                                       cl::desc("Unix domain socket to listen on (default $OUR_OPT_SOCKET or "
+                                                "our-opt-server.sock in the temporary directory)"));
+
+static cl::opt<unsigned> Workers("workers", cl::init(0),
+                                 cl::desc("Requests optimized at the same time, 0 for one per hardware thread"));
+
+static cl::opt<unsigned> ContextReuse("context-reuse", cl::init(64),
+                                      cl::desc("Requests a context serves before it is replaced by a fresh one (0 for never)"));
+
+static ExitOnError ExitOnErr("our-opt-server: ");
+
+// Real paths of the loaded plugins, and the options the passes run with, as given on the command line.
+static std::vector<std::string> Plugins;
+static std::vector<std::string> PassOptions;
+
+namespace {
+// State a worker keeps between requests.
+struct WorkerState {
+  std::unique_ptr<LLVMContext> Context;
+  unsigned Served = 0;
+  // Target machines by triple, they do not depend on the context.
+  StringMap<std::unique_ptr<TargetMachine>> Machines;
+};
+
+// The pipeline a request asks for.
+struct Request {
+  std::string ModuleName = "<stdin>";
+  std::vector<const PassInfo *> Passes;
+  std::vector<std::string> Options;
+  bool Text = false;
+};
+} // namespace
+
+static std::string getRealPath(StringRef Path)
+{
+    SmallString<256> RealPath;
+    if (sys::fs::real_path(Path, RealPath)) {
+      return Path.str();
+    }
+    return RealPath.str().str();
+}
+
+// "--x" and "-x" are the same option.
+static std::string normalizeOption(StringRef Arg)
+{
+    if (Arg.startswith("--")) {
+      Arg = Arg.drop_front();
+    }
+    return Arg.str();
+}
+
+// Everything on the command line but the options of the server itself and -load, whose values
+// are either attached with "=" or the next argument.
+static void collectPassOptions(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+      std::string Arg = normalizeOption(argv[i]);
+      StringRef Name = StringRef(Arg).split('=').first;
+      if (Name == "-load" || Name == "-socket" || Name == "-workers" || Name == "-context-reuse") {
+        if (!StringRef(Arg).contains('=')) {
+          i++;
+        }
+        continue;
+      }
+      PassOptions.push_back(Arg);
+    }
+    llvm::sort(PassOptions);
+}
+
+static OptConnection::Status parseRequest(StringRef Arguments, Request &R, raw_ostream &Diagnostics)
+{
+    SmallVector<StringRef, 16> Args;
+    Arguments.split(Args, '\0', -1, false);
+
+    for (StringRef RawArg : Args) {
+      std::string Arg = normalizeOption(RawArg);
+      StringRef Name(Arg);
+
+      if (Name == "-" || !Name.startswith("-")) {
+        R.ModuleName = Name == "-" ? "<stdin>" : Name.str();
+      }
+      else if (Name == "-S") {
+        R.Text = true;
+      }
+      else if (Name == "-enable-new-pm=0" || Name == "-enable-new-pm=false") {
+        continue;
+      }
+      else if (Name.startswith("-load=")) {
+        if (!is_contained(Plugins, Name.drop_front(strlen("-load=")))) {
+          Diagnostics << "plugin " << Name.drop_front(strlen("-load=")) << " is not loaded by the server\n";
+          return OptConnection::Unsupported;
+        }
+      }
+      else if (const PassInfo *PI = PassRegistry::getPassRegistry()->getPassInfo(Name.drop_front())) {
+        if (PI->getNormalCtor() == nullptr) {
+          Diagnostics << "pass " << Name << " cannot be created\n";
+          return OptConnection::Unsupported;
+        }
+        R.Passes.push_back(PI);
+      }
+      else {
+        R.Options.push_back(Arg);
+      }
+    }
+
+    llvm::sort(R.Options);
+    if (R.Options != PassOptions) {
+      Diagnostics << "the server runs with other options than the request\n";
+      return OptConnection::Unsupported;
+    }
+    return OptConnection::Optimized;
+}
+
+static TargetMachine *getTargetMachine(WorkerState &Worker, const Module &M)
+{
+    if (M.getTargetTriple().empty()) {
+      return nullptr;
+    }
+
+    std::unique_ptr<TargetMachine> &TM = Worker.Machines[M.getTargetTriple()];
+    if (TM == nullptr) {
+      std::string Error;
+      const Target *T = TargetRegistry::lookupTarget(M.getTargetTriple(), Error);
+      if (T != nullptr) {
+        TM.reset(T->createTargetMachine(M.getTargetTriple(), "", "", TargetOptions(), {}));
+      }
+    }
+    return TM.get();
+}
+
+// setPassOutput of the MyLICMPass plugin (see PassOutput.h), nullptr if no loaded plugin has it.
+using SetPassOutputFn = void (*)(raw_ostream *);
+static SetPassOutputFn SetPassOutput = nullptr;
+
+static OptConnection::Status optimize(WorkerState &Worker, const Request &R, StringRef Input,
+                                      raw_ostream &Diagnostics, raw_ostream &Output)
+{
+    SMDiagnostic Err;
+    std::unique_ptr<Module> M = parseIR(MemoryBufferRef(Input, R.ModuleName), Err, *Worker.Context);
+    if (M == nullptr) {
+      Err.print("our-opt", Diagnostics);
+      return OptConnection::Failed;
+    }
+
+    if (verifyModule(*M, &Diagnostics)) {
+      Diagnostics << "our-opt: " << R.ModuleName << ": error: input module is broken!\n";
+      return OptConnection::Failed;
+    }
+
+    legacy::PassManager PM;
+    if (TargetMachine *TM = getTargetMachine(Worker, *M)) {
+      PM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+    }
+    for (const PassInfo *PI : R.Passes) {
+      PM.add(PI->getNormalCtor()());
+    }
+    // Every worker thread reports the passes' messages to its own request.
+    if (SetPassOutput != nullptr) {
+      SetPassOutput(&Diagnostics);
+    }
+    PM.run(*M);
+    if (SetPassOutput != nullptr) {
+      SetPassOutput(nullptr);
+    }
+
+    OptConnection::Status Result = OptConnection::Optimized;
+    if (verifyModule(*M, &Diagnostics)) {
+      Diagnostics << "our-opt: " << R.ModuleName << ": error: the passes produced a broken module\n";
+      Result = OptConnection::Failed;
+    }
+    else if (R.Text) {
+      M->print(Output, nullptr);
+    }
+    else {
+      WriteBitcodeToFile(*M, Output);
+    }
+
+    // Named struct types outlive the module in the context and would rename the types of the next one.
+    for (StructType *ST : M->getIdentifiedStructTypes()) {
+      ST->setName("");
+    }
+    return Result;
+}
+
+static void serve(WorkerState &Worker, OptConnection &Connection)
+{
+    std::string Arguments, Input;
+    if (!Connection.receive(Arguments) || !Connection.receive(Input)) {
+      return;
+    }
+
+    if (Worker.Context == nullptr || (ContextReuse != 0 && Worker.Served >= ContextReuse)) {
+      Worker.Context = std::make_unique<LLVMContext>();
+      Worker.Served = 0;
+    }
+    Worker.Served++;
+
+    std::string Diagnostics, Output;
+    raw_string_ostream DiagnosticsStream(Diagnostics), OutputStream(Output);
+    Request R;
+    OptConnection::Status Result = parseRequest(Arguments, R, DiagnosticsStream);
+    if (Result == OptConnection::Optimized) {
+      Result = optimize(Worker, R, Input, DiagnosticsStream, OutputStream);
+    }
+
+    // A module that failed to parse may have left named types behind, the next request starts over.
+    if (Result == OptConnection::Failed) {
+      Worker.Context.reset();
+    }
+
+    char Status = Result;
+    Connection.send(StringRef(&Status, 1));
+    Connection.send(DiagnosticsStream.str());
+    Connection.send(OutputStream.str());
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM X(argc, argv);
+    InitializeAllTargets();
+    InitializeAllTargetMCs();
+
+    PassRegistry &Registry = *PassRegistry::getPassRegistry();
+    initializeCore(Registry);
+    initializeAnalysis(Registry);
+    initializeTransformUtils(Registry);
+    initializeTarget(Registry);
+
+    cl::ParseCommandLineOptions(argc, argv, "resident optimizer for the MyLICMPass plugin\n");
+    for (unsigned i = 0; i < PluginLoader::getNumPlugins(); i++) {
+      Plugins.push_back(getRealPath(PluginLoader::getPlugin(i)));
+    }
+    collectPassOptions(argc, argv);
+    SetPassOutput = reinterpret_cast<SetPassOutputFn>(sys::DynamicLibrary::SearchForAddressOfSymbol("setPassOutput"));
+
+    std::string Path = SocketPath.empty() ? OptConnection::getDefaultSocketPath() : SocketPath.getValue();
+    int ListenFD = ExitOnErr(OptConnection::listen(Path, 128));
+
+    unsigned NumWorkers = Workers == 0 ? std::max(1u, hardware_concurrency().compute_thread_count()) : Workers;
+    errs() << "our-opt-server: listening on " << Path << " with " << NumWorkers << " workers\n";
+
+    std::mutex QueueMutex;
+    std::condition_variable QueueReady;
+    std::deque<std::unique_ptr<OptConnection>> Queue;
+
+    std::vector<std::thread> Threads;
+    for (unsigned i = 0; i < NumWorkers; i++) {
+      Threads.emplace_back([&]() {
+        WorkerState Worker;
+        while (true) {
+          std::unique_ptr<OptConnection> Connection;
+          {
+            std::unique_lock<std::mutex> Lock(QueueMutex);
+            QueueReady.wait(Lock, [&Queue]() { return !Queue.empty(); });
+            Connection = std::move(Queue.front());
+            Queue.pop_front();
+          }
+          serve(Worker, *Connection);
+        }
+      });
+    }
+
+    // Runs until it is killed. The socket is left behind, the next server replaces it (see
+    // OptConnection::listen).
+    while (true) {
+      std::unique_ptr<OptConnection> Connection = OptConnection::accept(ListenFD);
+      if (Connection == nullptr) {
+        continue;
+      }
+
+      std::lock_guard<std::mutex> Lock(QueueMutex);
+      Queue.push_back(std::move(Connection));
+      QueueReady.notify_one();
+    }
+}